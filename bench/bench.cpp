@@ -0,0 +1,1245 @@
+#include "astindex.hpp"
+#include "gen.hpp"
+#include "jit.hpp"
+#include "lexer.hpp"
+#include "grammar.hpp"
+#include "parser.hpp"
+#include "perfcount.hpp"
+#include "pipeline.hpp"
+#include "server.hpp"
+#include "tokensource.hpp"
+#include "tokfile.hpp"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+//// ALLOCATION COUNTING ////
+
+// Every allocation carries its size in a header so frees can update the
+// live total, which gives an exact peak rather than a sampled RSS.
+
+static std::atomic<size_t> g_allocated{0};
+static std::atomic<size_t> g_allocations{0};
+static std::atomic<size_t> g_live{0};
+static std::atomic<size_t> g_peak{0};
+
+static size_t const header = alignof(std::max_align_t);
+
+static void* counted_alloc(size_t size, size_t align)
+{
+    size_t const offset = std::max(header, align);
+    size_t const total = (size + offset + align - 1) / align * align;
+    void* p = std::aligned_alloc(align, total);
+
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+
+    *static_cast<size_t*>(p) = size;
+    g_allocated += size;
+    ++g_allocations;
+    size_t const live = g_live += size;
+    size_t peak = g_peak;
+
+    while (live > peak && !g_peak.compare_exchange_weak(peak, live))
+    {}
+
+    return static_cast<char*>(p) + offset;
+}
+
+static void counted_free(void* p, size_t align)
+{
+    if (p)
+    {
+        void* base = static_cast<char*>(p) - std::max(header, align);
+        g_live -= *static_cast<size_t*>(base);
+        std::free(base);
+    }
+}
+
+// pmr::new_delete_resource allocates through the aligned forms, so all four
+// families have to be replaced.
+
+void* operator new(size_t size)
+{
+    return counted_alloc(size, header);
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+    return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void operator delete(void* p) noexcept
+{
+    counted_free(p, header);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    counted_free(p, header);
+}
+
+void operator delete(void* p, std::align_val_t align) noexcept
+{
+    counted_free(p, static_cast<size_t>(align));
+}
+
+void operator delete(void* p, size_t, std::align_val_t align) noexcept
+{
+    counted_free(p, static_cast<size_t>(align));
+}
+
+//// PERF COUNTERS ////
+
+// With --perf_counters, parse benchmarks also report hardware counters per
+// token for each phase parse() records, and per sampled call of parse_func;
+// BM_phases adds lexing and printing. Benchmarks run on the main thread,
+// which is the one counted. Events the machine lacks are left out, and the
+// report's context says which opened.
+
+static std::unique_ptr<PerfCounters> g_perf;
+
+static void perf_counters(benchmark::State& state, string const& prefix, 
+    PerfSample const& total, double per, char const* unit)
+{
+    static PerfEvent const events[] = 
+    {
+        PerfEvent::cycles, PerfEvent::instructions, 
+        PerfEvent::branch_misses, PerfEvent::cache_misses, PerfEvent::task_clock,
+    };
+
+    for (PerfEvent e : events)
+    {
+        if (total.has(e))
+        {
+            string name = perf_event_name(e);
+            std::replace(name.begin(), name.end(), '-', '_');
+            state.counters[prefix + name + unit] = static_cast<double>(total[e]) / per;
+        }
+    }
+
+    if (total.has(PerfEvent::cycles) && total.has(PerfEvent::instructions) && total[PerfEvent::cycles])
+    {
+        state.counters[prefix + "ipc"] = static_cast<double>(total[PerfEvent::instructions]) 
+            / static_cast<double>(total[PerfEvent::cycles]);
+    }
+
+    state.counters[prefix + "wall_ns" + unit] = static_cast<double>(total.wall_ns) / per;
+}
+
+static void perf_report(benchmark::State& state, PerfReport const& report, double tokens)
+{
+    for (PerfReport::Entry const& e : report.phases)
+    {
+        perf_counters(state, e.name + "_", e.total, tokens, "/token");
+    }
+
+    for (PerfReport::Entry const& e : report.rules)
+    {
+        if (e.samples)
+        {
+            perf_counters(state, e.name + "_", e.total, static_cast<double>(e.samples), "/call");
+        }
+    }
+}
+
+static PerfReport new_perf_report()
+{
+    PerfReport report;
+    report.counters = g_perf.get();
+    PerfReport::Entry func;
+    func.name = "parse_func";
+    report.rules.push_back(func);
+    return report;
+}
+
+//// HARNESS ////
+
+static void run_parse(benchmark::State& state, vector<Tok> const& tokens, 
+    ParseOptions opts = ParseOptions(), bool must_succeed = true)
+{
+    size_t allocated = 0;
+    size_t peak = 0;
+    ParseStats stats;
+    opts.stats = &stats;
+    PerfReport perf = new_perf_report();
+    opts.perf = g_perf ? &perf : nullptr;
+
+    for (auto _ : state)
+    {
+        size_t const before = g_allocated;
+        size_t const base = g_live;
+        g_peak = base;
+
+        auto r = parse(tokens, opts);
+
+        allocated += g_allocated - before;
+        peak = std::max(peak, g_peak - base);
+
+        if (!r && must_succeed)
+        {
+            state.SkipWithError("parse failed");
+            break;
+        }
+
+        benchmark::DoNotOptimize(r);
+    }
+
+    double const toks = static_cast<double>(tokens.size());
+    double const iters = static_cast<double>(state.iterations());
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(tokens.size()));
+    state.counters["tokens"] = toks;
+    state.counters["bytes/token"] = static_cast<double>(allocated) / (toks * iters);
+    state.counters["peak_bytes"] = static_cast<double>(peak);
+    state.counters["steps/token"] = static_cast<double>(stats.steps) / toks;
+    state.counters["rewinds/token"] = static_cast<double>(stats.rewinds) / toks;
+    state.counters["memo_peak"] = static_cast<double>(stats.memo_peak);
+
+    // Where the bytes/token go, from the last iteration.
+    state.counters["memo_bytes/token"] = static_cast<double>(stats.memo.bytes) / toks;
+    state.counters["ast_bytes/token"] = static_cast<double>(stats.ast.bytes) / toks;
+    state.counters["trace_bytes/token"] = static_cast<double>(stats.tracer.bytes) / toks;
+
+    if (g_perf)
+    {
+        perf_report(state, perf, toks * iters);
+    }
+}
+
+static void BM_parse_program(benchmark::State& state)
+{
+    GenOptions opts;
+    opts.functions = static_cast<unsigned>(state.range(0));
+    opts.max_depth = static_cast<unsigned>(state.range(1));
+    run_parse(state, generate_program(opts));
+}
+
+static void BM_parse_deep_parens(benchmark::State& state)
+{
+    run_parse(state, generate_deep_parens(static_cast<unsigned>(state.range(0))));
+}
+
+static void BM_parse_operator_chain(benchmark::State& state)
+{
+    run_parse(state, generate_operator_chain(static_cast<unsigned>(state.range(0))));
+}
+
+static void BM_parse_logical_chain(benchmark::State& state)
+{
+    OpMix mix;
+    mix.add = mix.sub = mix.mul = mix.div = 0;
+    run_parse(state, generate_operator_chain(static_cast<unsigned>(state.range(0)), mix));
+}
+
+//// BACKTRACKING STRESS ////
+
+// Without memoization every paren level re-parses its contents once per
+// precedence level, so steps grow exponentially with depth. The budget turns
+// that into a prompt failure; packrat mode keeps steps/token flat.
+//
+// Each benchmark fails if steps/token goes over its budget, which leaves
+// about a quarter of headroom over what it measures at every size, as the
+// fuzz corpus budgets do. Unmemoized, the step cap itself must hold.
+
+static void run_stress(benchmark::State& state, vector<Tok> const& tokens, ParseOptions const& opts,
+    double steps_per_token_budget, bool must_succeed = true)
+{
+    run_parse(state, tokens, opts, must_succeed);
+
+    double const steps_per_token = state.counters["steps/token"];
+
+    if (steps_per_token > steps_per_token_budget)
+    {
+        state.SkipWithError(("steps/token " + std::to_string(steps_per_token) + " over budget "
+            + std::to_string(steps_per_token_budget)).c_str());
+    }
+}
+
+static void BM_stress_parens_unmemoized(benchmark::State& state)
+{
+    vector<Tok> const tokens = generate_deep_parens(static_cast<unsigned>(state.range(0)));
+    ParseOptions opts;
+    opts.memoize = false;
+    opts.max_steps = 1000 * tokens.size();
+    run_stress(state, tokens, opts, 1010, false);
+}
+
+static void BM_stress_parens_packrat(benchmark::State& state)
+{
+    ParseOptions opts;
+    opts.packrat = true;
+    run_stress(state, generate_deep_parens(static_cast<unsigned>(state.range(0))), opts, 17);
+}
+
+static void BM_stress_chain_packrat(benchmark::State& state)
+{
+    ParseOptions opts;
+    opts.packrat = true;
+    run_stress(state, generate_operator_chain(static_cast<unsigned>(state.range(0))), opts, 7);
+}
+
+static void BM_stress_program_packrat(benchmark::State& state)
+{
+    GenOptions gen;
+    gen.functions = static_cast<unsigned>(state.range(0));
+    ParseOptions opts;
+    opts.packrat = true;
+    run_stress(state, generate_program(gen), opts, 8.5);
+}
+
+BENCHMARK(BM_stress_parens_unmemoized)
+    ->DenseRange(2, 12, 2)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_stress_parens_packrat)
+    ->RangeMultiplier(4)->Range(4, 256)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_stress_chain_packrat)
+    ->RangeMultiplier(4)->Range(4, 1024)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_stress_program_packrat)
+    ->RangeMultiplier(4)->Range(1, 64)
+    ->Unit(benchmark::kMicrosecond);
+
+//// MEMO PLANS ////
+
+// Memoizes the rules the static grammar analysis picks, or the ones an
+// unmemoized profile of a smaller sample says pay for themselves.
+
+static void BM_plan_program_static(benchmark::State& state)
+{
+    static GrammarAnalysis const analysis = analyze_grammar();
+    GenOptions gen;
+    gen.functions = static_cast<unsigned>(state.range(0));
+    ParseOptions opts;
+    opts.memo_plan = &analysis.plan;
+    run_parse(state, generate_program(gen), opts);
+}
+
+static void BM_plan_program_profiled(benchmark::State& state)
+{
+    GenOptions sample;
+    sample.seed = 7;
+    sample.functions = 8;
+    static GrammarAnalysis const analysis = analyze_grammar(generate_program(sample));
+    GenOptions gen;
+    gen.functions = static_cast<unsigned>(state.range(0));
+    ParseOptions opts;
+    opts.memo_plan = &analysis.plan;
+    run_parse(state, generate_program(gen), opts);
+}
+
+BENCHMARK(BM_plan_program_static)
+    ->RangeMultiplier(4)->Range(1, 64)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_plan_program_profiled)
+    ->RangeMultiplier(4)->Range(1, 64)
+    ->Unit(benchmark::kMicrosecond);
+
+//// TOKEN FILES ////
+
+// Loading an encoded token file and parsing it, either rebuilding a
+// vector<Tok> first or parsing the view in place. Most allocations are the
+// AST's, so load_allocs/token counts those made before the parse begins.
+
+static void run_token_file(benchmark::State& state, bool in_place)
+{
+    GenOptions gen;
+    gen.functions = static_cast<unsigned>(state.range(0));
+    vector<Tok> const tokens = generate_program(gen);
+    string const bytes = *encode_tokens(tokens);
+    size_t allocations = 0;
+    size_t load_allocations = 0;
+
+    for (auto _ : state)
+    {
+        size_t const before = g_allocations;
+        optional<TokenView> view = decode_tokens(bytes);
+        optional<vector<Tok>> rebuilt;
+
+        if (!in_place)
+        {
+            rebuilt = view->to_tokens();
+        }
+
+        load_allocations += g_allocations - before;
+        Parsed<ASTPtr> r = in_place ? parse(*view) : parse(*rebuilt);
+        allocations += g_allocations - before;
+
+        if (!r)
+        {
+            state.SkipWithError("parse failed");
+            break;
+        }
+
+        benchmark::DoNotOptimize(r);
+    }
+
+    double const toks = static_cast<double>(tokens.size());
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(tokens.size()));
+    state.counters["file_bytes/token"] = static_cast<double>(bytes.size()) / toks;
+    state.counters["allocs/token"] = static_cast<double>(allocations) 
+        / (toks * static_cast<double>(state.iterations()));
+    state.counters["load_allocs/token"] = static_cast<double>(load_allocations) 
+        / (toks * static_cast<double>(state.iterations()));
+}
+
+static void BM_token_file_vector(benchmark::State& state)
+{
+    run_token_file(state, false);
+}
+
+static void BM_token_file_in_place(benchmark::State& state)
+{
+    run_token_file(state, true);
+}
+
+BENCHMARK(BM_token_file_vector)
+    ->RangeMultiplier(8)->Range(8, 512)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_token_file_in_place)
+    ->RangeMultiplier(8)->Range(8, 512)
+    ->Unit(benchmark::kMicrosecond);
+
+//// PRESCAN ////
+
+// Inputs with one defect near the end, so the parser gets through nearly
+// all of them before failing: range(0) picks it, none, a stray '*' before
+// the last ';', or deep parens missing their last ')'. range(1) turns on
+// the prescan, which turns them away in one pass over the token kinds.
+
+static vector<Tok> prescan_input(int64_t defect)
+{
+    if (defect == 2)
+    {
+        vector<Tok> tokens = generate_deep_parens(256);
+        auto last = std::find_if(tokens.rbegin(), tokens.rend(), 
+            [](Tok const& t) { return std::holds_alternative<RParTok>(t); });
+        tokens.erase(std::next(last).base());
+        return tokens;
+    }
+
+    GenOptions gen;
+    gen.functions = 64;
+    vector<Tok> tokens = generate_program(gen);
+
+    if (defect == 1)
+    {
+        auto last = std::find_if(tokens.rbegin(), tokens.rend(), 
+            [](Tok const& t) { return std::holds_alternative<SemiTok>(t); });
+        tokens.insert(std::next(last).base(), MulTok{});
+    }
+
+    return tokens;
+}
+
+static void BM_prescan(benchmark::State& state)
+{
+    ParseOptions opts;
+    opts.prescan = state.range(1) != 0;
+    run_parse(state, prescan_input(state.range(0)), opts, state.range(0) == 0);
+}
+
+BENCHMARK(BM_prescan)
+    ->ArgsProduct({{0, 1, 2}, {0, 1}})
+    ->Unit(benchmark::kMicrosecond);
+
+//// STREAMING ////
+
+// Produces a program one generated function at a time, so the whole input
+// never exists in memory.
+class GeneratedSource : public TokenSource
+{
+    public:
+        GeneratedSource(unsigned functions)
+            : _left(functions)
+        {}
+
+        size_t read(vector<Tok>& out, size_t max)
+        {
+            while (_buffer.size() - _next < max && _left > 0)
+            {
+                GenOptions opts;
+                opts.seed = _left--;
+                opts.functions = 1;
+                _buffer.erase(_buffer.begin(), _buffer.begin() + static_cast<ptrdiff_t>(_next));
+                _next = 0;
+                vector<Tok> f = generate_program(opts);
+                _buffer.insert(_buffer.end(), f.begin(), f.end());
+            }
+
+            size_t const n = std::min(max, _buffer.size() - _next);
+            auto const first = _buffer.begin() + static_cast<ptrdiff_t>(_next);
+            out.insert(out.end(), first, first + static_cast<ptrdiff_t>(n));
+            _next += n;
+            tokens += n;
+            return n;
+        }
+
+        size_t tokens = 0;
+
+    private:
+        unsigned    _left;
+        vector<Tok> _buffer;
+        size_t      _next = 0;
+};
+
+static void BM_stream_program(benchmark::State& state)
+{
+    size_t peak = 0;
+    size_t tokens = 0;
+
+    for (auto _ : state)
+    {
+        GeneratedSource source(static_cast<unsigned>(state.range(0)));
+        size_t const base = g_live;
+        g_peak = base;
+
+        bool const ok = parse_stream(source, [](shared_ptr<ASTFunc> const& f)
+        {
+            benchmark::DoNotOptimize(f);
+        });
+
+        peak = std::max(peak, g_peak - base);
+        tokens = source.tokens;
+
+        if (!ok)
+        {
+            state.SkipWithError("parse failed");
+            break;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(tokens));
+    state.counters["tokens"] = static_cast<double>(tokens);
+    state.counters["peak_bytes"] = static_cast<double>(peak);
+}
+
+BENCHMARK(BM_stream_program)
+    ->RangeMultiplier(8)->Range(8, 4096)
+    ->Unit(benchmark::kMillisecond);
+
+//// SERVER ////
+
+// Round trips to a warm ParseServer for small one-function programs, as a
+// build tool would send them: every request answered from the cache, or
+// with the cache off so each is lexed and parsed.
+
+static void run_server(benchmark::State& state, size_t cache_bytes)
+{
+    ServerOptions opts;
+    opts.socket_path = "/tmp/prs_bench." + std::to_string(getpid()) + ".sock";
+    opts.threads = 1;
+    opts.cache_bytes = cache_bytes;
+
+    ParseServer server(opts);
+    string error;
+
+    if (!server.start(&error))
+    {
+        state.SkipWithError(error.c_str());
+        return;
+    }
+
+    std::thread serving([&]() { server.run(); });
+    unique_ptr<ParseClient> client = ParseClient::connect(opts.socket_path, &error);
+
+    GenOptions gen;
+    gen.functions = 1;
+    gen.max_stmts = static_cast<unsigned>(state.range(0));
+    string const text = to_string(generate_program(gen));
+
+    for (auto _ : state)
+    {
+        optional<ServerReply> reply = client ? client->request(ServerRequest::text, text, &error) : std::nullopt;
+
+        if (!reply || reply->status != ServerStatus::ok)
+        {
+            state.SkipWithError(reply ? reply->body.c_str() : error.c_str());
+            break;
+        }
+
+        benchmark::DoNotOptimize(reply);
+    }
+
+    client.reset();
+    server.stop();
+    serving.join();
+    state.counters["request_bytes"] = static_cast<double>(text.size());
+}
+
+static void BM_server_cached(benchmark::State& state)
+{
+    run_server(state, 64 << 20);
+}
+
+static void BM_server_uncached(benchmark::State& state)
+{
+    run_server(state, 0);
+}
+
+BENCHMARK(BM_server_cached)
+    ->Arg(4)->Arg(32)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_server_uncached)
+    ->Arg(4)->Arg(32)
+    ->Unit(benchmark::kMicrosecond);
+
+//// QUERIES ////
+
+// "Functions that assign to a0" and "divisions by a variable" over many
+// programs, by walking every tree or from an ASTIndex. The walk is also the
+// reference the index's answers are checked against.
+
+static vector<ASTPtr> const& query_programs()
+{
+    static vector<ASTPtr> const programs = []()
+    {
+        vector<ASTPtr> out;
+
+        for (unsigned seed = 1; seed <= 1000; ++seed)
+        {
+            GenOptions gen;
+            gen.seed = seed;
+            gen.functions = 4;
+            out.push_back(std::get<0>(*parse(generate_program(gen))));
+        }
+
+        return out;
+    }();
+
+    return programs;
+}
+
+struct WalkResult
+{
+    vector<AST const*> funcs;
+    vector<AST const*> divisions;
+};
+
+static bool walk(AST const& ast, WalkResult& out)
+{
+    bool assigns = false;
+
+    switch (ast.kind())
+    {
+        case ASTKind::binop:
+        {
+            auto const& b = static_cast<ASTBinop const&>(ast);
+
+            if (b.op == Op::opDiv && b.right->kind() == ASTKind::var)
+            {
+                out.divisions.push_back(&ast);
+            }
+
+            walk(*b.left, out);
+            walk(*b.right, out);
+            break;
+        }
+
+        case ASTKind::unop:
+            walk(*static_cast<ASTUnop const&>(ast).right, out);
+            break;
+
+        case ASTKind::block:
+            for (ASTPtr const& stmt : static_cast<ASTBlock const&>(ast).stmts)
+            {
+                assigns |= walk(*stmt, out);
+            }
+            break;
+
+        case ASTKind::var_decl:
+        {
+            auto const& d = static_cast<ASTVarDecl const&>(ast);
+            assigns = d.name == "a0";
+            walk(*d.value, out);
+            break;
+        }
+
+        case ASTKind::assign:
+        {
+            auto const& a = static_cast<ASTAssign const&>(ast);
+            assigns = a.name == "a0";
+            walk(*a.value, out);
+            break;
+        }
+
+        case ASTKind::func:
+            if (walk(*static_cast<ASTFunc const&>(ast).body, out))
+            {
+                out.funcs.push_back(&ast);
+            }
+            break;
+
+        case ASTKind::program:
+            for (ASTPtr const& d : static_cast<ASTProgram const&>(ast).decls)
+            {
+                walk(*d, out);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return assigns;
+}
+
+static WalkResult query_by_walk(vector<ASTPtr> const& programs)
+{
+    WalkResult out;
+
+    for (ASTPtr const& p : programs)
+    {
+        walk(*p, out);
+    }
+
+    return out;
+}
+
+static WalkResult query_by_index(ASTIndex const& index)
+{
+    WalkResult out;
+
+    for (uint32_t id : index.funcs_assigning("a0"))
+    {
+        out.funcs.push_back(index.node(id).node);
+    }
+
+    for (uint32_t id : index.binops_with_right(Op::opDiv, ASTKind::var))
+    {
+        out.divisions.push_back(index.node(id).node);
+    }
+
+    return out;
+}
+
+static void BM_query_walk(benchmark::State& state)
+{
+    vector<ASTPtr> const& programs = query_programs();
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(query_by_walk(programs));
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(programs.size()));
+}
+
+static void BM_query_index(benchmark::State& state)
+{
+    vector<ASTPtr> const& programs = query_programs();
+
+    // Built per file and merged, as across a build.
+    ASTIndex index;
+
+    for (ASTPtr const& p : programs)
+    {
+        ASTIndex file;
+        file.add(p);
+        index.merge(file);
+    }
+
+    WalkResult const expected = query_by_walk(programs);
+    WalkResult const got = query_by_index(index);
+
+    if (got.funcs != expected.funcs || got.divisions != expected.divisions)
+    {
+        state.SkipWithError("index disagrees with the walk");
+        return;
+    }
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(query_by_index(index));
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(programs.size()));
+    state.counters["nodes"] = static_cast<double>(index.node_count());
+    state.counters["matches"] = static_cast<double>(got.funcs.size() + got.divisions.size());
+}
+
+static void BM_index_build(benchmark::State& state)
+{
+    vector<ASTPtr> const& programs = query_programs();
+
+    for (auto _ : state)
+    {
+        ASTIndex index;
+
+        for (ASTPtr const& p : programs)
+        {
+            index.add(p);
+        }
+
+        benchmark::DoNotOptimize(index);
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(programs.size()));
+}
+
+BENCHMARK(BM_query_walk)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_query_index)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_index_build)->Unit(benchmark::kMillisecond);
+
+//// EXPRESSIONS ////
+
+// Random trees over every Op, eight variables and constants that include
+// the edge cases for division, evaluated by the JIT and by the interpreter.
+
+static vector<string> const expr_vars = {"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7"};
+
+static ASTPtr random_expr(std::mt19937& rng, unsigned depth)
+{
+    auto below = [&](unsigned n) { return std::uniform_int_distribution<unsigned>(0, n - 1)(rng); };
+
+    if (depth == 0 || below(4) == 0)
+    {
+        static int const constants[] = {0, 1, -1, 2, 7, 100, INT_MAX, INT_MIN};
+
+        if (below(2) == 0)
+        {
+            return std::make_shared<ASTNum>(constants[below(8)]);
+        }
+
+        return std::make_shared<ASTVar>(expr_vars[below(8)]);
+    }
+
+    static Op const ops[] = {Op::opAdd, Op::opSub, Op::opMul, Op::opDiv, Op::opAnd, Op::opOr, Op::opNot, Op::opNeg};
+    Op const op = ops[below(8)];
+
+    if (op == Op::opNot || op == Op::opNeg)
+    {
+        return std::make_shared<ASTUnop>(op, random_expr(rng, depth - 1));
+    }
+
+    ASTPtr left = random_expr(rng, depth - 1);
+    return std::make_shared<ASTBinop>(std::move(left), op, random_expr(rng, depth - 1));
+}
+
+static vector<int> random_vars(std::mt19937& rng)
+{
+    static int const values[] = {0, 1, -1, 3, -5, 1000, INT_MAX, INT_MIN};
+    vector<int> vars;
+
+    for (size_t i = 0; i < expr_vars.size(); ++i)
+    {
+        vars.push_back(rng() % 2 ? values[rng() % 8] : static_cast<int>(rng()));
+    }
+
+    return vars;
+}
+
+// Every native result must equal the interpreter's; returns the first
+// expression that disagrees, or an empty string.
+static string check_jit(size_t exprs, size_t* native)
+{
+    std::mt19937 rng(42);
+
+    for (size_t e = 0; e < exprs; ++e)
+    {
+        ASTPtr const ast = random_expr(rng, 1 + e % 10);
+        unique_ptr<CompiledExpr> const c = CompiledExpr::compile(*ast, expr_vars);
+        *native += c->native();
+
+        for (int i = 0; i < 32; ++i)
+        {
+            vector<int> const vars = random_vars(rng);
+
+            if ((*c)(vars.data()) != c->interpret(vars.data()))
+            {
+                return ast->to_string();
+            }
+        }
+    }
+
+    return "";
+}
+
+static void run_expr(benchmark::State& state, bool jit)
+{
+    size_t const exprs = 2000;
+    size_t native = 0;
+
+    if (jit)
+    {
+        string const bad = check_jit(exprs, &native);
+
+        if (!bad.empty())
+        {
+            state.SkipWithError(("JIT disagrees with the interpreter on " + bad).c_str());
+            return;
+        }
+    }
+
+    std::mt19937 rng(7);
+    vector<unique_ptr<CompiledExpr>> compiled;
+    size_t nodes = 0;
+
+    for (int i = 0; i < 64; ++i)
+    {
+        compiled.push_back(CompiledExpr::compile(*random_expr(rng, static_cast<unsigned>(state.range(0))), expr_vars, nullptr, jit));
+        nodes += compiled.back()->program().size();
+    }
+
+    vector<int> const vars = random_vars(rng);
+
+    for (auto _ : state)
+    {
+        for (unique_ptr<CompiledExpr> const& c : compiled)
+        {
+            benchmark::DoNotOptimize((*c)(vars.data()));
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(nodes));
+
+    if (jit)
+    {
+        state.counters["native"] = static_cast<double>(native) / static_cast<double>(exprs);
+    }
+}
+
+static void BM_expr_interpreted(benchmark::State& state)
+{
+    run_expr(state, false);
+}
+
+static void BM_expr_jit(benchmark::State& state)
+{
+    run_expr(state, true);
+}
+
+BENCHMARK(BM_expr_interpreted)
+    ->DenseRange(2, 8, 3)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_expr_jit)
+    ->DenseRange(2, 8, 3)
+    ->Unit(benchmark::kMicrosecond);
+
+//// LEXING ////
+
+// A generated source of about 16 MiB, one function per line, lexed on one
+// thread or in chunks on a pool of state.range(0) threads.
+
+static string const& lex_text()
+{
+    static string const text = []()
+    {
+        string out;
+
+        for (unsigned seed = 1; out.size() < (16u << 20); ++seed)
+        {
+            GenOptions gen;
+            gen.seed = seed;
+            gen.functions = 1;
+            out += to_string(generate_program(gen)) + "\n";
+        }
+
+        return out;
+    }();
+
+    return text;
+}
+
+static void BM_lex_serial(benchmark::State& state)
+{
+    string const& text = lex_text();
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(lex(text));
+    }
+
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(text.size()));
+}
+
+static void BM_lex_parallel(benchmark::State& state)
+{
+    string const& text = lex_text();
+    ThreadPool pool(static_cast<unsigned>(state.range(0)));
+
+    // Same tokens and offsets as lex(), and they parse.
+    vector<uint32_t> serial_offsets, chunk_offsets;
+    vector<Tok> const serial = *lex(text, &serial_offsets);
+    vector<vector<Tok>> chunks = *lex_parallel(text, pool, &chunk_offsets);
+    vector<Tok> joined;
+
+    for (vector<Tok> const& c : chunks)
+    {
+        joined.insert(joined.end(), c.begin(), c.end());
+    }
+
+    ChunkedTokenSource source(std::move(chunks));
+    size_t funcs = 0;
+    bool const parsed = parse_stream(source, [&](shared_ptr<ASTFunc> const&) { ++funcs; });
+
+    if (to_string(joined) != to_string(serial) || chunk_offsets != serial_offsets || !parsed)
+    {
+        state.SkipWithError("chunked lexing differs from lex()");
+        return;
+    }
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(lex_parallel(text, pool));
+    }
+
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(text.size()));
+    state.counters["threads"] = static_cast<double>(pool.size());
+}
+
+BENCHMARK(BM_lex_serial)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK(BM_lex_parallel)
+    ->RangeMultiplier(2)->Range(1, 16)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+//// INGESTION ////
+
+// 256 generated files on disk, each read, lexed, parsed and its AST written
+// back: one after another, or through the pipeline with io_uring or with
+// threaded I/O (state.range(0)).
+
+static string ingest_dir()
+{
+    return "/tmp/prs_bench_ingest." + std::to_string(getpid());
+}
+
+static void remove_ingest_dir()
+{
+    std::error_code ec;
+    std::filesystem::remove_all(ingest_dir(), ec);
+}
+
+static vector<string> const& ingest_inputs()
+{
+    static vector<string> const inputs = []()
+    {
+        string const dir = ingest_dir();
+        std::filesystem::create_directories(dir + "/in");
+        std::atexit(remove_ingest_dir);
+        vector<string> out;
+
+        for (unsigned i = 0; i < 256; ++i)
+        {
+            GenOptions gen;
+            gen.seed = i + 1;
+            gen.functions = 16;
+            out.push_back(dir + "/in/f" + std::to_string(i) + ".prs");
+            std::ofstream(out.back()) << to_string(generate_program(gen)) << "\n";
+        }
+
+        return out;
+    }();
+
+    return inputs;
+}
+
+static string ingest_output_dir()
+{
+    return ingest_dir() + "/out";
+}
+
+static void BM_ingest_sequential(benchmark::State& state)
+{
+    vector<string> const& inputs = ingest_inputs();
+    string const out = ingest_output_dir();
+    std::filesystem::create_directories(out);
+
+    for (auto _ : state)
+    {
+        for (string const& path : inputs)
+        {
+            std::ifstream in(path);
+            string const text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            Parsed<ASTPtr> r = parse(*lex(text));
+            string const name = std::filesystem::path(path).filename().string();
+            std::ofstream(out + "/" + name + ".ast") << std::get<0>(*r)->to_string();
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(inputs.size()));
+}
+
+static void BM_ingest_pipeline(benchmark::State& state)
+{
+    PipelineOptions opts;
+    opts.inputs = ingest_inputs();
+    opts.output_dir = ingest_output_dir();
+    opts.use_io_uring = state.range(0) != 0;
+    PipelineStats stats;
+
+    for (auto _ : state)
+    {
+        stats = run_pipeline(opts);
+
+        if (stats.failed || stats.ok != opts.inputs.size())
+        {
+            state.SkipWithError("pipeline failed");
+            break;
+        }
+    }
+
+    auto util = [&](StageStats const& s)
+    {
+        return static_cast<double>(s.busy_ns) / static_cast<double>(stats.wall_ns * std::max(1u, s.threads));
+    };
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(opts.inputs.size()));
+    state.counters["io_uring"] = stats.io_uring;
+    state.counters["lex_util"] = util(stats.lex);
+    state.counters["parse_util"] = util(stats.parse);
+    state.counters["lex_queue_depth"] = stats.lex_parse.mean_depth;
+}
+
+BENCHMARK(BM_ingest_sequential)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK(BM_ingest_pipeline)
+    ->Arg(0)->Arg(1)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+//// PHASES ////
+
+// Lexes a generated program of range(0) functions, parses it with a trace,
+// and prints the AST, with counters for each phase. Registered by main()
+// only with --perf_counters.
+
+static void BM_phases(benchmark::State& state)
+{
+    GenOptions gen;
+    gen.functions = static_cast<unsigned>(state.range(0));
+    string const text = to_string(generate_program(gen));
+
+    PerfReport perf = new_perf_report();
+    ParseOptions opts;
+    opts.perf = &perf;
+    size_t tokens = 0;
+
+    for (auto _ : state)
+    {
+        PerfSample start = g_perf->read();
+        optional<vector<Tok>> lexed = lex(text);
+        perf.add("lex", g_perf->read() - start);
+
+        std::ostringstream trace;
+        opts.trace = &trace;
+        Parsed<ASTPtr> r = parse(*lexed, opts);
+
+        if (!r)
+        {
+            state.SkipWithError("parse failed");
+            break;
+        }
+
+        start = g_perf->read();
+        string printed = std::get<0>(*r)->to_string();
+        perf.add("print", g_perf->read() - start);
+
+        benchmark::DoNotOptimize(printed);
+        tokens = lexed->size();
+    }
+
+    double const toks = static_cast<double>(tokens);
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(tokens));
+    state.counters["tokens"] = toks;
+    perf_report(state, perf, toks * static_cast<double>(state.iterations()));
+}
+
+//// THROUGHPUT ////
+
+BENCHMARK(BM_parse_program)
+    ->ArgsProduct({{1, 8, 64}, {2, 4, 6}})
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_parse_deep_parens)
+    ->RangeMultiplier(4)->Range(4, 256)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_parse_operator_chain)
+    ->RangeMultiplier(4)->Range(4, 1024)
+    ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK(BM_parse_logical_chain)
+    ->RangeMultiplier(4)->Range(4, 1024)
+    ->Unit(benchmark::kMicrosecond);
+
+// As BENCHMARK_MAIN(), plus --perf_counters; see PERF COUNTERS above. With
+// --benchmark_out=<file> --benchmark_out_format=json the counters land in
+// a machine-readable report beside the timings.
+int main(int argc, char** argv)
+{
+    vector<char*> args;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (string(argv[i]) == "--perf_counters")
+        {
+            g_perf = std::make_unique<PerfCounters>();
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (g_perf)
+    {
+        string events;
+
+        for (size_t e = 0; e < perf_event_count; ++e)
+        {
+            if (g_perf->available() & (1u << e))
+            {
+                events += (events.empty() ? "" : " ") + string(perf_event_name(static_cast<PerfEvent>(e)));
+            }
+        }
+
+        benchmark::AddCustomContext("perf_events", events.empty() ? "none" : events);
+
+        if (!g_perf->error().empty())
+        {
+            benchmark::AddCustomContext("perf_missing", g_perf->error());
+        }
+
+        benchmark::RegisterBenchmark("BM_phases", BM_phases)
+            ->Arg(8)->Arg(64)
+            ->Unit(benchmark::kMillisecond);
+    }
+
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+    {
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
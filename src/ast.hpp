@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <memory>
@@ -8,7 +9,24 @@ using std::string;
 using std::vector;
 using std::shared_ptr;
 
-enum class Op { opAdd, opSub, opMul, opDiv, opAnd, opOr, opNot, opNeg };
+enum class Op : uint8_t { opAdd, opSub, opMul, opDiv, opAnd, opOr, opNot, opNeg };
+
+enum class ASTKind : uint8_t
+{ 
+    num, 
+    var, 
+    binop, 
+    unop, 
+    block, 
+    var_decl, 
+    assign, 
+    func, 
+    program,
+    error
+};
+
+// Slot of a binding that has not been (or could not be) resolved.
+unsigned const no_slot = ~0u;
 
 struct Arg
 {
@@ -46,17 +64,36 @@ string to_string(Op op)
     std::abort();
 }
 
+// Token indices [begin, end) of the input a node was parsed from. A node
+// always covers a token, so end == 0 means it was never set. SourceMap turns
+// token indices into lines and columns.
+struct Span
+{
+    uint32_t begin = 0;
+    uint32_t end   = 0;
+};
+
 struct AST
 {
+    Span span;
+
     virtual ~AST() {}
+    virtual ASTKind kind() const = 0;
     virtual string to_string() const = 0;
 };
 
 using ASTPtr = shared_ptr<AST>;
 
+// The parser builds operator chains by iteration, so they can be far deeper
+// than the native stack. Binop and unop nodes are printed and torn down with
+// an explicit stack rather than by recursion.
+string operator_string(AST const&);
+void release_operands(ASTPtr&, ASTPtr&);
+
 struct ASTNum : AST
 {
     int value;
+    ASTKind kind() const { return ASTKind::num; }
     string to_string() const { return std::to_string(value); }
     ASTNum(int _value) : value(_value) {}
 };
@@ -64,6 +101,8 @@ struct ASTNum : AST
 struct ASTVar : AST
 {
     string value;
+    unsigned slot = no_slot;
+    ASTKind kind() const { return ASTKind::var; }
     string to_string() const { return value; }
     ASTVar(string _value) : value(_value) {}
 };
@@ -73,35 +112,33 @@ struct ASTBinop : AST
     ASTPtr left;
     Op op;
     ASTPtr right;
+    ASTKind kind() const { return ASTKind::binop; }
     ASTBinop(ASTPtr _left, Op _op, ASTPtr _right) 
         : left(std::move(_left))
         , op(_op)
         , right(std::move(_right)) 
     {}
-    string to_string() const 
-    { 
-        return "(" + left->to_string() 
-            + ::to_string(op) + right->to_string() + ")"; 
-    }
+    ~ASTBinop() { release_operands(left, right); }
+    string to_string() const { return operator_string(*this); }
 };
 
 struct ASTUnop : AST
 {
     Op op;
     ASTPtr right;
+    ASTKind kind() const { return ASTKind::unop; }
     ASTUnop(Op _op, ASTPtr _right) 
         : op(_op)
         , right(std::move(_right)) 
     {}
-    string to_string() const 
-    { 
-        return "(" + ::to_string(op) + right->to_string() + ")"; 
-    }
+    ~ASTUnop() { ASTPtr none; release_operands(none, right); }
+    string to_string() const { return operator_string(*this); }
 };
 
 struct ASTBlock :  AST
 {
     vector<ASTPtr> stmts;
+    ASTKind kind() const { return ASTKind::block; }
     ASTBlock(vector<ASTPtr> _stmts)
         : stmts(std::move(_stmts))
     {}
@@ -121,6 +158,8 @@ struct ASTVarDecl : AST
     string type;
     string name;
     ASTPtr value;
+    unsigned slot = no_slot;
+    ASTKind kind() const { return ASTKind::var_decl; }
     ASTVarDecl(string _type, string _name, ASTPtr _value)
         : type(_type)
         , name(_name)
@@ -136,6 +175,8 @@ struct ASTAssign : AST
 {
     string name;
     ASTPtr value;
+    unsigned slot = no_slot;
+    ASTKind kind() const { return ASTKind::assign; }
     ASTAssign(string _name, ASTPtr _value)
         : name(_name)
         , value(std::move(_value))
@@ -152,6 +193,8 @@ struct ASTFunc : AST
     string name;
     vector<Arg> args;
     ASTPtr body;
+    unsigned num_slots = 0; // Args take slots [0, args.size()), then locals.
+    ASTKind kind() const { return ASTKind::func; }
     ASTFunc(string _ret_type, string _name, vector<Arg> _args, ASTPtr _body)
         : ret_type(std::move(_ret_type))
         , name(std::move(_name))
@@ -169,9 +212,22 @@ struct ASTFunc : AST
     }
 };
 
+// Stands in for input skipped while recovering from a syntax error; the
+// diagnostic itself goes to ParseOptions::errors.
+struct ASTError : AST
+{
+    string message;
+    ASTKind kind() const { return ASTKind::error; }
+    string to_string() const { return "<error>"; }
+    ASTError(string _message)
+        : message(std::move(_message))
+    {}
+};
+
 struct ASTProgram : AST
 {
     vector<ASTPtr> decls;
+    ASTKind kind() const { return ASTKind::program; }
     ASTProgram(vector<ASTPtr> _decls)
         : decls(std::move(_decls))
     {}
@@ -186,3 +242,93 @@ struct ASTProgram : AST
         return s;
     }
 };
+
+inline
+string operator_string(AST const& root)
+{
+    // A pending item is either a node to expand or text to emit.
+    struct Item
+    {
+        AST const* node;
+        string     text;
+    };
+
+    string s;
+    vector<Item> pending{{&root, ""}};
+
+    while (!pending.empty())
+    {
+        Item item = std::move(pending.back());
+        pending.pop_back();
+
+        if (!item.node)
+        {
+            s += item.text;
+            continue;
+        }
+
+        switch (item.node->kind())
+        {
+            case ASTKind::binop:
+            {
+                auto const& b = static_cast<ASTBinop const&>(*item.node);
+                s += "(";
+                pending.push_back({nullptr, ")"});
+                pending.push_back({b.right.get(), ""});
+                pending.push_back({nullptr, ::to_string(b.op)});
+                pending.push_back({b.left.get(), ""});
+                break;
+            }
+            case ASTKind::unop:
+            {
+                auto const& u = static_cast<ASTUnop const&>(*item.node);
+                s += "(" + ::to_string(u.op);
+                pending.push_back({nullptr, ")"});
+                pending.push_back({u.right.get(), ""});
+                break;
+            }
+            default:
+                s += item.node->to_string();
+                break;
+        }
+    }
+
+    return s;
+}
+
+// Takes over the operands of every binop and unop this node solely owns
+// before they die, so each destructor finds its own operands already gone.
+inline
+void release_operands(ASTPtr& left, ASTPtr& right)
+{
+    if (!left && !right)
+    {
+        return;
+    }
+
+    vector<ASTPtr> pending;
+    pending.push_back(std::move(left));
+    pending.push_back(std::move(right));
+
+    while (!pending.empty())
+    {
+        ASTPtr node = std::move(pending.back());
+        pending.pop_back();
+
+        if (!node || node.use_count() != 1)
+        {
+            continue;
+        }
+
+        if (node->kind() == ASTKind::binop)
+        {
+            auto& b = static_cast<ASTBinop&>(*node);
+            pending.push_back(std::move(b.left));
+            pending.push_back(std::move(b.right));
+        }
+        else if (node->kind() == ASTKind::unop)
+        {
+            pending.push_back(std::move(static_cast<ASTUnop&>(*node).right));
+        }
+    }
+}
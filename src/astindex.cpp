@@ -0,0 +1,347 @@
+#include "astindex.hpp"
+#include <algorithm>
+#include <iterator>
+
+static size_t const kind_count = static_cast<size_t>(ASTKind::error) + 1;
+static size_t const op_count = static_cast<size_t>(Op::opNeg) + 1;
+
+static Postings const no_postings;
+
+uint32_t ASTIndex::add(ASTPtr const& program)
+{
+    if (_kinds.empty())
+    {
+        _kinds.resize(kind_count);
+        _ops.resize(op_count);
+    }
+
+    uint32_t const number = static_cast<uint32_t>(_programs.size());
+    _programs.push_back(program);
+    _program_begin.push_back(static_cast<uint32_t>(_nodes.size()));
+    visit(*program, number);
+    return number;
+}
+
+// Pre-order over an explicit stack, since operator chains can be deeper
+// than the native one. Children are pushed last to first so that they are
+// numbered in order.
+void ASTIndex::visit(AST const& root, uint32_t program)
+{
+    struct Pending
+    {
+        AST const* node;
+        uint32_t   func;
+        uint32_t   parent;
+        uint32_t   child;
+    };
+
+    vector<Pending> pending{{&root, no_node, no_node, 0}};
+
+    auto push_children = [&pending](vector<ASTPtr> const& children, uint32_t func, uint32_t id)
+    {
+        for (size_t i = children.size(); i-- > 0;)
+        {
+            pending.push_back({children[i].get(), func, id, static_cast<uint32_t>(i)});
+        }
+    };
+
+    while (!pending.empty())
+    {
+        Pending const p = pending.back();
+        pending.pop_back();
+
+        AST const& ast = *p.node;
+        uint32_t const id = static_cast<uint32_t>(_nodes.size());
+        ASTKind const kind = ast.kind();
+        uint32_t const func = kind == ASTKind::func ? id : p.func;
+        Op op = Op::opAdd;
+        ASTKind right = ASTKind::error;
+
+        switch (kind)
+        {
+            case ASTKind::binop:
+                op = static_cast<ASTBinop const&>(ast).op;
+                right = static_cast<ASTBinop const&>(ast).right->kind();
+                break;
+
+            case ASTKind::unop:
+                op = static_cast<ASTUnop const&>(ast).op;
+                right = static_cast<ASTUnop const&>(ast).right->kind();
+                break;
+
+            default:
+                break;
+        }
+
+        _nodes.push_back({&ast, program, func, p.parent, p.child, kind, op, right});
+        _kinds[static_cast<size_t>(kind)].push_back(id);
+
+        switch (kind)
+        {
+            case ASTKind::num:
+            case ASTKind::error:
+                break;
+
+            case ASTKind::var:
+                post_name(static_cast<ASTVar const&>(ast).value, id);
+                break;
+
+            case ASTKind::binop:
+            {
+                auto const& b = static_cast<ASTBinop const&>(ast);
+                _ops[static_cast<size_t>(b.op)].push_back(id);
+                pending.push_back({b.right.get(), func, id, 1});
+                pending.push_back({b.left.get(), func, id, 0});
+                break;
+            }
+
+            case ASTKind::unop:
+            {
+                auto const& u = static_cast<ASTUnop const&>(ast);
+                _ops[static_cast<size_t>(u.op)].push_back(id);
+                pending.push_back({u.right.get(), func, id, 1});
+                break;
+            }
+
+            case ASTKind::block:
+                push_children(static_cast<ASTBlock const&>(ast).stmts, func, id);
+                break;
+
+            case ASTKind::var_decl:
+            {
+                auto const& d = static_cast<ASTVarDecl const&>(ast);
+                post_name(d.name, id);
+                _assigned[d.name].push_back(id);
+                pending.push_back({d.value.get(), func, id, 0});
+                break;
+            }
+
+            case ASTKind::assign:
+            {
+                auto const& a = static_cast<ASTAssign const&>(ast);
+                post_name(a.name, id);
+                _assigned[a.name].push_back(id);
+                pending.push_back({a.value.get(), func, id, 0});
+                break;
+            }
+
+            case ASTKind::func:
+            {
+                auto const& f = static_cast<ASTFunc const&>(ast);
+                post_name(f.name, id);
+
+                for (Arg const& a : f.args)
+                {
+                    post_name(a.name, id);
+                }
+
+                pending.push_back({f.body.get(), func, id, 0});
+                break;
+            }
+
+            case ASTKind::program:
+                push_children(static_cast<ASTProgram const&>(ast).decls, func, id);
+                break;
+        }
+    }
+}
+
+// A function may name the same argument twice, or after itself.
+void ASTIndex::post_name(string const& name, uint32_t id)
+{
+    Postings& list = _names[name];
+
+    if (list.empty() || list.back() != id)
+    {
+        list.push_back(id);
+    }
+}
+
+void ASTIndex::merge(ASTIndex const& other)
+{
+    if (&other == this)
+    {
+        ASTIndex const copy = other;
+        merge(copy);
+        return;
+    }
+
+    if (_kinds.empty())
+    {
+        _kinds.resize(kind_count);
+        _ops.resize(op_count);
+    }
+
+    uint32_t const programs = static_cast<uint32_t>(_programs.size());
+    uint32_t const base = static_cast<uint32_t>(_nodes.size());
+
+    auto shift = [base](uint32_t id) { return id == no_node ? no_node : id + base; };
+
+    auto append = [&](Postings& to, Postings const& from)
+    {
+        to.reserve(to.size() + from.size());
+
+        for (uint32_t id : from)
+        {
+            to.push_back(id + base);
+        }
+    };
+
+    _programs.insert(_programs.end(), other._programs.begin(), other._programs.end());
+
+    for (uint32_t begin : other._program_begin)
+    {
+        _program_begin.push_back(begin + base);
+    }
+
+    for (IndexedNode n : other._nodes)
+    {
+        n.program += programs;
+        n.func = shift(n.func);
+        n.parent = shift(n.parent);
+        _nodes.push_back(n);
+    }
+
+    for (size_t i = 0; i < other._kinds.size(); ++i)
+    {
+        append(_kinds[i], other._kinds[i]);
+    }
+
+    for (size_t i = 0; i < other._ops.size(); ++i)
+    {
+        append(_ops[i], other._ops[i]);
+    }
+
+    for (auto const& [name, list] : other._names)
+    {
+        append(_names[name], list);
+    }
+
+    for (auto const& [name, list] : other._assigned)
+    {
+        append(_assigned[name], list);
+    }
+}
+
+size_t ASTIndex::program_count() const
+{
+    return _programs.size();
+}
+
+size_t ASTIndex::node_count() const
+{
+    return _nodes.size();
+}
+
+ASTPtr const& ASTIndex::program(uint32_t number) const
+{
+    return _programs[number];
+}
+
+IndexedNode const& ASTIndex::node(uint32_t id) const
+{
+    return _nodes[id];
+}
+
+Postings const& ASTIndex::of_kind(ASTKind kind) const
+{
+    return _kinds.empty() ? no_postings : _kinds[static_cast<size_t>(kind)];
+}
+
+Postings const& ASTIndex::of_op(Op op) const
+{
+    return _ops.empty() ? no_postings : _ops[static_cast<size_t>(op)];
+}
+
+Postings const& ASTIndex::named(string const& name) const
+{
+    auto it = _names.find(name);
+    return it == _names.end() ? no_postings : it->second;
+}
+
+Postings ASTIndex::in_program(Postings const& list, uint32_t program) const
+{
+    uint32_t const begin = _program_begin[program];
+    uint32_t const end = program + 1 < _program_begin.size()
+        ? _program_begin[program + 1]
+        : static_cast<uint32_t>(_nodes.size());
+
+    return Postings(std::lower_bound(list.begin(), list.end(), begin),
+                    std::lower_bound(list.begin(), list.end(), end));
+}
+
+// Functions do not nest, so each owns a contiguous run of ids and the
+// result stays sorted; only neighbours repeat.
+Postings ASTIndex::funcs_of(Postings const& list) const
+{
+    Postings out;
+
+    for (uint32_t id : list)
+    {
+        uint32_t const func = _nodes[id].func;
+
+        if (func != no_node && (out.empty() || out.back() != func))
+        {
+            out.push_back(func);
+        }
+    }
+
+    return out;
+}
+
+// Siblings interleave with their nephews, so this one needs a sort.
+Postings ASTIndex::parents_of(Postings const& list) const
+{
+    Postings out;
+
+    for (uint32_t id : list)
+    {
+        uint32_t const parent = _nodes[id].parent;
+
+        if (parent != no_node)
+        {
+            out.push_back(parent);
+        }
+    }
+
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+Postings ASTIndex::funcs_assigning(string const& name) const
+{
+    auto it = _assigned.find(name);
+    return it == _assigned.end() ? Postings() : funcs_of(it->second);
+}
+
+Postings ASTIndex::binops_with_right(Op op, ASTKind kind) const
+{
+    Postings out;
+
+    for (uint32_t id : of_op(op))
+    {
+        IndexedNode const& n = _nodes[id];
+
+        if (n.kind == ASTKind::binop && n.right == kind)
+        {
+            out.push_back(id);
+        }
+    }
+
+    return out;
+}
+
+Postings intersect(Postings const& a, Postings const& b)
+{
+    Postings out;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out));
+    return out;
+}
+
+Postings unite(Postings const& a, Postings const& b)
+{
+    Postings out;
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out));
+    return out;
+}
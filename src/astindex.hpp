@@ -0,0 +1,91 @@
+#pragma once
+
+#include "ast.hpp"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Node ids, ascending; each list holds at most one entry per node.
+using Postings = vector<uint32_t>;
+
+uint32_t const no_node = ~0u;
+
+struct IndexedNode
+{
+    AST const* node;
+    uint32_t   program;
+    uint32_t   func;    // Enclosing ASTFunc, itself for a function, or no_node.
+    uint32_t   parent;  // no_node for a root.
+    uint32_t   child;   // Which child of the parent: left 0, right 1, or the
+                        // position among statements or declarations.
+    ASTKind    kind;
+    Op         op;      // Meaningful for binop and unop only.
+    ASTKind    right;   // The operand's kind, likewise.
+};
+
+static_assert(sizeof(IndexedNode) <= 32, "two nodes to a cache line");
+
+// Flattens parsed programs into a node table with posting lists by kind, by
+// Op, by identifier and by name assigned, so lookups such as "functions
+// that assign to x" read a list or two instead of walking every tree. Nodes
+// are numbered in pre-order, one program after another, so each program
+// owns a contiguous range of ids and every list is sorted.
+//
+// The index shares ownership of the programs it was given; node pointers
+// stay valid as long as it does.
+class ASTIndex
+{
+    public:
+        // Indexes an ASTProgram, or a lone ASTFunc from parse_stream(), as
+        // the next program; returns its number.
+        uint32_t add(ASTPtr const& program);
+
+        // Appends another index's programs after this one's.
+        void merge(ASTIndex const&);
+
+        size_t program_count() const;
+        size_t node_count() const;
+        ASTPtr const& program(uint32_t) const;
+        IndexedNode const& node(uint32_t id) const;
+
+        Postings const& of_kind(ASTKind) const;
+        Postings const& of_op(Op) const;
+
+        // Variables read, assigned or declared, and functions and their
+        // arguments (posted on the ASTFunc), by name. Type names are not
+        // indexed.
+        Postings const& named(string const&) const;
+
+        // The part of a list that falls in one program.
+        Postings in_program(Postings const&, uint32_t program) const;
+
+        // Distinct enclosing functions and parents of the listed nodes.
+        Postings funcs_of(Postings const&) const;
+        Postings parents_of(Postings const&) const;
+
+        // Functions that assign to, or declare, a name.
+        Postings funcs_assigning(string const& name) const;
+
+        // Binary operations whose right operand is of the given kind, e.g.
+        // divisions by a variable.
+        Postings binops_with_right(Op, ASTKind) const;
+
+    private:
+        vector<ASTPtr>      _programs;
+        vector<uint32_t>    _program_begin; // First node id of each program.
+        vector<IndexedNode> _nodes;
+        vector<Postings>    _kinds;
+        vector<Postings>    _ops;
+        std::unordered_map<string, Postings> _names;
+        std::unordered_map<string, Postings> _assigned; // assign and var_decl nodes.
+
+        void visit(AST const&, uint32_t program);
+        void post_name(string const&, uint32_t id);
+};
+
+Postings intersect(Postings const&, Postings const&);
+Postings unite(Postings const&, Postings const&);
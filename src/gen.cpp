@@ -0,0 +1,206 @@
+#include "gen.hpp"
+#include <random>
+
+class Generator
+{
+    public:
+        Generator(GenOptions const& opts)
+            : _opts(opts)
+            , _rng(opts.seed)
+        {}
+
+        vector<Tok> program()
+        {
+            for (unsigned f = 0; f < _opts.functions; ++f)
+            {
+                func("f" + std::to_string(f));
+            }
+
+            return std::move(_toks);
+        }
+
+    private:
+        GenOptions const& _opts;
+        std::mt19937      _rng;
+        vector<Tok>       _toks;
+        vector<string>    _names;
+
+        unsigned below(unsigned n)
+        {
+            return std::uniform_int_distribution<unsigned>(0, n - 1)(_rng);
+        }
+
+        unsigned between(unsigned lo, unsigned hi)
+        {
+            return lo >= hi ? lo : lo + below(hi - lo + 1);
+        }
+
+        void func(string name)
+        {
+            _names.clear();
+            _toks.push_back(VarTok{"int"});
+            _toks.push_back(VarTok{std::move(name)});
+            _toks.push_back(LParTok{});
+
+            unsigned const args = between(0, _opts.max_args);
+
+            for (unsigned a = 0; a < args; ++a)
+            {
+                if (a > 0)
+                {
+                    _toks.push_back(CommaTok{});
+                }
+
+                declare_into("a");
+            }
+
+            _toks.push_back(RParTok{});
+            _toks.push_back(LBraceTok{});
+
+            unsigned const stmts = between(_opts.min_stmts, _opts.max_stmts);
+
+            for (unsigned s = 0; s < stmts; ++s)
+            {
+                stmt();
+            }
+
+            _toks.push_back(RBraceTok{});
+        }
+
+        // Emits "int <fresh name>" and makes the name visible to later uses.
+        void declare_into(char const* prefix)
+        {
+            _names.push_back(prefix + std::to_string(_names.size()));
+            _toks.push_back(VarTok{"int"});
+            _toks.push_back(VarTok{_names.back()});
+        }
+
+        void stmt()
+        {
+            if (_names.empty() || below(2) == 0)
+            {
+                string const name = "v" + std::to_string(_names.size());
+                _toks.push_back(VarTok{"int"});
+                _toks.push_back(VarTok{name});
+                _toks.push_back(AssignTok{});
+                exp(_opts.max_depth);
+                _names.push_back(name); // Not in scope of its own initializer.
+            }
+            else
+            {
+                _toks.push_back(VarTok{_names[below(static_cast<unsigned>(_names.size()))]});
+                _toks.push_back(AssignTok{});
+                exp(_opts.max_depth);
+            }
+
+            _toks.push_back(SemiTok{});
+        }
+
+        void exp(unsigned depth)
+        {
+            OpMix const& m = _opts.mix;
+            unsigned const binary = m.add + m.sub + m.mul + m.div + m.logical;
+
+            if (depth == 0 || binary == 0 || below(3) == 0)
+            {
+                primary(depth);
+                return;
+            }
+
+            exp(depth - 1);
+            unsigned r = below(binary);
+
+            if (r < m.add)                   _toks.push_back(AddTok{});
+            else if ((r -= m.add) < m.sub)   _toks.push_back(SubTok{});
+            else if ((r -= m.sub) < m.mul)   _toks.push_back(MulTok{});
+            else if ((r -= m.mul) < m.div)   _toks.push_back(DivTok{});
+            else if (below(2) == 0)          _toks.push_back(AndTok{});
+            else                             _toks.push_back(OrTok{});
+
+            exp(depth - 1);
+        }
+
+        void primary(unsigned depth)
+        {
+            OpMix const& m = _opts.mix;
+            unsigned const leaf = 4;
+            unsigned r = below(leaf + m.unary + (depth > 0 ? m.parens : 0));
+
+            if (r < leaf)
+            {
+                if (_names.empty() || r < 2)
+                {
+                    _toks.push_back(NumTok{static_cast<int>(below(1000))});
+                }
+                else
+                {
+                    _toks.push_back(VarTok{_names[below(static_cast<unsigned>(_names.size()))]});
+                }
+            }
+            else if (r - leaf < m.unary)
+            {
+                if (below(2) == 0) _toks.push_back(SubTok{});
+                else               _toks.push_back(NotTok{});
+
+                primary(depth);
+            }
+            else
+            {
+                _toks.push_back(LParTok{});
+                exp(depth - 1);
+                _toks.push_back(RParTok{});
+            }
+        }
+};
+
+vector<Tok> generate_program(GenOptions const& opts)
+{
+    return Generator(opts).program();
+}
+
+// int f() { int x = <body>; }
+static vector<Tok> wrap_exp(vector<Tok> body)
+{
+    vector<Tok> toks
+    {
+        VarTok{"int"}, VarTok{"f"}, LParTok{}, RParTok{}, LBraceTok{},
+        VarTok{"int"}, VarTok{"x"}, AssignTok{},
+    };
+
+    toks.insert(toks.end(), 
+        std::make_move_iterator(body.begin()), 
+        std::make_move_iterator(body.end()));
+    toks.push_back(SemiTok{});
+    toks.push_back(RBraceTok{});
+    return toks;
+}
+
+vector<Tok> generate_deep_parens(unsigned depth)
+{
+    vector<Tok> body(depth, LParTok{});
+    body.push_back(NumTok{1});
+    body.insert(body.end(), depth, RParTok{});
+    return wrap_exp(std::move(body));
+}
+
+vector<Tok> generate_operator_chain(unsigned length, OpMix const& mix)
+{
+    vector<Tok> ops;
+    
+    if (mix.add)     ops.push_back(AddTok{});
+    if (mix.sub)     ops.push_back(SubTok{});
+    if (mix.mul)     ops.push_back(MulTok{});
+    if (mix.div)     ops.push_back(DivTok{});
+    if (mix.logical) ops.push_back(AndTok{});
+    if (ops.empty()) ops.push_back(AddTok{});
+
+    vector<Tok> body{NumTok{1}};
+
+    for (unsigned i = 0; i < length; ++i)
+    {
+        body.push_back(ops[i % ops.size()]);
+        body.push_back(NumTok{static_cast<int>(i % 100)});
+    }
+
+    return wrap_exp(std::move(body));
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "tokens.hpp"
+
+// Relative weights; a weight of 0 disables that choice.
+struct OpMix
+{
+    unsigned add = 4;
+    unsigned sub = 2;
+    unsigned mul = 3;
+    unsigned div = 1;
+    unsigned logical = 1; // && and ||
+    unsigned unary = 1;   // - and ! in front of a primary
+    unsigned parens = 1;
+};
+
+struct GenOptions
+{
+    unsigned seed       = 1;
+    unsigned functions  = 8;
+    unsigned max_args   = 3;
+    unsigned min_stmts  = 1;
+    unsigned max_stmts  = 12;
+    unsigned max_depth  = 4;  // Nesting of binary operators and parens.
+    OpMix    mix;
+};
+
+// A well-formed program: every name refers to an argument or earlier local.
+vector<Tok> generate_program(GenOptions const&);
+
+// Pathological shapes, each wrapped in one function so parse() accepts them.
+vector<Tok> generate_deep_parens(unsigned depth);
+vector<Tok> generate_operator_chain(unsigned length, OpMix const& = OpMix());
@@ -0,0 +1,719 @@
+#include "grammar.hpp"
+#include "parser.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <set>
+
+//// DESCRIPTION ////
+
+template <typename T>
+static GExpr tok()
+{
+    GExpr e;
+    e.kind = GExpr::Kind::token;
+    e.token = tok_kind<T>;
+    return e;
+}
+
+static GExpr ref(char const* rule)
+{
+    GExpr e;
+    e.kind = GExpr::Kind::rule;
+    e.rule = rule;
+    return e;
+}
+
+static GExpr seq(vector<GExpr> items)
+{
+    GExpr e;
+    e.kind = GExpr::Kind::seq;
+    e.items = std::move(items);
+    return e;
+}
+
+static GExpr alt(vector<GExpr> items)
+{
+    GExpr e;
+    e.kind = GExpr::Kind::alt;
+    e.items = std::move(items);
+    return e;
+}
+
+static GExpr many(GExpr item)
+{
+    GExpr e;
+    e.kind = GExpr::Kind::many;
+    e.items.push_back(std::move(item));
+    return e;
+}
+
+static GExpr skip()
+{
+    GExpr e;
+    e.kind = GExpr::Kind::skip;
+    return e;
+}
+
+template <typename Sep>
+static GExpr list(GExpr item)
+{
+    GExpr e;
+    e.kind = GExpr::Kind::list;
+    e.items.push_back(std::move(item));
+    e.sep = tok_kind<Sep>;
+    return e;
+}
+
+vector<GRule> const& grammar()
+{
+    static vector<GRule> const rules
+    {
+        {"parse_num",           tok<NumTok>()},
+        {"parse_var",           tok<VarTok>()},
+        {"parse_name",          tok<VarTok>()},
+        {"parse_unary_op",      alt({tok<NotTok>(), tok<SubTok>()})},
+        {"parse_multive_op",    alt({tok<MulTok>(), tok<DivTok>()})},
+        {"parse_additive_op",   alt({tok<AddTok>(), tok<SubTok>()})},
+        {"parse_logical_op",    alt({tok<AndTok>(), tok<OrTok>()})},
+        {"parse_unary",         seq({ref("parse_unary_op"), ref("parse_primary")})},
+        {"parse_parens_exp",    seq({tok<LParTok>(), ref("parse_exp"), tok<RParTok>()})},
+        {"parse_primary",       alt({ref("parse_num"), ref("parse_parens_exp"), 
+                                     ref("parse_var"), ref("parse_unary")})},
+        {"parse_multive",       alt({seq({ref("parse_multive"), ref("parse_multive_op"), 
+                                          ref("parse_primary")}), 
+                                     ref("parse_primary")})},
+        {"parse_additive",      alt({seq({ref("parse_additive"), ref("parse_additive_op"), 
+                                          ref("parse_multive")}), 
+                                     ref("parse_multive")})},
+        {"parse_logical",       alt({seq({ref("parse_logical"), ref("parse_logical_op"), 
+                                          ref("parse_additive")}), 
+                                     ref("parse_additive")})},
+        {"parse_exp",           ref("parse_logical")},
+        {"parse_var_decl",      seq({ref("parse_name"), ref("parse_name"), 
+                                     tok<AssignTok>(), ref("parse_exp")})},
+        {"parse_assign",        seq({ref("parse_name"), tok<AssignTok>(), ref("parse_exp")})},
+        {"parse_stmt",          seq({alt({ref("parse_assign"), ref("parse_var_decl")}), 
+                                     tok<SemiTok>()})},
+        {"parse_stmt_recovery", skip(), true},
+        {"parse_missing_rbrace", seq({}), true},
+        {"parse_func_recovery", skip(), true},
+        {"parse_block",         seq({tok<LBraceTok>(), 
+                                     many(alt({ref("parse_stmt"), ref("parse_stmt_recovery")})), 
+                                     alt({tok<RBraceTok>(), ref("parse_missing_rbrace")})})},
+        {"parse_arg",           seq({ref("parse_name"), ref("parse_name")})},
+        {"parse_formal_args",   seq({tok<LParTok>(), list<CommaTok>(ref("parse_arg")), 
+                                     tok<RParTok>()})},
+        {"parse_func",          seq({ref("parse_name"), ref("parse_name"), 
+                                     ref("parse_formal_args"), ref("parse_block")})},
+        {"parse_end",           tok<EndTok>()},
+        {"parse_program",       seq({many(alt({ref("parse_func"), ref("parse_func_recovery")})), 
+                                     ref("parse_end")})},
+    };
+
+    return rules;
+}
+
+static void check_refs(GExpr const& e, string const& rule, std::set<string> const& defined, 
+    vector<string>& problems)
+{
+    if (e.kind == GExpr::Kind::rule && !defined.count(e.rule))
+    {
+        problems.push_back(rule + " refers to " + e.rule + ", which grammar() does not define");
+    }
+
+    for (GExpr const& item : e.items)
+    {
+        check_refs(item, rule, defined, problems);
+    }
+}
+
+vector<string> check_grammar()
+{
+    std::set<string> defined;
+
+    for (GRule const& r : grammar())
+    {
+        defined.insert(r.name);
+    }
+
+    vector<string> problems;
+    std::set<string> traced;
+
+    for (string const& name : parser_rules())
+    {
+        // grammar() spells match<T>() as a token.
+        if (name.compare(0, 6, "match<") == 0)
+        {
+            continue;
+        }
+
+        traced.insert(name);
+
+        if (!defined.count(name))
+        {
+            problems.push_back("parser rule " + name + " is missing from grammar()");
+        }
+    }
+
+    for (GRule const& r : grammar())
+    {
+        if (!traced.count(r.name))
+        {
+            problems.push_back("grammar() rule " + r.name + " is not a rule of the parser");
+        }
+
+        check_refs(r.body, r.name, defined, problems);
+    }
+
+    return problems;
+}
+
+//// ANALYSIS ////
+
+using RuleSet = vector<bool>;
+
+class Analyzer
+{
+    public:
+        // Strict reads the grammar without its recovery rules, as the
+        // language a parse without ParseOptions::recover accepts.
+        explicit Analyzer(bool strict = false)
+            : _rules(grammar())
+            , _n(_rules.size())
+            , _strict(strict)
+            , _nullable(_n, false)
+            , _first(_n, 0)
+            , _last(_n, 0)
+            , _leads(_n, RuleSet(_n, false))
+        {
+            for (size_t r = 0; r < _n; ++r)
+            {
+                _index[_rules[r].name] = r;
+            }
+
+            fixpoint();
+
+            for (size_t r = 0; r < _n; ++r)
+            {
+                lead(_rules[r].body, _leads[r]);
+            }
+
+            close_leads();
+        }
+
+        GrammarAnalysis run()
+        {
+            RuleSet reentrant(_n, false);
+
+            for (GRule const& rule : _rules)
+            {
+                reentry(rule.body, reentrant);
+            }
+
+            GrammarAnalysis a;
+
+            for (size_t r = 0; r < _n; ++r)
+            {
+                RuleAnalysis ra;
+                ra.name           = _rules[r].name;
+                ra.nullable       = _nullable[r];
+                ra.first          = _first[r];
+                ra.left_recursive = _leads[r][r];
+                ra.reentrant      = reentrant[r];
+                ra.cheap          = !has_subrule(_rules[r].body);
+
+                if (ra.left_recursive)
+                {
+                    ra.memoize = true;
+                    ra.reason = "left-recursive; required for seed growing";
+                }
+                else if (ra.reentrant && !ra.cheap)
+                {
+                    ra.memoize = true;
+                    ra.reason = "alternatives re-enter it at the same position";
+                }
+                else if (ra.reentrant)
+                {
+                    ra.reason = "re-entered, but only matches tokens";
+                }
+                else
+                {
+                    ra.reason = "never re-entered at the same position";
+                }
+
+                a.rules.push_back(ra);
+            }
+
+            return a;
+        }
+
+        TokenAdjacency adjacency() const
+        {
+            TokenAdjacency a;
+
+            for (GRule const& rule : _rules)
+            {
+                if (!rule.recovery)
+                {
+                    pairs(rule.body, a.follows);
+                }
+            }
+
+            a.follows[tok_kind<EndTok>] |= _first[index("parse_program")];
+            return a;
+        }
+
+    private:
+        vector<GRule> const&           _rules;
+        size_t                         _n;
+        bool                           _strict;
+        unordered_map<string, size_t>  _index;
+        vector<bool>                   _nullable;
+        vector<uint32_t>               _first;
+        vector<uint32_t>               _last;
+        vector<RuleSet>                _leads; // Rules reachable at the start.
+
+        size_t index(string const& rule) const
+        {
+            return _index.at(rule);
+        }
+
+        bool nullable(GExpr const& e) const
+        {
+            switch (e.kind)
+            {
+                case GExpr::Kind::token:    return e.token == tok_kind<EndTok>;
+                case GExpr::Kind::skip:     return false;
+                case GExpr::Kind::rule:     return _nullable[index(e.rule)];
+                case GExpr::Kind::many:     return true;
+                case GExpr::Kind::list:     return true;
+                case GExpr::Kind::seq:
+                    return std::all_of(e.items.begin(), e.items.end(), 
+                        [this](GExpr const& i) { return nullable(i); });
+                case GExpr::Kind::alt:
+                    return std::any_of(e.items.begin(), e.items.end(), 
+                        [this](GExpr const& i) { return nullable(i); });
+            }
+
+            std::abort();
+        }
+
+        uint32_t first(GExpr const& e) const
+        {
+            switch (e.kind)
+            {
+                case GExpr::Kind::token:    return 1u << e.token;
+                case GExpr::Kind::skip:     return skipped();
+                case GExpr::Kind::rule:     return _first[index(e.rule)];
+                case GExpr::Kind::many:     return first(e.items[0]);
+                case GExpr::Kind::list:     return first(e.items[0]);
+                case GExpr::Kind::alt:
+                {
+                    uint32_t f = 0;
+
+                    for (GExpr const& i : e.items)
+                    {
+                        f |= first(i);
+                    }
+
+                    return f;
+                }
+                case GExpr::Kind::seq:
+                {
+                    uint32_t f = 0;
+
+                    for (GExpr const& i : e.items)
+                    {
+                        f |= first(i);
+
+                        if (!nullable(i))
+                        {
+                            break;
+                        }
+                    }
+
+                    return f;
+                }
+            }
+
+            std::abort();
+        }
+
+        // Tokens an expression can end with; first() read backwards.
+        uint32_t last(GExpr const& e) const
+        {
+            switch (e.kind)
+            {
+                case GExpr::Kind::token:    return 1u << e.token;
+                case GExpr::Kind::skip:     return skipped();
+                case GExpr::Kind::rule:     return _last[index(e.rule)];
+                case GExpr::Kind::many:     return last(e.items[0]);
+                case GExpr::Kind::list:     return last(e.items[0]);
+                case GExpr::Kind::alt:
+                {
+                    uint32_t l = 0;
+
+                    for (GExpr const& i : e.items)
+                    {
+                        l |= last(i);
+                    }
+
+                    return l;
+                }
+                case GExpr::Kind::seq:
+                {
+                    uint32_t l = 0;
+
+                    for (auto i = e.items.rbegin(); i != e.items.rend(); ++i)
+                    {
+                        l |= last(*i);
+
+                        if (!nullable(*i))
+                        {
+                            break;
+                        }
+                    }
+
+                    return l;
+                }
+            }
+
+            std::abort();
+        }
+
+        uint32_t skipped() const
+        {
+            return _strict ? 0 : ((1u << tok_kind_count) - 1) & ~(1u << tok_kind<EndTok>);
+        }
+
+        // A strict recovery rule matches nothing: not nullable, no tokens.
+        void fixpoint()
+        {
+            for (bool changed = true; changed; )
+            {
+                changed = false;
+
+                for (size_t r = 0; r < _n; ++r)
+                {
+                    if (_strict && _rules[r].recovery)
+                    {
+                        continue;
+                    }
+
+                    bool const n = nullable(_rules[r].body);
+                    uint32_t const f = first(_rules[r].body);
+                    uint32_t const l = last(_rules[r].body);
+                    changed |= n != _nullable[r] || f != _first[r] || l != _last[r];
+                    _nullable[r] = n;
+                    _first[r] = f;
+                    _last[r] = l;
+                }
+            }
+        }
+
+        static void link(uint32_t from, uint32_t to, uint32_t* follows)
+        {
+            for (size_t k = 0; k < tok_kind_count; ++k)
+            {
+                if (from & (1u << k))
+                {
+                    follows[k] |= to;
+                }
+            }
+        }
+
+        // Pairs that meet inside the expression: where one item ends and
+        // the next, past any that can be empty, begins. Pairs inside the
+        // rules it calls come from those rules' own bodies.
+        void pairs(GExpr const& e, uint32_t* follows) const
+        {
+            switch (e.kind)
+            {
+                case GExpr::Kind::token:
+                case GExpr::Kind::rule:
+                case GExpr::Kind::skip:
+                case GExpr::Kind::alt:
+                    break;
+                case GExpr::Kind::many:
+                    link(last(e.items[0]), first(e.items[0]), follows);
+                    break;
+                case GExpr::Kind::list:
+                    link(last(e.items[0]), 1u << e.sep, follows);
+                    link(1u << e.sep, first(e.items[0]), follows);
+                    break;
+                case GExpr::Kind::seq:
+                    for (size_t i = 0; i < e.items.size(); ++i)
+                    {
+                        for (size_t j = i + 1; j < e.items.size(); ++j)
+                        {
+                            link(last(e.items[i]), first(e.items[j]), follows);
+
+                            if (!nullable(e.items[j]))
+                            {
+                                break;
+                            }
+                        }
+                    }
+                    break;
+            }
+
+            for (GExpr const& i : e.items)
+            {
+                pairs(i, follows);
+            }
+        }
+
+        // Rules an expression may call before consuming any input.
+        void lead(GExpr const& e, RuleSet& out) const
+        {
+            switch (e.kind)
+            {
+                case GExpr::Kind::token:
+                case GExpr::Kind::skip:
+                    return;
+                case GExpr::Kind::rule:
+                    out[index(e.rule)] = true;
+                    return;
+                case GExpr::Kind::many:
+                case GExpr::Kind::list:
+                    lead(e.items[0], out);
+                    return;
+                case GExpr::Kind::alt:
+                    for (GExpr const& i : e.items)
+                    {
+                        lead(i, out);
+                    }
+                    return;
+                case GExpr::Kind::seq:
+                    for (GExpr const& i : e.items)
+                    {
+                        lead(i, out);
+
+                        if (!nullable(i))
+                        {
+                            break;
+                        }
+                    }
+                    return;
+            }
+        }
+
+        void close_leads()
+        {
+            for (bool changed = true; changed; )
+            {
+                changed = false;
+
+                for (size_t r = 0; r < _n; ++r)
+                {
+                    for (size_t m = 0; m < _n; ++m)
+                    {
+                        if (!_leads[r][m])
+                        {
+                            continue;
+                        }
+
+                        for (size_t k = 0; k < _n; ++k)
+                        {
+                            if (_leads[m][k] && !_leads[r][k])
+                            {
+                                _leads[r][k] = true;
+                                changed = true;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        RuleSet lead_closure(GExpr const& e) const
+        {
+            RuleSet direct(_n, false);
+            lead(e, direct);
+            RuleSet all = direct;
+
+            for (size_t r = 0; r < _n; ++r)
+            {
+                for (size_t k = 0; direct[r] && k < _n; ++k)
+                {
+                    all[k] = all[k] || _leads[r][k];
+                }
+            }
+
+            return all;
+        }
+
+        void mark_common(RuleSet const& a, RuleSet const& b, RuleSet& out) const
+        {
+            for (size_t r = 0; r < _n; ++r)
+            {
+                out[r] = out[r] || (a[r] && b[r]);
+            }
+        }
+
+        // A rule runs twice at one position when two alternatives both reach
+        // it first, or when an optional element fails and what follows it
+        // starts with the same rule.
+        void reentry(GExpr const& e, RuleSet& out) const
+        {
+            if (e.kind == GExpr::Kind::alt)
+            {
+                for (size_t i = 0; i < e.items.size(); ++i)
+                {
+                    for (size_t j = i + 1; j < e.items.size(); ++j)
+                    {
+                        mark_common(lead_closure(e.items[i]), lead_closure(e.items[j]), out);
+                    }
+                }
+            }
+            else if (e.kind == GExpr::Kind::seq)
+            {
+                for (size_t i = 0; i + 1 < e.items.size(); ++i)
+                {
+                    if (nullable(e.items[i]))
+                    {
+                        GExpr rest;
+                        rest.kind = GExpr::Kind::seq;
+                        rest.items.assign(e.items.begin() + static_cast<ptrdiff_t>(i + 1), e.items.end());
+                        mark_common(lead_closure(e.items[i]), lead_closure(rest), out);
+                    }
+                }
+            }
+
+            for (GExpr const& i : e.items)
+            {
+                reentry(i, out);
+            }
+        }
+
+        static bool has_subrule(GExpr const& e)
+        {
+            return e.kind == GExpr::Kind::rule 
+                || std::any_of(e.items.begin(), e.items.end(), has_subrule);
+        }
+};
+
+static void make_plan(GrammarAnalysis& a)
+{
+    for (RuleAnalysis const& r : a.rules)
+    {
+        unsigned const id = rule_id(r.name);
+
+        if (id >= a.plan.rules.size())
+        {
+            a.plan.rules.resize(id + 1);
+        }
+
+        a.plan.rules[id] = r.memoize;
+    }
+}
+
+GrammarAnalysis analyze_grammar()
+{
+    GrammarAnalysis a = Analyzer().run();
+    make_plan(a);
+    return a;
+}
+
+MemoPlan const& required_memo_plan()
+{
+    static MemoPlan const plan = []
+    {
+        GrammarAnalysis a = Analyzer().run();
+
+        for (RuleAnalysis& r : a.rules)
+        {
+            r.memoize = r.left_recursive;
+        }
+
+        make_plan(a);
+        return a.plan;
+    }();
+
+    return plan;
+}
+
+TokenAdjacency analyze_adjacency()
+{
+    return Analyzer(true).adjacency();
+}
+
+GrammarAnalysis analyze_grammar(vector<Tok> const& sample)
+{
+    // Roughly what storing and probing one memo entry costs, in rule steps.
+    double const entry_cost = 2.0;
+
+    GrammarAnalysis a = analyze_grammar();
+
+    // Profile under the static plan, so repeats are the ones it leaves and
+    // hits on the rules it memoizes.
+    RuleProfile profile;
+    ParseOptions opts;
+    opts.memo_plan = &a.plan;
+    opts.profile = &profile;
+    opts.max_steps = 1000 * (sample.size() + 1);
+    parse(sample, opts);
+
+    for (RuleAnalysis& r : a.rules)
+    {
+        unsigned const id = rule_id(r.name);
+
+        if (id >= profile.rules.size() || profile.rules[id].calls == 0)
+        {
+            continue;
+        }
+
+        RuleProfile::Counts const& c = profile.rules[id];
+        r.has_profile = true;
+        r.profile = c;
+
+        if (r.left_recursive)
+        {
+            continue;
+        }
+
+        uint64_t const runs = r.memoize ? c.calls - c.repeats : c.calls;
+        double const per_run = runs ? static_cast<double>(c.steps) / static_cast<double>(runs) : 0.0;
+        double const saved = static_cast<double>(c.repeats) * per_run;
+        double const cost = static_cast<double>(c.calls - c.repeats) * entry_cost;
+
+        char buf[128];
+        std::snprintf(buf, sizeof buf, "%llu of %llu calls repeated at ~%.1f steps: saves %.0f, costs %.0f",
+            static_cast<unsigned long long>(c.repeats), 
+            static_cast<unsigned long long>(c.calls), per_run, saved, cost);
+
+        r.memoize = saved > cost;
+        r.reason = buf;
+    }
+
+    make_plan(a);
+    return a;
+}
+
+string to_string(GrammarAnalysis const& a)
+{
+    string s;
+
+    for (RuleAnalysis const& r : a.rules)
+    {
+        string first;
+
+        for (size_t k = 0; k < tok_kind_count; ++k)
+        {
+            if (r.first & (1u << k))
+            {
+                first += (first.empty() ? "" : " ") + kind_name(k);
+            }
+        }
+
+        s += (r.memoize ? "MEMO " : "     ") + r.name + ": " + r.reason + "\n";
+        s += "       first {" + first + "}";
+        s += r.nullable ? " nullable" : "";
+        s += r.left_recursive ? " left-recursive" : "";
+        s += r.reentrant ? " re-entrant" : "";
+        s += r.cheap ? " token-only" : "";
+        s += "\n";
+    }
+
+    return s;
+}
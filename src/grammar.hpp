@@ -0,0 +1,89 @@
+#pragma once
+
+#include "parsestate.hpp"
+
+// A symbolic copy of the grammar in parser.cpp, which the combinators
+// themselves cannot expose. Rule names are the __func__ names TRACE uses, so
+// results map onto rule_id()s. Keep the two in step when editing rules;
+// fuzz_check fails where check_grammar() finds they are not.
+
+struct GExpr
+{
+    // skip: error recovery, consuming one or more tokens of any kind.
+    enum class Kind { token, rule, seq, alt, many, list, skip };
+
+    Kind          kind = Kind::token;
+    size_t        token = 0; // kind::token: a tok_kind; EndTok means end of input.
+    string        rule;      // kind::rule
+    vector<GExpr> items;     // seq, alt; many and list have one item
+    size_t        sep = 0;   // kind::list: separator token
+};
+
+struct GRule
+{
+    string name;
+    GExpr  body;
+    bool   recovery = false; // Only runs with ParseOptions::recover.
+};
+
+vector<GRule> const& grammar();
+
+// How grammar() has drifted from parser.cpp: a rule the parser TRACEs that
+// it lacks, a rule it has that the parser never TRACEs, or a reference to a
+// rule it does not define. One message each; empty when they agree.
+vector<string> check_grammar();
+
+struct RuleAnalysis
+{
+    string   name;
+    bool     nullable       = false;
+    uint32_t first          = 0;     // Set of tok_kinds.
+    bool     left_recursive = false;
+    bool     reentrant      = false; // Can run twice at one position.
+    bool     cheap          = false; // Matches tokens only, no subrules.
+    bool     memoize        = false;
+    string   reason;
+
+    bool                has_profile = false;
+    RuleProfile::Counts profile;
+};
+
+struct GrammarAnalysis
+{
+    vector<RuleAnalysis> rules; // In grammar() order.
+    MemoPlan             plan;
+};
+
+// Decides memoization from the grammar alone: left-recursive rules must be
+// memoized; otherwise a rule is memoized if alternatives can re-enter it at
+// the same position and it does more than match a token.
+GrammarAnalysis analyze_grammar();
+
+// Refines the static decisions with a profiled parse of the sample under the
+// static plan: a rule is memoized where the work its repeats would redo
+// outweighs one memo entry per distinct call.
+GrammarAnalysis analyze_grammar(vector<Tok> const& sample);
+
+string to_string(GrammarAnalysis const&);
+
+// The rules analyze_grammar() finds left-recursive, which a parse memoizes
+// under any ParseOptions::memo_plan.
+MemoPlan const& required_memo_plan();
+
+// Which token kinds can stand side by side in a program that parses without
+// recovery: bit b of follows[a] is set if b can come right after a. EndTok
+// stands for either end of the input, so follows[EndTok] is what a program
+// can start with, and a can end one if follows[a] has the EndTok bit.
+struct TokenAdjacency
+{
+    uint32_t follows[tok_kind_count] = {};
+
+    bool allows(size_t a, size_t b) const
+    {
+        return (follows[a] >> b) & 1;
+    }
+};
+
+// Read off the grammar as a context-free one, so it errs towards allowing:
+// a pair it rules out never occurs in a program the parser accepts.
+TokenAdjacency analyze_adjacency();
@@ -0,0 +1,567 @@
+#include "jit.hpp"
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_map>
+
+//// LOWERING ////
+
+static ExprInstr::Code const binary_codes[] =
+{
+    ExprInstr::add, ExprInstr::sub, ExprInstr::mul, ExprInstr::div,
+    ExprInstr::and_, ExprInstr::or_,
+};
+
+// Index of a variable in vars, or -1 with a message.
+static int32_t var_index(ASTVar const& var, vector<string> const& vars, string* error)
+{
+    auto it = std::find(vars.begin(), vars.end(), var.value);
+
+    if (it == vars.end())
+    {
+        if (error)
+        {
+            *error = "unknown variable " + var.value;
+        }
+
+        return -1;
+    }
+
+    return static_cast<int32_t>(it - vars.begin());
+}
+
+// The temporaries each node needs, Sethi-Ullman style: a binop whose sides
+// need l and r needs max(l, r), or l + 1 if they are equal. Post-order over
+// an explicit stack, as chains can be deeper than the native one. Empty on
+// an error.
+static std::unordered_map<AST const*, unsigned> needs(AST const& root, vector<string> const& vars, string* error)
+{
+    std::unordered_map<AST const*, unsigned> need;
+    vector<std::pair<AST const*, bool>> pending{{&root, false}};
+
+    while (!pending.empty())
+    {
+        auto const [ast, expanded] = pending.back();
+        pending.pop_back();
+
+        switch (ast->kind())
+        {
+            case ASTKind::num:
+                need[ast] = 1;
+                break;
+
+            case ASTKind::var:
+                if (var_index(static_cast<ASTVar const&>(*ast), vars, error) < 0)
+                {
+                    return {};
+                }
+
+                need[ast] = 1;
+                break;
+
+            case ASTKind::unop:
+            {
+                AST const* right = static_cast<ASTUnop const&>(*ast).right.get();
+
+                if (!expanded)
+                {
+                    pending.push_back({ast, true});
+                    pending.push_back({right, false});
+                    break;
+                }
+
+                need[ast] = need[right];
+                break;
+            }
+
+            case ASTKind::binop:
+            {
+                auto const& b = static_cast<ASTBinop const&>(*ast);
+
+                if (!expanded)
+                {
+                    pending.push_back({ast, true});
+                    pending.push_back({b.right.get(), false});
+                    pending.push_back({b.left.get(), false});
+                    break;
+                }
+
+                unsigned const l = need[b.left.get()];
+                unsigned const r = need[b.right.get()];
+                need[ast] = l == r ? l + 1 : std::max(l, r);
+                break;
+            }
+
+            default:
+                if (error)
+                {
+                    *error = "not an expression";
+                }
+
+                return {};
+        }
+    }
+
+    return need;
+}
+
+// Postfix, with the child needing more temporaries emitted first, so that
+// a tree of n leaves needs at most log2(n) + 1. Writes straight into out
+// from an explicit stack. Returns the temporaries needed, or 0 on an error.
+static unsigned lower(AST const& root, vector<string> const& vars, vector<ExprInstr>& out, string* error)
+{
+    std::unordered_map<AST const*, unsigned> const need = needs(root, vars, error);
+
+    if (need.empty())
+    {
+        return 0;
+    }
+
+    vector<std::pair<AST const*, bool>> pending{{&root, false}};
+
+    while (!pending.empty())
+    {
+        auto const [ast, expanded] = pending.back();
+        pending.pop_back();
+
+        switch (ast->kind())
+        {
+            case ASTKind::num:
+                out.push_back({ExprInstr::num, false, static_cast<ASTNum const&>(*ast).value});
+                break;
+
+            case ASTKind::var:
+                out.push_back({ExprInstr::var, false, var_index(static_cast<ASTVar const&>(*ast), vars, error)});
+                break;
+
+            case ASTKind::unop:
+            {
+                auto const& u = static_cast<ASTUnop const&>(*ast);
+
+                if (!expanded)
+                {
+                    pending.push_back({ast, true});
+                    pending.push_back({u.right.get(), false});
+                    break;
+                }
+
+                out.push_back({u.op == Op::opNot ? ExprInstr::not_ : ExprInstr::neg, false, 0});
+                break;
+            }
+
+            case ASTKind::binop:
+            {
+                auto const& b = static_cast<ASTBinop const&>(*ast);
+                bool const swapped = need.at(b.right.get()) > need.at(b.left.get());
+
+                if (!expanded)
+                {
+                    pending.push_back({ast, true});
+                    pending.push_back({swapped ? b.left.get() : b.right.get(), false});
+                    pending.push_back({swapped ? b.right.get() : b.left.get(), false});
+                    break;
+                }
+
+                out.push_back({binary_codes[static_cast<size_t>(b.op)], swapped, 0});
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    return need.at(&root);
+}
+
+unique_ptr<CompiledExpr> CompiledExpr::compile(AST const& ast, vector<string> const& vars, string* error, bool jit)
+{
+    unique_ptr<CompiledExpr> e(new CompiledExpr());
+    e->_depth = lower(ast, vars, e->_program, error);
+
+    if (!e->_depth)
+    {
+        return nullptr;
+    }
+
+    if (jit)
+    {
+        e->emit();
+    }
+
+    return e;
+}
+
+CompiledExpr::~CompiledExpr()
+{
+    if (_code)
+    {
+        munmap(_code, _code_size);
+    }
+}
+
+int CompiledExpr::operator()(int const* vars) const
+{
+    return _fn ? _fn(vars) : interpret(vars);
+}
+
+bool CompiledExpr::native() const
+{
+    return _fn != nullptr;
+}
+
+vector<ExprInstr> const& CompiledExpr::program() const
+{
+    return _program;
+}
+
+size_t CompiledExpr::code_size() const
+{
+    return _code_size;
+}
+
+//// INTERPRETER ////
+
+// Through uint32_t, so overflow wraps instead of being undefined.
+static int wrap(uint32_t v)
+{
+    return static_cast<int>(v);
+}
+
+static int apply(ExprInstr::Code code, int a, int b)
+{
+    uint32_t const ua = static_cast<uint32_t>(a);
+    uint32_t const ub = static_cast<uint32_t>(b);
+
+    switch (code)
+    {
+        case ExprInstr::add:  return wrap(ua + ub);
+        case ExprInstr::sub:  return wrap(ua - ub);
+        case ExprInstr::mul:  return wrap(ua * ub);
+        case ExprInstr::div:  return b == 0 ? 0 : b == -1 ? wrap(0u - ua) : a / b;
+        case ExprInstr::and_: return a != 0 && b != 0;
+        case ExprInstr::or_:  return a != 0 || b != 0;
+        default:              return 0;
+    }
+}
+
+int CompiledExpr::interpret(int const* vars) const
+{
+    int small[32] = {};
+    vector<int> large;
+    int* stack = small;
+
+    if (_depth > 32)
+    {
+        large.resize(_depth);
+        stack = large.data();
+    }
+
+    size_t sp = 0;
+
+    for (ExprInstr const& in : _program)
+    {
+        switch (in.code)
+        {
+            case ExprInstr::num:
+                stack[sp++] = in.operand;
+                break;
+
+            case ExprInstr::var:
+                stack[sp++] = vars[in.operand];
+                break;
+
+            case ExprInstr::not_:
+                stack[sp - 1] = stack[sp - 1] == 0;
+                break;
+
+            case ExprInstr::neg:
+                stack[sp - 1] = wrap(0u - static_cast<uint32_t>(stack[sp - 1]));
+                break;
+
+            default:
+            {
+                // The top is the right operand unless they were swapped.
+                int top = stack[--sp];
+                int below = stack[sp - 1];
+                stack[sp - 1] = in.swapped ? apply(in.code, top, below) : apply(in.code, below, top);
+                break;
+            }
+        }
+    }
+
+    return stack[0];
+}
+
+//// X86-64 ////
+
+#if defined(__x86_64__)
+
+// Register numbers as encoded; 8 and up need a REX prefix.
+enum Reg : uint8_t { eax = 0, ecx = 1, edx = 2, esi = 6, edi = 7, r8d = 8, r9d = 9, r10d = 10, r11d = 11 };
+
+// Temporaries, bottom of the stack first: caller-saved registers other than
+// eax and edx, which idiv and setcc need, and rdi, which holds vars.
+static Reg const temps[] = { ecx, esi, r8d, r9d, r10d, r11d };
+static unsigned const temp_count = sizeof(temps) / sizeof(temps[0]);
+
+class Emitter
+{
+    public:
+        vector<uint8_t> code;
+
+        void byte(unsigned b) { code.push_back(static_cast<uint8_t>(b)); }
+
+        void imm32(int32_t v)
+        {
+            uint8_t b[4];
+            memcpy(b, &v, 4);
+            code.insert(code.end(), b, b + 4);
+        }
+
+        void rex(Reg reg, Reg rm)
+        {
+            if (reg >= 8 || rm >= 8)
+            {
+                byte(0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+            }
+        }
+
+        void modrm(unsigned mod, unsigned reg, unsigned rm)
+        {
+            byte(mod << 6 | (reg & 7) << 3 | (rm & 7));
+        }
+
+        // op r/m32, r32: add, sub, and, or, xor, cmp, test, mov.
+        void alu(unsigned op, Reg dst, Reg src)
+        {
+            rex(src, dst);
+            byte(op);
+            modrm(3, src, dst);
+        }
+
+        void mov_imm(Reg dst, int32_t v)
+        {
+            rex(eax, dst);
+            byte(0xB8 + (dst & 7));
+            imm32(v);
+        }
+
+        // mov dst, [rdi + index * 4]
+        void load_var(Reg dst, int32_t index)
+        {
+            rex(dst, eax);
+            byte(0x8B);
+            modrm(2, dst, edi);
+            imm32(index * 4);
+        }
+
+        void imul(Reg dst, Reg src)
+        {
+            rex(dst, src);
+            byte(0x0F);
+            byte(0xAF);
+            modrm(3, dst, src);
+        }
+
+        // F7 group: 3 neg, 7 idiv.
+        void unary(unsigned ext, Reg r)
+        {
+            rex(eax, r);
+            byte(0xF7);
+            modrm(3, ext, r);
+        }
+
+        void cmp_imm8(Reg r, int8_t v)
+        {
+            rex(eax, r);
+            byte(0x83);
+            modrm(3, 7, r);
+            byte(static_cast<uint8_t>(v));
+        }
+
+        // setcc al; cc 0x94 is e, 0x95 ne.
+        void setcc_al(unsigned cc)
+        {
+            byte(0x0F);
+            byte(cc);
+            modrm(3, 0, eax);
+        }
+
+        void setcc_dl(unsigned cc)
+        {
+            byte(0x0F);
+            byte(cc);
+            modrm(3, 0, edx);
+        }
+
+        void movzx_al(Reg dst)
+        {
+            rex(dst, eax);
+            byte(0x0F);
+            byte(0xB6);
+            modrm(3, dst, eax);
+        }
+
+        // A short jump, patched by land() once the target is known.
+        size_t jump(unsigned op)
+        {
+            byte(op);
+            byte(0);
+            return code.size();
+        }
+
+        void land(size_t from)
+        {
+            code[from - 1] = static_cast<uint8_t>(code.size() - from);
+        }
+};
+
+static unsigned const op_add = 0x01, op_sub = 0x29, op_and = 0x21, op_or = 0x09;
+static unsigned const op_xor = 0x31, op_test = 0x85, op_mov = 0x89;
+static unsigned const jz = 0x74, jmp = 0xEB;
+
+// dst = left / right, with the interpreter's answers for 0 and -1; dst is
+// one of the two.
+static void emit_div(Emitter& e, Reg dst, Reg left, Reg right)
+{
+    e.alu(op_test, right, right);
+    size_t const zero = e.jump(jz);
+    e.cmp_imm8(right, -1);
+    size_t const minus_one = e.jump(jz);
+
+    e.alu(op_mov, eax, left);
+    e.byte(0x99); // cdq
+    e.unary(7, right);
+    e.alu(op_mov, dst, eax);
+    size_t const done_div = e.jump(jmp);
+
+    e.land(zero);
+    e.alu(op_xor, dst, dst);
+    size_t const done_zero = e.jump(jmp);
+
+    e.land(minus_one);
+
+    if (dst != left)
+    {
+        e.alu(op_mov, dst, left);
+    }
+
+    e.unary(3, dst);
+    e.land(done_div);
+    e.land(done_zero);
+}
+
+// dst = (a != 0) op (b != 0), op being and or or.
+static void emit_logical(Emitter& e, unsigned op, Reg dst, Reg a, Reg b)
+{
+    e.alu(op_test, a, a);
+    e.setcc_al(0x95);
+    e.alu(op_test, b, b);
+    e.setcc_dl(0x95);
+    e.byte(op == op_and ? 0x20 : 0x08); // and/or al, dl
+    e.modrm(3, edx, eax);
+    e.movzx_al(dst);
+}
+
+void CompiledExpr::emit()
+{
+    if (_depth > temp_count)
+    {
+        return;
+    }
+
+    Emitter e;
+    size_t sp = 0;
+
+    for (ExprInstr const& in : _program)
+    {
+        switch (in.code)
+        {
+            case ExprInstr::num:
+                e.mov_imm(temps[sp++], in.operand);
+                continue;
+
+            case ExprInstr::var:
+                e.load_var(temps[sp++], in.operand);
+                continue;
+
+            case ExprInstr::not_:
+                e.alu(op_test, temps[sp - 1], temps[sp - 1]);
+                e.setcc_al(0x94);
+                e.movzx_al(temps[sp - 1]);
+                continue;
+
+            case ExprInstr::neg:
+                e.unary(3, temps[sp - 1]);
+                continue;
+
+            default:
+                break;
+        }
+
+        // The result goes below the top, where the first-pushed operand is.
+        Reg const top = temps[--sp];
+        Reg const dst = temps[sp - 1];
+        Reg const left = in.swapped ? top : dst;
+        Reg const right = in.swapped ? dst : top;
+
+        switch (in.code)
+        {
+            case ExprInstr::add:  e.alu(op_add, dst, top); break;
+            case ExprInstr::mul:  e.imul(dst, top); break;
+            case ExprInstr::and_: emit_logical(e, op_and, dst, left, right); break;
+            case ExprInstr::or_:  emit_logical(e, op_or, dst, left, right); break;
+            case ExprInstr::div:  emit_div(e, dst, left, right); break;
+
+            case ExprInstr::sub:
+                if (in.swapped)
+                {
+                    e.unary(3, dst); // dst = top - dst
+                    e.alu(op_add, dst, top);
+                }
+                else
+                {
+                    e.alu(op_sub, dst, top);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    e.alu(op_mov, eax, temps[0]);
+    e.byte(0xC3); // ret
+
+    // Written, then made executable; never both at once.
+    size_t const page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t const size = (e.code.size() + page - 1) / page * page;
+    void* code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (code == MAP_FAILED)
+    {
+        return;
+    }
+
+    memcpy(code, e.code.data(), e.code.size());
+
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(code, size);
+        return;
+    }
+
+    _code = code;
+    _code_size = size;
+    _fn = reinterpret_cast<Fn>(code);
+}
+
+#else
+
+void CompiledExpr::emit()
+{
+}
+
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ast.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+// Compiles ASTNum/ASTVar/ASTBinop/ASTUnop trees to x86-64 machine code in
+// mmap()ed memory, with a postfix interpreter that runs the same program
+// where the JIT cannot: on other targets, if the expression needs more
+// temporaries than there are scratch registers, or if mapping fails.
+//
+// Arithmetic is on 32-bit ints and wraps. x / 0 is 0 and INT_MIN / -1 is
+// INT_MIN, instead of trapping. && and || give 0 or 1 and evaluate both
+// sides, which nothing here can tell apart from short-circuiting.
+
+struct ExprInstr
+{
+    enum Code : uint8_t { num, var, add, sub, mul, div, and_, or_, not_, neg };
+
+    Code    code;
+    bool    swapped = false; // Binary: the right operand was pushed first.
+    int32_t operand = 0;     // num: the value; var: index into the vars.
+};
+
+class CompiledExpr
+{
+    public:
+        // vars[i] names the int at index i of what operator() is given.
+        // Returns null, with a message, for anything but an expression or
+        // for a name not in vars.
+        static unique_ptr<CompiledExpr> compile(AST const&, vector<string> const& vars,
+            string* error = nullptr, bool jit = true);
+
+        ~CompiledExpr();
+
+        CompiledExpr(CompiledExpr const&) = delete;
+        CompiledExpr& operator=(CompiledExpr const&) = delete;
+
+        int operator()(int const* vars) const;
+
+        // Runs the postfix program whatever native() says.
+        int interpret(int const* vars) const;
+
+        bool native() const;
+        vector<ExprInstr> const& program() const;
+        size_t code_size() const; // Bytes mapped; 0 when interpreted.
+
+    private:
+        using Fn = int (*)(int const*);
+
+        vector<ExprInstr> _program;
+        unsigned          _depth = 0; // Temporaries needed.
+        Fn                _fn = nullptr;
+        void*             _code = nullptr;
+        size_t            _code_size = 0;
+
+        CompiledExpr() = default;
+        void emit();
+};
@@ -0,0 +1,213 @@
+#include "lexer.hpp"
+#include <algorithm>
+#include <limits>
+
+string to_string(LexError const& e)
+{
+    return "byte " + std::to_string(e.offset) + ": " + e.message;
+}
+
+static bool is_name_start(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+optional<vector<Tok>> lex(string_view text, vector<uint32_t>* offsets, LexError* error)
+{
+    auto const fail = [&](size_t at, string message) -> optional<vector<Tok>>
+    {
+        if (error)
+        {
+            *error = LexError{static_cast<uint32_t>(at), std::move(message)};
+        }
+
+        return std::nullopt;
+    };
+
+    if (text.size() > std::numeric_limits<uint32_t>::max())
+    {
+        return fail(0, "input larger than 4 GiB");
+    }
+
+    vector<Tok> tokens;
+    size_t i = 0;
+
+    auto const emit = [&](size_t at, Tok t)
+    {
+        tokens.push_back(std::move(t));
+
+        if (offsets)
+        {
+            offsets->push_back(static_cast<uint32_t>(at));
+        }
+    };
+
+    while (true)
+    {
+        while (i < text.size() && is_space(text[i]))
+        {
+            ++i;
+        }
+
+        if (text.substr(i, 2) == "//")
+        {
+            while (i < text.size() && text[i] != '\n')
+            {
+                ++i;
+            }
+
+            continue;
+        }
+
+        size_t const start = i;
+
+        if (i == text.size())
+        {
+            return tokens;
+        }
+
+        char const c = text[i];
+
+        if (is_name_start(c))
+        {
+            while (i < text.size() && (is_name_start(text[i]) || is_digit(text[i])))
+            {
+                ++i;
+            }
+
+            emit(start, VarTok{string(text.substr(start, i - start))});
+            continue;
+        }
+
+        if (is_digit(c))
+        {
+            int64_t value = 0;
+
+            while (i < text.size() && is_digit(text[i]))
+            {
+                value = value * 10 + (text[i++] - '0');
+
+                if (value > std::numeric_limits<int>::max())
+                {
+                    return fail(start, "number out of range");
+                }
+            }
+
+            emit(start, NumTok{static_cast<int>(value)});
+            continue;
+        }
+
+        string_view const two = text.substr(i, 2);
+
+        if (two == "&&" || two == "||")
+        {
+            i += 2;
+            emit(start, two == "&&" ? Tok(AndTok{}) : Tok(OrTok{}));
+            continue;
+        }
+
+        ++i;
+
+        switch (c)
+        {
+            case '(': emit(start, LParTok{});   continue;
+            case ')': emit(start, RParTok{});   continue;
+            case '{': emit(start, LBraceTok{}); continue;
+            case '}': emit(start, RBraceTok{}); continue;
+            case ',': emit(start, CommaTok{});  continue;
+            case ';': emit(start, SemiTok{});   continue;
+            case '+': emit(start, AddTok{});    continue;
+            case '-': emit(start, SubTok{});    continue;
+            case '*': emit(start, MulTok{});    continue;
+            case '/': emit(start, DivTok{});    continue;
+            case '!': emit(start, NotTok{});    continue;
+            case '=': emit(start, AssignTok{}); continue;
+            default:
+                return fail(start, "unexpected character '" + string(1, c) + "'");
+        }
+    }
+}
+
+optional<vector<vector<Tok>>> lex_parallel(string_view text, ThreadPool& pool, 
+    vector<uint32_t>* offsets, LexError* error, size_t min_chunk)
+{
+    if (text.size() > std::numeric_limits<uint32_t>::max())
+    {
+        if (error)
+        {
+            *error = LexError{0, "input larger than 4 GiB"};
+        }
+
+        return std::nullopt;
+    }
+
+    // A few chunks per thread, so one slow chunk does not hold up the rest.
+    size_t const want = std::max<size_t>(1, 
+        std::min<size_t>(pool.size() * 4, text.size() / std::max<size_t>(min_chunk, 1)));
+    vector<size_t> bounds{0};
+
+    for (size_t k = 1; k < want; ++k)
+    {
+        size_t const target = std::max(text.size() / want * k, bounds.back() + min_chunk);
+        size_t const newline = target < text.size() ? text.find('\n', target) : string_view::npos;
+
+        if (newline == string_view::npos || newline + 1 == text.size())
+        {
+            break;
+        }
+
+        bounds.push_back(newline + 1);
+    }
+
+    bounds.push_back(text.size());
+    size_t const n = bounds.size() - 1;
+
+    vector<optional<vector<Tok>>> results(n);
+    vector<vector<uint32_t>> chunk_offsets(n);
+    vector<LexError> errors(n);
+
+    parallel_for(pool, n, [&](size_t c)
+    {
+        results[c] = lex(text.substr(bounds[c], bounds[c + 1] - bounds[c]), 
+            offsets ? &chunk_offsets[c] : nullptr, &errors[c]);
+    });
+
+    vector<vector<Tok>> chunks;
+    chunks.reserve(n);
+
+    for (size_t c = 0; c < n; ++c)
+    {
+        if (!results[c])
+        {
+            if (error)
+            {
+                *error = errors[c];
+                error->offset += static_cast<uint32_t>(bounds[c]);
+            }
+
+            return std::nullopt;
+        }
+
+        chunks.push_back(std::move(*results[c]));
+
+        if (offsets)
+        {
+            for (uint32_t o : chunk_offsets[c])
+            {
+                offsets->push_back(o + static_cast<uint32_t>(bounds[c]));
+            }
+        }
+    }
+
+    return chunks;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "threadpool.hpp"
+#include "tokens.hpp"
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+using std::optional;
+using std::string_view;
+
+struct LexError
+{
+    uint32_t offset; // Byte offset into the text.
+    string   message;
+};
+
+string to_string(LexError const&);
+
+// Splits text into tokens. Names are [A-Za-z_][A-Za-z0-9_]*,
+// numbers are decimal ints, and "//" comments run to the end of the line.
+// When offsets is given, it receives each token's byte offset, a side array
+// the tokens themselves do not carry. Texts must fit 32-bit offsets.
+optional<vector<Tok>> lex(string_view text, vector<uint32_t>* offsets = nullptr, 
+    LexError* error = nullptr);
+
+// The same tokens, lexed in chunks on the pool and returned per chunk, for
+// ChunkedTokenSource to stream without joining them. Chunks end at line
+// breaks: the one kind of whitespace that cannot fall inside a comment or a
+// two-character operator. A chunk is at least min_chunk bytes unless it is
+// the last, so a text without line breaks is lexed on one thread. Offsets,
+// if given, are into the whole text; an error is the first in the text.
+optional<vector<vector<Tok>>> lex_parallel(string_view text, ThreadPool&,
+    vector<uint32_t>* offsets = nullptr, LexError* error = nullptr, 
+    size_t min_chunk = 64 << 10);
@@ -1,5 +1,7 @@
-#include "tokens.hpp"
+#include "lexer.hpp"
 #include "parser.hpp"
+#include "source.hpp"
+#include "typecheck.hpp"
 #include "types.hpp"
 #include <iostream>
 
@@ -7,37 +9,49 @@ using namespace std;
 
 int main()
 {
-    auto name   = [](char const* s) { return VarTok{s}; };
-    auto num    = [](int i)         { return NumTok{i}; };
-    auto lpar   = LParTok{};
-    auto rpar   = RParTok{};
-    auto lbrace = LBraceTok{};
-    auto rbrace = RBraceTok{};
-    auto comma  = CommaTok{};
-    auto semi   = SemiTok{};
-    auto assign = AssignTok{};
-
-    vector<Tok> tokens
+    string const text = 
+        "ret fun(type1 arg1, type2 arg2)\n"
+        "{\n"
+        "    int x = 80;\n"
+        "    flt y = 90;\n"
+        "}\n";
+
+    vector<uint32_t> offsets;
+    LexError lex_error;
+    auto tokens = lex(text, &offsets, &lex_error);
+
+    if (!tokens)
+    {
+        cout << "lex error at " << to_string(lex_error) << "\n";
+        return 1;
+    }
+
+    SourceMap const source(text, std::move(offsets));
+
+    vector<ParseError> errors;
+    ParseOptions opts;
+    opts.log = &cout;
+    opts.trace = &cout;
+    opts.errors = &errors;
+    opts.recover = true;
+
+    auto r = parse(*tokens, opts);
+
+    for (ParseError const& e : errors)
     {
-        name("ret"),
-        name("fun"),
-        lpar,
-            name("type1"), name("arg1"),
-            comma,
-            name("type2"), name("arg2"),
-        rpar,
-        lbrace,
-            name("int"), name("x"), assign, num(80), semi,
-            name("flt"), name("y"), assign, num(90), semi,
-        rbrace,
-    };
-
-    auto r = parse(tokens);
+        cout << to_string(source.at_token(static_cast<uint32_t>(e.pos))) 
+            << ": " << e.message << "\n";
+    }
     
     if (r)
     {
         auto& [x] = *r;
         cout << x->to_string() << "\n";
+
+        for (TypeError const& e : typecheck(x))
+        {
+            cout << to_string(source.begin(e.span)) << ": " << to_string(e) << "\n";
+        }
     }
     else
     {
@@ -0,0 +1,67 @@
+#include "memory.hpp"
+
+string to_string(MemoryStats const& m)
+{
+    return std::to_string(m.bytes) + " bytes in " + std::to_string(m.allocations) 
+        + " allocations, " + std::to_string(m.live) + " live, " 
+        + std::to_string(m.peak) + " peak";
+}
+
+void MemoryCounter::allocated(size_t bytes)
+{
+    _bytes.fetch_add(bytes, std::memory_order_relaxed);
+    _allocations.fetch_add(1, std::memory_order_relaxed);
+    uint64_t const live = _live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    uint64_t peak = _peak.load(std::memory_order_relaxed);
+
+    while (live > peak && !_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+    {}
+}
+
+void MemoryCounter::freed(size_t bytes)
+{
+    _live.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+MemoryStats MemoryCounter::stats() const
+{
+    MemoryStats s;
+    s.bytes = _bytes.load(std::memory_order_relaxed);
+    s.allocations = _allocations.load(std::memory_order_relaxed);
+    s.live = _live.load(std::memory_order_relaxed);
+    s.peak = _peak.load(std::memory_order_relaxed);
+    return s;
+}
+
+MemoryCounter& closure_memory()
+{
+    static MemoryCounter counter;
+    return counter;
+}
+
+CountingResource::CountingResource(std::pmr::memory_resource* upstream)
+    : _upstream(upstream)
+{}
+
+MemoryStats CountingResource::stats() const
+{
+    return _counter.stats();
+}
+
+void* CountingResource::do_allocate(size_t bytes, size_t align)
+{
+    void* const p = _upstream->allocate(bytes, align);
+    _counter.allocated(bytes);
+    return p;
+}
+
+void CountingResource::do_deallocate(void* p, size_t bytes, size_t align)
+{
+    _upstream->deallocate(p, bytes, align);
+    _counter.freed(bytes);
+}
+
+bool CountingResource::do_is_equal(std::pmr::memory_resource const& other) const noexcept
+{
+    return this == &other;
+}
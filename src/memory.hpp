@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <string>
+
+using std::string;
+
+// What one subsystem allocated: totals, and bytes held at the end and at most.
+struct MemoryStats
+{
+    uint64_t bytes       = 0;
+    uint64_t allocations = 0;
+    uint64_t live        = 0;
+    uint64_t peak        = 0;
+};
+
+string to_string(MemoryStats const&);
+
+// Allocation counts that may be updated from several threads, e.g. by AST
+// nodes freed after the parse that built them.
+class MemoryCounter
+{
+    public:
+        void allocated(size_t bytes);
+        void freed(size_t bytes);
+        MemoryStats stats() const;
+
+    private:
+        std::atomic<uint64_t> _bytes{0};
+        std::atomic<uint64_t> _allocations{0};
+        std::atomic<uint64_t> _live{0};
+        std::atomic<uint64_t> _peak{0};
+};
+
+// Heap blocks holding the parser combinators' std::function closures. The
+// grammar is built once, so this is process-wide.
+MemoryCounter& closure_memory();
+
+// Forwards to an upstream resource, counting what passes through.
+class CountingResource : public std::pmr::memory_resource
+{
+    public:
+        explicit CountingResource(
+            std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+
+        MemoryStats stats() const;
+
+    private:
+        std::pmr::memory_resource* _upstream;
+        MemoryCounter              _counter;
+
+        void* do_allocate(size_t bytes, size_t align) override;
+        void do_deallocate(void* p, size_t bytes, size_t align) override;
+        bool do_is_equal(std::pmr::memory_resource const&) const noexcept override;
+};
+
+// For objects that outlive whoever counts them, such as AST nodes built by
+// std::allocate_shared: every block keeps its resource alive.
+template <typename T>
+struct CountingAllocator
+{
+    using value_type = T;
+
+    std::shared_ptr<CountingResource> resource;
+
+    CountingAllocator(std::shared_ptr<CountingResource> _resource)
+        : resource(std::move(_resource))
+    {}
+
+    template <typename U>
+    CountingAllocator(CountingAllocator<U> const& other)
+        : resource(other.resource)
+    {}
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(resource->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        resource->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    template <typename U>
+    bool operator==(CountingAllocator<U> const& other) const
+    {
+        return resource == other.resource;
+    }
+
+    template <typename U>
+    bool operator!=(CountingAllocator<U> const& other) const
+    {
+        return resource != other.resource;
+    }
+};
@@ -1,18 +1,34 @@
 #include "parser.hpp"
+#include "astindex.hpp"
 #include "tokens.hpp"
 #include "parsestate.hpp"
 #include "parsercombi.hpp"
-#include <iostream>
+#include "prescan.hpp"
+#include <ostream>
 
 using namespace std;
 
 
 //// HELPERS ////
 
+// Nodes are counted against the parse that builds them; see ParseStats::ast.
+template <typename T, typename... Args>
+ASTPtr new_ast(Args&&... args)
+{
+    shared_ptr<CountingResource> const& memory = current_ast_memory();
+
+    if (!memory)
+    {
+        return make_shared<T>(std::forward<Args>(args)...);
+    }
+
+    return allocate_shared<T>(CountingAllocator<T>(memory), std::forward<Args>(args)...);
+}
+
 template <typename T>
 auto make_ast = [](auto&&... args) -> Parsed<ASTPtr>
 {
-    return make_shared<T>(std::move(args)...);
+    return new_ast<T>(std::move(args)...);
 };
 
 template <typename T>
@@ -28,6 +44,123 @@ Parser<Op> parse_op(Op op)
 }
 
 
+//// RECOVERY ////
+
+// Only "name name (" starts a function, so it is safe to resynchronize at.
+static bool at_func_header(ParseState const& s)
+{
+    return s.peek_kind(0) == tok_kind<VarTok>
+        && s.peek_kind(1) == tok_kind<VarTok>
+        && s.peek_kind(2) == tok_kind<LParTok>;
+}
+
+static ASTPtr recovered(ParseState const& s)
+{
+    return new_ast<ASTError>(s.diagnostics().back().message);
+}
+
+// Skips a malformed statement through its ';', or up to the '}' or function
+// header that ends the block. Fails where there is nothing to skip, so the
+// statement loop ends. A bracketed group is skipped whole where a prescan
+// matched it, so a ';' or '}' inside it does not end the statement.
+Parser<ASTPtr> parse_stmt_recovery()
+{
+    Parser<ASTPtr> p = [](ParseState& s) -> Parsed<ASTPtr>
+    {
+        if (!s.recovering() || s.at_end() 
+            || s.peek_kind() == tok_kind<RBraceTok> || at_func_header(s))
+        {
+            return nullopt;
+        }
+
+        if (!s.recover())
+        {
+            return nullopt;
+        }
+
+        do
+        {
+            s.set_pos(s.group_end(s.pos()) + 1);
+        }
+        while (!s.at_end() 
+            && s.peek_kind() != tok_kind<SemiTok>
+            && s.peek_kind() != tok_kind<RBraceTok> 
+            && !at_func_header(s));
+
+        if (s.peek_kind() == tok_kind<SemiTok>)
+        {
+            s.set_pos(s.pos() + 1);
+        }
+
+        return recovered(s);
+    };
+
+    return TRACE
+        /= p;
+}
+
+// Accepts a missing '}' where the next function or the end of input shows
+// the block is over.
+Parser<> parse_missing_rbrace()
+{
+    Parser<> p = [](ParseState& s) -> Parsed<>
+    {
+        if (!s.recovering() || !(s.at_end() || at_func_header(s)))
+        {
+            return nullopt;
+        }
+
+        if (!s.recover(string("missing '}' before ") + (s.at_end() ? "end of input" : "function header")))
+        {
+            return nullopt;
+        }
+
+        return tuple<>();
+    };
+
+    return TRACE
+        /= p;
+}
+
+// Skips a function that failed before its body up to the next function
+// header. If it failed past its cut, the halt is lifted before TRACE, which
+// takes no steps in a halted parse; the skip only goes forward. Matched
+// brackets are skipped whole, so nothing inside a body is taken for a header.
+Parser<ASTPtr> parse_func_recovery()
+{
+    Parser<ASTPtr> skip = [](ParseState& s) -> Parsed<ASTPtr>
+    {
+        do
+        {
+            s.set_pos(s.group_end(s.pos()) + 1);
+        }
+        while (!s.at_end() && !at_func_header(s));
+
+        return recovered(s);
+    };
+
+    skip = TRACE
+        /= skip;
+
+    return closure<Parser<ASTPtr>>([=](ParseState& s) -> Parsed<ASTPtr>
+    {
+        if (!s.recovering() || s.at_end())
+        {
+            return nullopt;
+        }
+
+        unsigned const start = std::max(s.pos(), s.committed());
+
+        if (!s.recover())
+        {
+            return nullopt;
+        }
+
+        s.set_pos(start);
+        return skip(s);
+    });
+}
+
 //// PARSERS ////
 
 Parser<ASTPtr> parse_exp();
@@ -39,7 +172,7 @@ Parser<ASTPtr> parse_num()
         /= parse_token<NumTok> 
         >> [](NumTok t) -> Parsed<ASTPtr> 
         { 
-            return make_shared<ASTNum>(t.value);
+            return new_ast<ASTNum>(t.value);
         };
 }
 
@@ -49,7 +182,7 @@ Parser<ASTPtr> parse_var()
         /= parse_token<VarTok>
         >> [](VarTok t) -> Parsed<ASTPtr>
         {
-            return make_shared<ASTVar>(t.value);
+            return new_ast<ASTVar>(t.value);
         };
 }
 
@@ -76,7 +209,6 @@ Parser<string> parse_name()
 Parser<Op> parse_unary_op()
 {
     return TRACE
-        /= MEMO
         /= parse_op<NotTok>(Op::opNot)
          | parse_op<SubTok>(Op::opNeg);
 }
@@ -84,7 +216,6 @@ Parser<Op> parse_unary_op()
 Parser<Op> parse_multive_op()
 {
     return TRACE
-        /= MEMO
         /= parse_op<MulTok>(Op::opMul) 
          | parse_op<DivTok>(Op::opDiv);
 }
@@ -92,7 +223,6 @@ Parser<Op> parse_multive_op()
 Parser<Op> parse_additive_op() 
 {
     return TRACE
-        /= MEMO
         /= parse_op<AddTok>(Op::opAdd) 
          | parse_op<SubTok>(Op::opSub);
 }
@@ -100,7 +230,6 @@ Parser<Op> parse_additive_op()
 Parser<Op> parse_logical_op() 
 {
     return TRACE
-        /= MEMO
         /= parse_op<AndTok>(Op::opAnd)
          | parse_op<OrTok>(Op::opOr);
 }
@@ -110,7 +239,7 @@ Parser<ASTPtr> parse_unary()
     return TRACE
         /= MEMO
         /= parse_unary_op()
-        >> lazy(parse_primary) 
+        >> lazy<parse_primary>() 
         >> make_ast<ASTUnop>;
 }
 
@@ -119,7 +248,7 @@ Parser<ASTPtr> parse_parens_exp()
     return TRACE
         /= MEMO
         /= match<LParTok>() 
-        >> lazy(parse_exp) 
+        >> lazy<parse_exp>() 
         >> match<RParTok>();
 }
 
@@ -137,9 +266,9 @@ Parser<ASTPtr> parse_multive()
 {
     return TRACE
         /= MEMO
-        /= parse_primary()
+        /= lazy<parse_multive>() 
         >> parse_multive_op()
-        >> lazy(parse_multive) 
+        >> parse_primary()
         >> make_ast<ASTBinop>
          | parse_primary();
 }
@@ -148,9 +277,9 @@ Parser<ASTPtr> parse_additive()
 {
     return TRACE
         /= MEMO
-        /= parse_multive() 
+        /= lazy<parse_additive>()
         >> parse_additive_op()
-        >> lazy(parse_additive)
+        >> parse_multive() 
         >> make_ast<ASTBinop>
          | parse_multive();
 }
@@ -159,9 +288,9 @@ Parser<ASTPtr> parse_logical()
 {
     return TRACE
         /= MEMO
-        /= parse_additive()
+        /= lazy<parse_logical>() 
         >> parse_logical_op()
-        >> lazy(parse_logical) 
+        >> parse_additive()
         >> make_ast<ASTBinop>
          | parse_additive();
 }
@@ -169,14 +298,12 @@ Parser<ASTPtr> parse_logical()
 Parser<ASTPtr> parse_exp()
 {
     return TRACE
-        /= MEMO
         /= parse_logical();
 }
 
 Parser<ASTPtr> parse_var_decl()
 {
     return TRACE
-        /= MEMO
         /= parse_name()
         >> parse_name()
         >> match<AssignTok>() 
@@ -187,7 +314,6 @@ Parser<ASTPtr> parse_var_decl()
 Parser<ASTPtr> parse_assign()
 {
     return TRACE
-        /= MEMO
         /= parse_name()
         >> match<AssignTok>()
         >> parse_exp() 
@@ -208,8 +334,8 @@ Parser<ASTPtr> parse_block()
 {
     return TRACE
         /= match<LBraceTok>()
-        >> zero_or_more(parse_stmt())
-        >> match<RBraceTok>()
+        >> zero_or_more(parse_stmt() | parse_stmt_recovery())
+        >> (match<RBraceTok>() | parse_missing_rbrace())
         >> make_ast<ASTBlock>;
 }
 
@@ -221,10 +347,13 @@ Parser<Arg> parse_arg()
         >> construct<Arg>;
 }
 
+// "name name (" can only start a function, so nothing before it will be
+// revisited: commit there to keep memo memory per function, not per file.
 Parser<vector<Arg>> parse_formal_args()
 {
     return TRACE
         /= match<LParTok>()
+        >> cut()
         >> parse_list(parse_arg())
         >> match<RParTok>();
 }
@@ -242,17 +371,245 @@ Parser<ASTPtr> parse_func()
 Parser<ASTPtr> parse_program()
 {
     return TRACE
-        /= zero_or_more(parse_func())
+        /= zero_or_more(parse_func() | parse_func_recovery())
         >> parse_end()
         >> make_ast<ASTProgram>;
 }
 
-Parsed<ASTPtr> parse(vector<Tok>const& tokens)
+static void report(ParseError const& error, ParseOptions const& opts, 
+    char const* what = "Parse failed at ")
+{
+    if (opts.log)
+    {
+        *opts.log << what << to_string(error) << "\n";
+    }
+
+    if (opts.errors)
+    {
+        opts.errors->push_back(error);
+    }
+}
+
+// Counter totals for ParseOptions::perf; an empty sample without it.
+static PerfSample perf_read(ParseOptions const& opts)
+{
+    return opts.perf ? opts.perf->counters->read() : PerfSample();
+}
+
+static void perf_add(ParseOptions const& opts, char const* phase, PerfSample const& start)
+{
+    if (opts.perf)
+    {
+        opts.perf->add(phase, opts.perf->counters->read() - start);
+    }
+}
+
+// See ParseOptions::prescan. False if the tokens were rejected, which is
+// then reported as the parse's failure.
+static bool run_prescan(ParseState& state, uint8_t const* kinds, size_t count, ParseOptions const& opts)
+{
+    vector<uint32_t> brackets;
+    ParseError error;
+    PerfSample const start = perf_read(opts);
+
+    if (opts.recover)
+    {
+        if (match_brackets(kinds, count, &brackets))
+        {
+            state.set_brackets(std::move(brackets));
+        }
+
+        perf_add(opts, "prescan", start);
+        return true;
+    }
+
+    bool const ok = prescan(kinds, count, &brackets, &error);
+    perf_add(opts, "prescan", start);
+
+    if (!ok)
+    {
+        if (opts.stats)
+        {
+            *opts.stats = state.final_stats();
+        }
+
+        report(error, opts);
+        return false;
+    }
+
+    state.set_brackets(std::move(brackets));
+    return true;
+}
+
+// The grammar holds no per-parse state, so its closures are built only once.
+static Parser<ASTPtr> const& program_parser()
+{
+    static Parser<ASTPtr> const parser = parse_program();
+    return parser;
+}
+
+vector<string> parser_rules()
+{
+    program_parser();
+    return traced_rules();
+}
+
+static Parsed<ASTPtr> run_program(ParseState& state, ParseOptions const& opts)
 {
-    std::cout << "Parsing " << to_string(tokens) << "\n";
-    ParseState state(tokens);
-    Parser<ASTPtr> parser = parse_program();
-    Parsed<ASTPtr> result = parser(state);
-    state.print_trace();
+    PerfSample const start = perf_read(opts);
+    Parsed<ASTPtr> result = program_parser()(state);
+    perf_add(opts, "parse", start);
+
+    if (state.halted())
+    {
+        result = nullopt;
+    }
+
+    if (opts.stats)
+    {
+        *opts.stats = state.final_stats();
+    }
+
+    if (opts.trace)
+    {
+        PerfSample const traced = perf_read(opts);
+        state.print_trace(*opts.trace);
+        perf_add(opts, "trace", traced);
+    }
+
+    for (ParseError const& e : state.diagnostics())
+    {
+        report(e, opts, "Recovered from syntax error at ");
+    }
+
+    if (!result)
+    {
+        report(state.error(), opts);
+    }
+    else if (opts.index)
+    {
+        opts.index->add(std::get<0>(*result));
+    }
+
     return result;
 }
+
+Parsed<ASTPtr> parse(vector<Tok> const& tokens, ParseOptions const& opts)
+{
+    if (opts.log)
+    {
+        *opts.log << "Parsing";
+
+        for (Tok const& tok : tokens)
+        {
+            *opts.log << " " << to_string(tok);
+        }
+
+        *opts.log << "\n";
+    }
+
+    ParseState state(tokens, opts);
+
+    if (opts.prescan)
+    {
+        vector<uint8_t> const kinds = token_kinds(tokens);
+
+        if (!run_prescan(state, kinds.data(), kinds.size(), opts))
+        {
+            return nullopt;
+        }
+    }
+
+    return run_program(state, opts);
+}
+
+Parsed<ASTPtr> parse(TokenView const& tokens, ParseOptions const& opts)
+{
+    if (opts.log)
+    {
+        *opts.log << "Parsing";
+
+        for (size_t i = 0; i < tokens.size(); ++i)
+        {
+            *opts.log << " " << to_string(tokens.tok(i));
+        }
+
+        *opts.log << "\n";
+    }
+
+    ParseState state(tokens, opts);
+
+    if (opts.prescan && !run_prescan(state, tokens.kinds(), tokens.size(), opts))
+    {
+        return nullopt;
+    }
+
+    return run_program(state, opts);
+}
+
+// Same language as parse_program: functions until the end of input.
+bool parse_stream(TokenSource& source, FuncCallback const& on_func, ParseOptions const& opts)
+{
+    static Parser<ASTPtr> const func = parse_func() | parse_func_recovery();
+    static Parser<> const end = parse_end();
+
+    ParseState state(source, opts);
+    bool ok = true;
+    PerfSample const start = perf_read(opts);
+
+    while (true)
+    {
+        state.discard_consumed();
+
+        if (end(state))
+        {
+            break;
+        }
+
+        Parsed<ASTPtr> r = func(state);
+
+        if (!r || state.halted())
+        {
+            ok = false;
+            break;
+        }
+
+        ASTPtr const& ast = std::get<0>(*r);
+
+        if (ast->kind() == ASTKind::func)
+        {
+            if (opts.index)
+            {
+                opts.index->add(ast);
+            }
+
+            on_func(std::static_pointer_cast<ASTFunc>(ast));
+        }
+    }
+
+    perf_add(opts, "parse", start);
+
+    for (ParseError const& e : state.diagnostics())
+    {
+        report(e, opts, "Recovered from syntax error at ");
+    }
+
+    if (!ok)
+    {
+        report(state.error(), opts);
+    }
+
+    if (opts.trace)
+    {
+        PerfSample const traced = perf_read(opts);
+        state.print_trace(*opts.trace);
+        perf_add(opts, "trace", traced);
+    }
+
+    if (opts.stats)
+    {
+        *opts.stats = state.final_stats();
+    }
+
+    return ok;
+}
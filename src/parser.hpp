@@ -3,4 +3,21 @@
 #include "ast.hpp"
 #include "parsercombi.hpp"
 
-Parsed<ASTPtr> parse(vector<Tok> const&);
+Parsed<ASTPtr> parse(vector<Tok> const&, ParseOptions const& = ParseOptions());
+
+// Parses tokens in place, e.g. from a mapped TokenFile, without a vector<Tok>.
+Parsed<ASTPtr> parse(TokenView const&, ParseOptions const& = ParseOptions());
+
+using FuncCallback = function<void(shared_ptr<ASTFunc> const&)>;
+
+// Parses a program function by function, pulling tokens from the source
+// opts.window at a time. Each ASTFunc goes to the callback as soon as it is
+// complete, and the tokens and memo state behind it are then released, so
+// memory is bounded by the largest function rather than the input.
+// Returns false on a syntax error, after which no more callbacks are made;
+// with opts.recover, malformed functions are skipped and reported instead.
+bool parse_stream(TokenSource&, FuncCallback const&, ParseOptions const& = ParseOptions());
+
+// The rule names TRACE gives the parser's rules, match<T>() included; what
+// check_grammar() holds grammar() to.
+vector<string> parser_rules();
@@ -1,7 +1,9 @@
 #pragma once
 
+#include "ast.hpp"
 #include "parsestate.hpp"
 #include "tokens.hpp"
+#include <algorithm>
 #include <optional>
 #include <tuple>
 #include <functional>
@@ -26,6 +28,67 @@ using Parser = RParser<Parsed<Ts...>>;
 template <typename R, typename... Ts>
 using Finisher = function<Parsed<R>(Ts...)>;
 
+// std::function takes no allocator since C++17, so the heap blocks holding
+// combinator closures are counted through the closures themselves: libstdc++
+// moves or copies a closure into each block and destroys it on release.
+template <typename F>
+class CountedClosure
+{
+    public:
+        explicit CountedClosure(F f)
+            : _f(std::move(f))
+        {}
+
+        CountedClosure(CountedClosure const& other)
+            : _f(other._f)
+            , _counted(true)
+        {
+            closure_memory().allocated(sizeof(CountedClosure));
+        }
+
+        CountedClosure(CountedClosure&& other)
+            : _f(std::move(other._f))
+            , _counted(true)
+        {
+            closure_memory().allocated(sizeof(CountedClosure));
+        }
+
+        ~CountedClosure()
+        {
+            if (_counted)
+            {
+                closure_memory().freed(sizeof(CountedClosure));
+            }
+        }
+
+        CountedClosure& operator=(CountedClosure const&) = delete;
+
+        template <typename... A>
+        auto operator()(A&&... args) const
+        {
+            return _f(std::forward<A>(args)...);
+        }
+
+    private:
+        F    _f;
+        bool _counted = false; // False for the temporary it is built from.
+};
+
+// Small trivially copyable closures are stored inline, so only the others
+// are wrapped.
+template <typename Fn, typename F>
+Fn closure(F f)
+{
+    if constexpr (std::is_trivially_copyable_v<F> && sizeof(F) <= 2 * sizeof(void*))
+    {
+        return Fn(std::move(f));
+    }
+    else
+    {
+        return Fn(CountedClosure<F>(std::move(f)));
+    }
+}
+
 struct TraceTag { string func; };
 struct MemoTag  { string func; };
 struct NullTag {};
@@ -39,59 +102,261 @@ Parser<R...> operator /=(NullTag const&, Parser<R...> const& p)
     return p;
 }
 
-template <typename... R>
-Parser<R...> operator /=(TraceTag const& trace, Parser<R...> const& p)
+inline
+bool _contains(vector<unsigned> const& v, unsigned x)
+{
+    return std::find(v.begin(), v.end(), x) != v.end();
+}
+
+// A recursive call reached a rule still in progress at the same position:
+// every frame above that rule's own frame is involved in the recursion.
+template <typename V>
+void _setup_lr(ParseState& s, unsigned rule, MemoEntry<V>& m)
 {
-    return [=](ParseState& s) -> Parsed<R...>
+    LRHead*& head = m.lr ? m.lr->head : m.lr_head;
+
+    if (!head)
     {
-        s.push_trace(trace.func + " " + to_string(s.cur()));
+        head = s.new_lr_head(rule);
+    }
 
-        auto r = p(s);
+    for (LRFrame* f = s.lr_stack(); f && f->head != head; f = f->next)
+    {
+        f->head = head;
 
-        if (r)
+        if (!_contains(head->involved, f->rule))
         {
-            s.pop_trace_success();
+            head->involved.push_back(f->rule);
         }
-        else
+    }
+}
+
+// Answers (rule, position) from the memo table, or runs f and records it.
+//
+// Left recursion is handled by seed growing: a rule that re-enters itself at
+// the same position first sees failure, the resulting parse becomes the seed,
+// and the body is then re-run with the seed memoized until it stops getting
+// longer. Long left-recursive chains are therefore parsed by iteration.
+//
+// With memoization turned off entries are still needed to detect recursion,
+// but plain results are dropped as soon as the rule returns.
+template <typename V, typename F>
+V memoized(ParseState& s, unsigned rule, F const& f)
+{
+    using Entry = MemoEntry<V>;
+
+    auto& map = s.memo<V>(rule);
+    unsigned const start_pos = s.pos();
+    auto const it = map.find(start_pos);
+    Entry* m = it == map.end() ? nullptr : &it->second;
+
+    if (LRHead* head = s.growing_at(start_pos))
+    {
+        bool const involved = rule == head->rule || _contains(head->involved, rule);
+
+        if (!m && !involved && s.memoizing())
+        {
+            return V();
+        }
+
+        auto const eval = std::find(head->eval.begin(), head->eval.end(), rule);
+
+        if (m && eval != head->eval.end())
+        {
+            head->eval.erase(eval);
+            m->value = f(s);
+            m->end_pos = s.pos();
+            m->lr_head = nullptr;
+        }
+    }
+
+    if (m)
+    {
+        s.set_pos(m->end_pos);
+
+        if (m->lr || m->lr_head)
+        {
+            _setup_lr(s, rule, *m);
+        }
+
+        return m->value;
+    }
+
+    LRFrame frame{rule};
+    s.push_lr(frame);
+    m = &map.insert({start_pos, Entry{V(), start_pos, &frame}}).first->second;
+    s.memo_added();
+
+    V r = f(s);
+
+    s.pop_lr();
+    m->lr = nullptr;
+    m->value = r;
+    m->end_pos = s.pos();
+
+    if (!frame.head)
+    {
+        if (!s.memoizing())
         {
-            s.pop_trace_failure();
+            map.erase(start_pos);
+            s.memo_erased();
         }
 
         return r;
-    };
+    }
+
+    if (frame.head->rule != rule)
+    {
+        m->lr_head = frame.head;
+        return r;
+    }
+
+    if (r)
+    {
+        s.set_growing(start_pos, frame.head);
+
+        while (true)
+        {
+            s.set_pos(start_pos);
+            frame.head->eval = frame.head->involved;
+            V grown = f(s);
+
+            if (!grown || s.pos() <= m->end_pos)
+            {
+                break;
+            }
+
+            m->value = std::move(grown);
+            m->end_pos = s.pos();
+        }
+
+        s.set_growing(start_pos, nullptr);
+        s.set_pos(m->end_pos);
+    }
+
+    r = m->value;
+
+    if (!s.memoizing())
+    {
+        map.erase(start_pos);
+        s.memo_erased();
+    }
+
+    return r;
 }
 
 template <typename... R>
-Parser<R...> operator /=(MemoTag const& memo, Parser<R...> const& p)
+Parsed<R...> traced(ParseState& s, string const& func, Parser<R...> const& p)
+{
+    s.push_trace(func + " " + to_string(s.cur()));
+
+    auto r = p(s);
+
+    if (r)
+    {
+        s.pop_trace_success();
+    }
+    else
+    {
+        s.pop_trace_failure();
+    }
+
+    return r;
+}
+
+template <typename... R>
+void _set_span(ParseState&, unsigned, Parsed<R...>&)
+{}
+
+// A rule stamps the node it built with the tokens it consumed. Nodes passed
+// up unchanged through enclosing rules keep their innermost span. A stream
+// can run past 2^32 tokens; positions beyond that saturate rather than wrap.
+inline
+void _set_span(ParseState& s, unsigned start, Parsed<ASTPtr>& r)
+{
+    AST& ast = *std::get<0>(*r);
+
+    if (ast.span.end == 0)
+    {
+        uint64_t const limit = UINT32_MAX;
+        ast.span.begin = static_cast<uint32_t>(std::min(s.offset() + start, limit));
+        ast.span.end = static_cast<uint32_t>(std::min(s.offset() + s.pos(), limit));
+    }
+}
+
+// Every named rule is entered through here: the call is charged to the step
+// budget, traced and profiled if asked, and memoized in packrat mode or when
+// the memo plan says so.
+template <typename... R>
+Parser<R...> operator /=(TraceTag const& trace, Parser<R...> const& p)
 {
-    return [=](ParseState& s) -> Parsed<R...>
+    unsigned const rule = traced_rule_id(trace.func);
+
+    return closure<Parser<R...>>([=](ParseState& s) -> Parsed<R...>
     {
-        struct Memo
+        if (!s.step())
+        {
+            return nullopt;
+        }
+
+        auto const body = [&](ParseState& s2) -> Parsed<R...>
         {
-            Parsed<R...> value;
-            unsigned end_pos;
+            unsigned const start = s2.pos();
+            auto r = s2.tracing() ? traced(s2, trace.func, p) : p(s2);
+
+            if (r)
+            {
+                _set_span(s2, start, r);
+            }
+
+            return r;
         };
 
-        using MemoMap = unordered_map<unsigned, Memo>;
-        
-        static unordered_map<string, MemoMap> maps; 
-       
-        auto& map = maps[memo.func];
-        unsigned const start_pos = s.pos();
+        auto const run = [&](ParseState& s2) -> Parsed<R...>
+        {
+            if (s2.packrat() || s2.planned(rule))
+            {
+                return memoized<Parsed<R...>>(s2, rule, body);
+            }
 
-        auto const it = map.find(start_pos);
+            return body(s2);
+        };
 
-        if (it != map.end())
+        if (s.profiling())
         {
-            s.set_pos(it->second.end_pos);
-            return it->second.value;
+            unsigned const pos = s.pos();
+            uint64_t const steps = s.stats().steps;
+            bool const sampled = s.sample_begin(rule);
+            auto r = run(s);
+
+            if (sampled)
+            {
+                s.sample_end(rule);
+            }
+
+            s.profile(rule, pos, steps);
+            return r;
         }
 
-        auto r = p(s);
-        unsigned const end_pos = s.pos();
-        map.insert({start_pos, Memo{r, end_pos}});
-        return r;
-    };
+        return run(s);
+    });
+}
+
+template <typename... R>
+Parser<R...> operator /=(MemoTag const& memo, Parser<R...> const& p)
+{
+    unsigned const rule = rule_id(memo.func);
+
+    return closure<Parser<R...>>([=](ParseState& s) -> Parsed<R...>
+    {
+        // With packrat or a plan, the enclosing TRACE decides instead.
+        if (s.packrat() || s.has_plan())
+        {
+            return p(s);
+        }
+
+        return memoized<Parsed<R...>>(s, rule, p);
+    });
 }
 
 template <typename T>
@@ -117,7 +382,7 @@ Parser<> parse_end()
 {
     Parser<> p = [](ParseState& s) -> Parsed<>
     {
-        if (s.at_end())
+        if (s.match_end())
         {
             return tuple<>();
         }
@@ -131,35 +396,40 @@ Parser<> parse_end()
         /= p;
 }
 
-template <typename T>
-Finisher<T> value(T t)
+// Commits to everything parsed so far. Memo entries that start before this
+// point are freed, and backtracking behind it fails the whole parse, so only
+// place a cut where no alternative could start earlier.
+inline
+Parser<> cut()
 {
-    return [=]() -> Parsed<T>
+    return [](ParseState& s) -> Parsed<>
     {
-        return t;
+        s.commit();
+        return tuple<>();
     };
 }
 
-template <typename P>
-Parser<P> lazy(Parser<P>(&f)())
+template <typename T>
+Finisher<T> value(T t)
 {
-    return [&f](ParseState& s) -> Parsed<P>
+    return closure<Finisher<T>>([=]() -> Parsed<T>
     {
-        static Parser<P> const p = f();
-        return p(s);
-    };
+        return t;
+    });
 }
 
-template <typename F,
-    typename G = std::invoke_result_t<F>,
-    typename R = std::invoke_result_t<G,ParseState&>>
-RParser<R> lazy(F const& f)
+// Defers building F's parser until first use, so rules can refer to
+// themselves. F is a template argument so that each rule gets its own cache.
+template <auto F>
+auto lazy()
 {
-    return [f](ParseState& s) -> R
+    using P = std::invoke_result_t<decltype(F)>;
+    
+    return P([](ParseState& s)
     {
-        static auto const p = f();
+        static P const p = F();
         return p(s);
-    };
+    });
 }
 
 template <typename T>
@@ -176,7 +446,7 @@ Parser<T> parse_token = [](ParseState& s) -> Parsed<T>
 template <typename... P1, typename... P2>
 Parser<P1..., P2...> operator>>(Parser<P1...> const& p1, Parser<P2...> const& p2)
 {
-    return [=](ParseState& s) -> Parsed<P1..., P2...>
+    return closure<Parser<P1..., P2...>>([=](ParseState& s) -> Parsed<P1..., P2...>
     {
         unsigned const start_pos = s.pos();
 
@@ -197,13 +467,13 @@ Parser<P1..., P2...> operator>>(Parser<P1...> const& p1, Parser<P2...> const& p2
         }
 
         return std::tuple_cat(std::move(*r1), std::move(*r2));
-    };
+    });
 }
 
 template <typename... P1, typename... P2>
 Parser<P1...> operator|(Parser<P1...> const& p1, Parser<P2...> const& p2)
 {
-    return [=](ParseState& s) -> Parsed<P1...>
+    return closure<Parser<P1...>>([=](ParseState& s) -> Parsed<P1...>
     {
         unsigned const start_pos = s.pos();
     
@@ -216,14 +486,14 @@ Parser<P1...> operator|(Parser<P1...> const& p1, Parser<P2...> const& p2)
             s.set_pos(start_pos);
             return p2(s);
         }
-    };
+    });
 }
 
 template <typename F, typename... P,
     typename R = std::invoke_result_t<F,P...>>
 RParser<R> operator>>(Parser<P...> const& p, F const& f)
 {
-    return [=](ParseState& s) -> R
+    return closure<RParser<R>>([=](ParseState& s) -> R
     {
         Parsed<P...> r = p(s);
 
@@ -231,13 +501,13 @@ RParser<R> operator>>(Parser<P...> const& p, F const& f)
             return nullopt;
 
         return std::apply(f, *r);
-    };
+    });
 }
 
 template <typename P>
 Parser<vector<P>> _parse_many(Parser<P> const& p, Parser<P> const& q)
 {
-    return [=](ParseState& s) -> Parsed<vector<P>>
+    return closure<Parser<vector<P>>>([=](ParseState& s) -> Parsed<vector<P>>
     {
         vector<P> rs;
 
@@ -256,7 +526,7 @@ Parser<vector<P>> _parse_many(Parser<P> const& p, Parser<P> const& q)
             start_pos = s.pos();
             r = q(s); // Note the q.
         }
-    };
+    });
 }
 
 template <typename P>
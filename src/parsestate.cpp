@@ -1,18 +1,173 @@
 #include "parsestate.hpp"
+#include "grammar.hpp"
+#include "prescan.hpp"
+#include <algorithm>
+#include <mutex>
+#include <utility>
 
-ParseState::ParseState(vector<Tok> const& tokens)
-    : _tokens(tokens)
-    , _tracer("", 2)
-{}
+string to_string(ParseError const& e)
+{
+    return "token " + std::to_string(e.pos) + ": " + e.message;
+}
+
+unsigned rule_id(string const& name)
+{
+    static std::mutex mutex;
+    static unordered_map<string, unsigned> ids;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return ids.insert({name, static_cast<unsigned>(ids.size())}).first->second;
+}
+
+static std::mutex g_traced_mutex;
+static vector<string> g_traced;
+
+unsigned traced_rule_id(string const& name)
+{
+    std::lock_guard<std::mutex> lock(g_traced_mutex);
+
+    if (std::find(g_traced.begin(), g_traced.end(), name) == g_traced.end())
+    {
+        g_traced.push_back(name);
+    }
+
+    return rule_id(name);
+}
+
+vector<string> traced_rules()
+{
+    std::lock_guard<std::mutex> lock(g_traced_mutex);
+    return g_traced;
+}
+
+static thread_local std::shared_ptr<CountingResource> t_ast_memory;
+
+std::shared_ptr<CountingResource> const& current_ast_memory()
+{
+    return t_ast_memory;
+}
+
+ParseState::ParseState(vector<Tok> const& tokens, ParseOptions const& opts)
+    : _memo_memory(opts.memory)
+    , _tokens(&tokens)
+    , _opts(opts)
+    , _tracer("", 2, &_tracer_memory)
+{
+    init();
+}
+
+ParseState::ParseState(TokenSource& source, ParseOptions const& opts)
+    : _memo_memory(opts.memory)
+    , _tokens(&_window)
+    , _source(&source)
+    , _opts(opts)
+    , _tracer("", 2, &_tracer_memory)
+{
+    init();
+}
+
+ParseState::ParseState(TokenView const& view, ParseOptions const& opts)
+    : _memo_memory(opts.memory)
+    , _tokens(&_window)
+    , _view(&view)
+    , _opts(opts)
+    , _tracer("", 2, &_tracer_memory)
+{
+    init();
+}
+
+ParseState::~ParseState()
+{
+    t_ast_memory = std::move(_outer_ast_memory);
+    _token_memory.freed(_token_bytes + _brackets.capacity() * sizeof(uint32_t));
+}
+
+void ParseState::init()
+{
+    // Counting costs every node a larger control block and atomic updates,
+    // so only a parse asked for stats pays it. A nested parse without stats
+    // still hides the outer one's resource, so its nodes are not counted.
+    if (_opts.stats)
+    {
+        _ast_memory = std::make_shared<CountingResource>();
+    }
+
+    _outer_ast_memory = std::exchange(t_ast_memory, _ast_memory);
+    _closures_before = closure_memory().stats();
+    account_tokens();
+
+    if (_opts.memo_plan)
+    {
+        _required_plan = &required_memo_plan();
+    }
+
+    if (_opts.perf)
+    {
+        for (size_t i = 0; i < _opts.perf->rules.size(); ++i)
+        {
+            unsigned const rule = rule_id(_opts.perf->rules[i].name);
+            _sample_slot.resize(std::max<size_t>(_sample_slot.size(), rule + 1), -1);
+            _sample_slot[rule] = static_cast<int>(i);
+        }
+
+        _sampling.resize(_opts.perf->rules.size());
+    }
+}
+
+// The token array is not ours to allocate, so follow its capacity instead.
+// A view allocates nothing per token.
+void ParseState::account_tokens() const
+{
+    if (_view)
+    {
+        return;
+    }
+
+    size_t const bytes = _tokens->capacity() * sizeof(Tok);
+
+    if (bytes != _token_bytes)
+    {
+        _token_memory.freed(_token_bytes);
+        _token_memory.allocated(bytes);
+        _token_bytes = bytes;
+    }
+}
+
+size_t ParseState::token_count() const
+{
+    return _view ? _view->size() : _tokens->size();
+}
+
+Tok const& ParseState::token(size_t i) const
+{
+    if (_view)
+    {
+        _scratch = _view->tok(i);
+        return _scratch;
+    }
+
+    return (*_tokens)[i];
+}
 
 Tok const& ParseState::cur_unchecked() const
 {
-    return _tokens[_pos];
+    return token(_pos);
+}
+
+bool ParseState::refill() const
+{
+    if (!_source || _source->read(_window, std::max<size_t>(_opts.window, 1)) == 0)
+    {
+        return false;
+    }
+
+    account_tokens();
+    return true;
 }
 
 bool ParseState::at_end() const
 {
-    return _pos >= _tokens.size();
+    return _pos >= token_count() && !refill();
 }
 
 unsigned ParseState::pos() const
@@ -34,11 +189,183 @@ Tok const& ParseState::cur() const
     }
 }
 
+// EndTok past the end of input.
+Tok const& ParseState::peek(unsigned ahead) const
+{
+    static Tok const end = EndTok{};
+
+    while (_pos + ahead >= token_count())
+    {
+        if (!refill())
+        {
+            return end;
+        }
+    }
+
+    return token(_pos + ahead);
+}
+
+// peek(ahead) without building a Tok: a view answers from its kind byte.
+size_t ParseState::peek_kind(unsigned ahead) const
+{
+    while (_pos + ahead >= token_count())
+    {
+        if (!refill())
+        {
+            return tok_kind<EndTok>;
+        }
+    }
+
+    size_t const i = _pos + ahead;
+    return _view ? _view->kind(i) : (*_tokens)[i].index();
+}
+
+bool ParseState::tracing() const
+{
+    return _opts.trace != nullptr;
+}
+
+bool ParseState::memoizing() const
+{
+    return _opts.memoize || _opts.packrat;
+}
+
+bool ParseState::packrat() const
+{
+    return _opts.packrat;
+}
+
+bool ParseState::has_plan() const
+{
+    return _opts.memo_plan != nullptr;
+}
+
+bool ParseState::planned(unsigned rule) const
+{
+    return _opts.memo_plan && (_opts.memo_plan->contains(rule) || _required_plan->contains(rule));
+}
+
+// Rule calls are wrapped for the profile, or to sample counters.
+bool ParseState::profiling() const
+{
+    return _opts.profile != nullptr || !_sample_slot.empty();
+}
+
+void ParseState::profile(unsigned rule, unsigned pos, uint64_t steps_before)
+{
+    if (!_opts.profile)
+    {
+        return;
+    }
+
+    RuleProfile& p = *_opts.profile;
+
+    if (rule >= p.rules.size())
+    {
+        p.rules.resize(rule + 1);
+    }
+
+    RuleProfile::Counts& c = p.rules[rule];
+    ++c.calls;
+    c.steps += _stats.steps - steps_before;
+
+    uint64_t const key = (static_cast<uint64_t>(rule) << 32) | (_offset + pos);
+
+    if (!p.seen.insert(key).second)
+    {
+        ++c.repeats;
+    }
+}
+
+// True if this call of the rule is measured; sample_end() must then follow.
+bool ParseState::sample_begin(unsigned rule)
+{
+    if (rule >= _sample_slot.size() || _sample_slot[rule] < 0)
+    {
+        return false;
+    }
+
+    size_t const slot = static_cast<size_t>(_sample_slot[rule]);
+    PerfReport::Entry& e = _opts.perf->rules[slot];
+
+    if (e.calls++ % std::max(_opts.perf->sample_every, 1u) != 0 || _sampling[slot])
+    {
+        return false;
+    }
+
+    _sampling[slot] = true;
+    _sample_starts.push_back(_opts.perf->counters->read());
+    return true;
+}
+
+void ParseState::sample_end(unsigned rule)
+{
+    PerfSample const end = _opts.perf->counters->read();
+    size_t const slot = static_cast<size_t>(_sample_slot[rule]);
+    PerfReport::Entry& e = _opts.perf->rules[slot];
+
+    e.total += end - _sample_starts.back();
+    ++e.samples;
+    _sample_starts.pop_back();
+    _sampling[slot] = false;
+}
+
+bool ParseState::halted() const
+{
+    return _halted != Halt::none;
+}
+
+ParseStats const& ParseState::stats() const
+{
+    return _stats;
+}
+
+ParseStats ParseState::final_stats() const
+{
+    ParseStats s = _stats;
+    s.tokens = _token_memory.stats();
+    s.tracer = _tracer_memory.stats();
+    s.memo = _memo_memory.stats();
+    s.ast = _ast_memory ? _ast_memory->stats() : MemoryStats();
+    s.closures = closure_memory().stats();
+    s.closures.bytes -= _closures_before.bytes;
+    s.closures.allocations -= _closures_before.allocations;
+    return s;
+}
+
+// Once halted, every rule fails immediately so the parse unwinds quickly.
+bool ParseState::step()
+{
+    ++_stats.steps;
+
+    if (_opts.max_steps && _stats.steps > _opts.max_steps && !halted())
+    {
+        _halted = Halt::budget;
+    }
+
+    return !halted();
+}
+
 void ParseState::set_pos(unsigned pos)
 {
-    if (pos > _tokens.size())
+    if (pos < _pos)
+    {
+        ++_stats.rewinds;
+
+        if (_opts.max_rewinds && _stats.rewinds > _opts.max_rewinds && !halted())
+        {
+            _halted = Halt::budget;
+        }
+
+        if (pos < _committed && !halted())
+        {
+            _halted = Halt::cut;
+        }
+    }
+
+    if (pos > token_count())
     {
-        _pos = static_cast<unsigned>(_tokens.size());
+        _pos = static_cast<unsigned>(token_count());
     }
     else
     {
@@ -46,6 +373,154 @@ void ParseState::set_pos(unsigned pos)
     }
 }
 
+void ParseState::expect(size_t kind)
+{
+    uint32_t const bit = 1u << kind;
+
+    if (_pos > _furthest)
+    {
+        _furthest = _pos;
+        _expected = bit;
+    }
+    else if (_pos == _furthest)
+    {
+        _expected |= bit;
+    }
+}
+
+bool ParseState::match_end()
+{
+    if (at_end())
+    {
+        return true;
+    }
+
+    expect(tok_kind<EndTok>);
+    return false;
+}
+
+LRFrame* ParseState::lr_stack() const
+{
+    return _lr_stack;
+}
+
+void ParseState::push_lr(LRFrame& frame)
+{
+    frame.next = _lr_stack;
+    _lr_stack = &frame;
+}
+
+void ParseState::pop_lr()
+{
+    _lr_stack = _lr_stack->next;
+}
+
+LRHead* ParseState::new_lr_head(unsigned rule)
+{
+    _lr_heads.push_back(LRHead{rule, {}, {}});
+    return &_lr_heads.back();
+}
+
+LRHead* ParseState::growing_at(unsigned pos) const
+{
+    if (_growing.empty())
+    {
+        return nullptr;
+    }
+
+    auto const it = _growing.find(pos);
+    return it == _growing.end() ? nullptr : it->second;
+}
+
+void ParseState::set_growing(unsigned pos, LRHead* head)
+{
+    if (head)
+    {
+        _growing[pos] = head;
+    }
+    else
+    {
+        _growing.erase(pos);
+    }
+}
+
+void ParseState::commit()
+{
+    _committed = _pos;
+    unsigned limit = _pos;
+
+    // A seed being grown is re-read on every round, so keep its position.
+    for (auto const& [pos, head] : _growing)
+    {
+        limit = std::min(limit, pos);
+    }
+
+    for (unique_ptr<MemoTableBase>& table : _memo)
+    {
+        if (table)
+        {
+            _memo_entries -= table->erase_below(limit);
+        }
+    }
+}
+
+void ParseState::memo_added()
+{
+    _stats.memo_peak = std::max(_stats.memo_peak, ++_memo_entries);
+}
+
+void ParseState::memo_erased()
+{
+    --_memo_entries;
+}
+
+unsigned ParseState::committed() const
+{
+    return _committed;
+}
+
+// Only valid between top-level rules, when nothing is in progress: drops the
+// tokens before pos() along with all memo and left-recursion state, and
+// renumbers positions so the next token is 0.
+void ParseState::discard_consumed()
+{
+    if (!_source)
+    {
+        return;
+    }
+
+    _window.erase(_window.begin(), _window.begin() + static_cast<ptrdiff_t>(_pos));
+    _offset += _pos;
+
+    if (_furthest >= _pos)
+    {
+        _furthest -= _pos;
+    }
+    else
+    {
+        _furthest = 0;
+        _expected = 0;
+    }
+
+    _pos = 0;
+    _committed = 0;
+
+    for (unique_ptr<MemoTableBase>& table : _memo)
+    {
+        if (table)
+        {
+            _memo_entries -= table->erase_below(~0u);
+        }
+    }
+
+    _lr_heads.clear();
+}
+
+uint64_t ParseState::offset() const
+{
+    return _offset;
+}
+
 void ParseState::push_trace(string const& label)
 {
     _tracer.push(label);
@@ -61,8 +536,94 @@ void ParseState::pop_trace_failure()
     _tracer.pop(TraceResult::failure);
 }
 
-void ParseState::print_trace()
+void ParseState::print_trace(std::ostream& out)
 {
     _tracer.finalize();
-    _tracer.print();
+    _tracer.print(out);
+}
+
+ParseError ParseState::error() const
+{
+    if (_halted == Halt::budget)
+    {
+        return ParseError{_offset + _pos, "parse abandoned after " 
+            + std::to_string(_stats.steps) + " steps and " 
+            + std::to_string(_stats.rewinds) + " rewinds (budget exceeded)"};
+    }
+
+    string message = "unexpected " + (_furthest < token_count()
+        ? "'" + to_string(token(_furthest)) + "'"
+        : kind_name(tok_kind<EndTok>));
+
+    string expected;
+
+    for (size_t kind = 0; kind < tok_kind_count; ++kind)
+    {
+        if (_expected & (1u << kind))
+        {
+            expected += expected.empty() ? "" : ", ";
+            expected += kind_name(kind);
+        }
+    }
+
+    if (!expected.empty())
+    {
+        message += ", expected " + expected;
+    }
+
+    return ParseError{_offset + _furthest, message};
+}
+
+bool ParseState::recovering() const
+{
+    return _opts.recover;
+}
+
+// Records the current error, or message at the current position, as a
+// diagnostic and clears it, so the parse can carry on from a
+// resynchronization point. A cut is lifted, as recovery only moves forward;
+// a budget halt stands. Returns false if still halted.
+bool ParseState::recover(string const& message)
+{
+    if (_halted == Halt::budget)
+    {
+        return false;
+    }
+
+    ParseError e = message.empty() ? error() : ParseError{_offset + _pos, message};
+
+    if (_diagnostics.empty() || _diagnostics.back().pos != e.pos)
+    {
+        _diagnostics.push_back(std::move(e));
+    }
+
+    _halted = Halt::none;
+    _furthest = _pos;
+    _expected = 0;
+    return true;
+}
+
+vector<ParseError> const& ParseState::diagnostics() const
+{
+    return _diagnostics;
+}
+
+// Counted with the tokens, as a side array of them.
+void ParseState::set_brackets(vector<uint32_t> brackets)
+{
+    _token_memory.freed(_brackets.capacity() * sizeof(uint32_t));
+    _brackets = std::move(brackets);
+    _token_memory.allocated(_brackets.capacity() * sizeof(uint32_t));
+}
+
+// Where the group opened by a bracket at pos closes; pos itself if there is
+// no bracket there, or no table.
+unsigned ParseState::group_end(unsigned pos) const
+{
+    if (pos >= _brackets.size() || _brackets[pos] == no_bracket || _brackets[pos] < pos)
+    {
+        return pos;
+    }
+
+    return _brackets[pos];
 }
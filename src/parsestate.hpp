@@ -1,50 +1,385 @@
 #pragma once
 
+#include "memory.hpp"
+#include "perfcount.hpp"
 #include "tokens.hpp"
+#include "tokensource.hpp"
+#include "tokfile.hpp"
 #include "tracer.hpp"
+#include <cstdint>
+#include <deque>
+#include <iosfwd>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 using std::vector;
+using std::unique_ptr;
+using std::unordered_map;
+
+class ASTIndex;
+
+struct ParseError
+{
+    uint64_t pos;
+    string   message;
+};
+
+string to_string(ParseError const&);
+
+struct ParseStats
+{
+    uint64_t steps   = 0; // Rule invocations, memo hits included.
+    uint64_t rewinds = 0; // set_pos calls that moved backwards.
+    uint64_t memo_peak = 0; // Most memo entries alive at once.
+
+    // Memory by subsystem. Tokens is the token array: the caller's, or the
+    // window when streaming; with a prescan, also its bracket table. AST
+    // counts nodes built by this parse, which may outlive it. Closures are
+    // the combinators' std::function heap blocks: bytes and allocations
+    // made during the parse, live and peak for the process, since the
+    // grammar is built once and kept.
+    MemoryStats tokens;
+    MemoryStats tracer;
+    MemoryStats memo;
+    MemoryStats ast;
+    MemoryStats closures;
+};
+
+// Which rules to memoize, indexed by rule_id; see analyze_grammar().
+struct MemoPlan
+{
+    vector<bool> rules;
+
+    bool contains(unsigned rule) const
+    {
+        return rule < rules.size() && rules[rule];
+    }
+};
+
+// Per-rule call counts gathered by a profiling parse, indexed by rule_id.
+struct RuleProfile
+{
+    struct Counts
+    {
+        uint64_t calls   = 0;
+        uint64_t repeats = 0; // Calls at a position the rule was already tried at.
+        uint64_t steps   = 0; // Steps taken beneath the rule, summed.
+    };
+
+    vector<Counts> rules;
+    std::unordered_set<uint64_t> seen; // (rule << 32) | position.
+};
+
+// Nothing is written anywhere unless a stream is given.
+struct ParseOptions
+{
+    std::ostream*       log     = nullptr; // "Parsing ..." and the outcome.
+    std::ostream*       trace   = nullptr; // Rule trace, printed at the end.
+    bool                memoize = true;    // Honour MEMO; off for debugging.
+    vector<ParseError>* errors  = nullptr; // Appended to on failure.
+    ParseStats*         stats   = nullptr; // Filled after every parse.
+
+    // Skip malformed statements and functions, leaving ASTError nodes, and
+    // report every syntax error instead of failing at the first.
+    bool recover = false;
+
+    // Abandon the parse once either count is exceeded; 0 means no limit.
+    uint64_t max_steps   = 0;
+    uint64_t max_rewinds = 0;
+
+    // Memoize every rule, not just MEMO ones: each rule runs at most once per
+    // position, so parse time is linear in the input at the cost of memory.
+    bool packrat = false;
+
+    // Memoize exactly these rules, ignoring MEMO tags. Left-recursive rules
+    // are memoized whether it lists them or not, as seed growing needs it;
+    // see required_memo_plan().
+    MemoPlan const* memo_plan = nullptr;
+
+    // Collect call counts for every named rule.
+    RuleProfile* profile = nullptr;
+
+    // Check brackets and adjacent tokens in one pass over the token kinds
+    // first, so malformed input fails without being parsed; see prescan().
+    // With recover nothing is rejected, but balanced brackets let recovery
+    // skip a bracketed group at once. Not done when streaming.
+    bool prescan = false;
+
+    // Hardware counters per phase and per sampled rule call, added to the
+    // report's totals; see PerfReport.
+    PerfReport* perf = nullptr;
+
+    // Given every program parsed, or every function when streaming.
+    ASTIndex* index = nullptr;
+
+    // Tokens pulled from a TokenSource per read when streaming.
+    size_t window = 4096;
+
+    // Backs the memo tables; not the AST, the trace or the tokens.
+    std::pmr::memory_resource* memory = std::pmr::get_default_resource();
+};
+
+// Dense id for a rule name; stable for the life of the process.
+unsigned rule_id(string const& name);
+
+// rule_id() for a TRACE, which also records the name for traced_rules().
+unsigned traced_rule_id(string const& name);
+
+// The names TRACE has registered so far, in the order it first saw them.
+vector<string> traced_rules();
+
+// Where the ParseState alive on this thread counts its AST nodes; null when
+// none is.
+std::shared_ptr<CountingResource> const& current_ast_memory();
+
+// Left-recursion bookkeeping for memoized(), after Warth, Douglass and
+// Millstein, "Packrat Parsers Can Support Left Recursion" (2008).
+
+struct LRHead
+{
+    unsigned         rule;     // The rule whose seed is being grown.
+    vector<unsigned> involved; // Rules between the head and its recursion.
+    vector<unsigned> eval;     // Involved rules still to re-run this round.
+};
+
+struct LRFrame
+{
+    unsigned rule;
+    LRHead*  head = nullptr;
+    LRFrame* next = nullptr;
+};
+
+template <typename V>
+struct MemoEntry
+{
+    V value;
+    unsigned end_pos;
+    LRFrame* lr      = nullptr; // Set while the rule is being evaluated here.
+    LRHead*  lr_head = nullptr; // Set if it is involved in another rule's
+                                // left recursion and holds only a seed.
+};
+
+struct MemoTableBase
+{
+    virtual ~MemoTableBase() {}
+
+    // Drops finished entries that start before pos; returns how many.
+    virtual size_t erase_below(unsigned pos) = 0;
+};
+
+template <typename V>
+struct MemoTable : MemoTableBase
+{
+    // Keyed by start position.
+    std::pmr::unordered_map<unsigned, MemoEntry<V>> entries;
+
+    MemoTable(std::pmr::memory_resource* memory)
+        : entries(memory)
+    {}
+
+    size_t erase_below(unsigned pos)
+    {
+        size_t const before = entries.size();
+
+        for (auto it = entries.begin(); it != entries.end(); )
+        {
+            bool const in_use = it->second.lr || it->second.lr_head;
+
+            if (it->first < pos && !in_use)
+            {
+                it = entries.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        return before - entries.size();
+    }
+};
 
 class ParseState
 {
     private:
-        vector<Tok> const& _tokens;
+        // Declared first to outlive everything they count.
+        mutable MemoryCounter             _token_memory;
+        mutable size_t                    _token_bytes = 0; // Last accounted.
+        CountingResource                  _tracer_memory;
+        CountingResource                  _memo_memory;
+        std::shared_ptr<CountingResource> _ast_memory;
+        std::shared_ptr<CountingResource> _outer_ast_memory;
+        MemoryStats                       _closures_before;
+
+        // Either the caller's vector or, when streaming, _window. Positions
+        // are relative to the first token still held. A TokenView is read
+        // in place instead; _tokens is then the empty _window.
+        vector<Tok> const* _tokens;
+        mutable vector<Tok> _window;
+        TokenView const* _view = nullptr;
+        mutable Tok _scratch;      // cur() and peek() of a view; traces only.
+        mutable NumTok _num{0};    // match<NumTok>() of a view.
+        TokenSource* _source = nullptr;
+        uint64_t _offset = 0; // Tokens discarded before _tokens[0].
+        ParseOptions _opts;
+        MemoPlan const* _required_plan = nullptr; // With a memo_plan.
         Tracer _tracer;
         unsigned _pos = 0;
+        vector<unique_ptr<MemoTableBase>> _memo; // Indexed by rule_id.
+
+        // Furthest position any match failed at, and what it wanted there.
+        unsigned _furthest = 0;
+        uint32_t _expected = 0;
+
+        enum class Halt { none, budget, cut };
+
+        ParseStats _stats;
+        Halt _halted = Halt::none;
+        unsigned _committed = 0;
+        uint64_t _memo_entries = 0;
+        vector<ParseError> _diagnostics; // Errors recovered from.
+        vector<uint32_t> _brackets;      // Partner positions; see prescan.hpp.
+
+        vector<int>        _sample_slot;   // rule_id -> index in perf->rules, or -1.
+        vector<bool>       _sampling;      // By slot: a call is being measured.
+        vector<PerfSample> _sample_starts;
+
+        LRFrame*                        _lr_stack = nullptr;
+        std::deque<LRHead>              _lr_heads;
+        unordered_map<unsigned, LRHead*> _growing; // Position -> head.
         
+        void init();
+        void account_tokens() const;
+        size_t token_count() const;
+        Tok const& token(size_t i) const;
         Tok const& cur_unchecked() const;
+        template <typename T> T const* view_match() const;
+        bool refill() const;
+        void expect(size_t kind);
 
     public:
-        ParseState(vector<Tok> const&);
+        ParseState(vector<Tok> const&, ParseOptions const&);
+        ParseState(TokenSource&, ParseOptions const&);
+        ParseState(TokenView const&, ParseOptions const&);
+        ~ParseState();
+
+        ParseState(ParseState const&) = delete;
+        ParseState& operator=(ParseState const&) = delete;
        
         bool at_end() const;
         unsigned pos() const;
         Tok const& cur() const;
+        Tok const& peek(unsigned ahead) const;
+        size_t peek_kind(unsigned ahead = 0) const;
+        bool tracing() const;
+        bool memoizing() const;
+        bool packrat() const;
+        bool has_plan() const;
+        bool planned(unsigned rule) const;
+        bool profiling() const;
+        void profile(unsigned rule, unsigned pos, uint64_t steps_before);
+        bool sample_begin(unsigned rule);
+        void sample_end(unsigned rule);
+        bool halted() const;
+        ParseStats const& stats() const;
+        ParseStats final_stats() const; // stats() plus memory use.
         
+        bool step();
         void set_pos(unsigned);
         template <typename T> T const* match();
+        bool match_end();
+        template <typename V> std::pmr::unordered_map<unsigned, MemoEntry<V>>& memo(unsigned rule);
+        void memo_added();
+        void memo_erased();
+        void commit();
+        unsigned committed() const;
+        void discard_consumed();
+        uint64_t offset() const;
+        LRFrame* lr_stack() const;
+        void push_lr(LRFrame&);
+        void pop_lr();
+        LRHead* new_lr_head(unsigned rule);
+        LRHead* growing_at(unsigned pos) const;
+        void set_growing(unsigned pos, LRHead*);
         void push_trace(string const&);
         void pop_trace_success();
         void pop_trace_failure();
-        void print_trace();
+        void print_trace(std::ostream&);
+        ParseError error() const;
+        bool recovering() const;
+        bool recover(string const& message = "");
+        vector<ParseError> const& diagnostics() const;
+        void set_brackets(vector<uint32_t>);
+        unsigned group_end(unsigned pos) const;
 };
 
+static_assert(tok_kind_count <= 32, "ParseState::_expected is a 32-bit set");
+
 template <typename T>
 T const* ParseState::match()
 {
     if (at_end())
     {
+        expect(tok_kind<T>);
         return nullptr;
     }
 
-    T const* t = std::get_if<T>(&cur_unchecked());
+    T const* t = _view ? view_match<T>() : std::get_if<T>(&cur_unchecked());
 
     if (!t)
     {
+        expect(tok_kind<T>);
         return nullptr;
     }
 
     ++_pos;
     return t;
 }
+
+// No Tok is built: names point into the view, numbers into _num, and the
+// other tokens carry nothing.
+template <typename T>
+T const* ParseState::view_match() const
+{
+    if (_view->kind(_pos) != tok_kind<T>)
+    {
+        return nullptr;
+    }
+
+    if constexpr (std::is_same_v<T, VarTok>)
+    {
+        return &_view->name(_view->payload(_pos));
+    }
+    else if constexpr (std::is_same_v<T, NumTok>)
+    {
+        _num.value = static_cast<int>(_view->payload(_pos));
+        return &_num;
+    }
+    else
+    {
+        static T const t{};
+        return &t;
+    }
+}
+
+// Every rule id must always be used with the same V.
+template <typename V>
+std::pmr::unordered_map<unsigned, MemoEntry<V>>& ParseState::memo(unsigned rule)
+{
+    if (rule >= _memo.size())
+    {
+        _memo.resize(rule + 1);
+    }
+
+    unique_ptr<MemoTableBase>& table = _memo[rule];
+
+    if (!table)
+    {
+        table = std::make_unique<MemoTable<V>>(&_memo_memory);
+    }
+
+    return static_cast<MemoTable<V>&>(*table).entries;
+}
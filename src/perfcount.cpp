@@ -0,0 +1,195 @@
+#include "perfcount.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+
+char const* perf_event_name(PerfEvent e)
+{
+    static char const* const names[perf_event_count] = 
+    {
+        "cycles", "instructions", "branch-misses", "cache-misses", "task-clock",
+    };
+
+    return names[static_cast<size_t>(e)];
+}
+
+PerfSample& PerfSample::operator+=(PerfSample const& other)
+{
+    for (size_t i = 0; i < perf_event_count; ++i)
+    {
+        values[i] += other.values[i];
+    }
+
+    // An empty sum takes the events of the first sample added to it.
+    available = available ? available & other.available : other.available;
+    wall_ns += other.wall_ns;
+    return *this;
+}
+
+PerfSample operator-(PerfSample const& end, PerfSample const& start)
+{
+    PerfSample d;
+
+    for (size_t i = 0; i < perf_event_count; ++i)
+    {
+        d.values[i] = end.values[i] - start.values[i];
+    }
+
+    d.available = end.available & start.available;
+    d.wall_ns = end.wall_ns - start.wall_ns;
+    return d;
+}
+
+static uint64_t now_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void PerfReport::add(string const& phase, PerfSample const& sample)
+{
+    for (Entry& e : phases)
+    {
+        if (e.name == phase)
+        {
+            ++e.calls;
+            ++e.samples;
+            e.total += sample;
+            return;
+        }
+    }
+
+    phases.push_back(Entry{phase, 1, 1, sample});
+}
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+PerfCounters::PerfCounters()
+{
+    static uint64_t const configs[perf_event_count][2] = 
+    {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    };
+
+    // The first event to open leads the group; the rest join it, so one
+    // read returns them all.
+    for (size_t e = 0; e < perf_event_count; ++e)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = static_cast<uint32_t>(configs[e][0]);
+        attr.config = configs[e][1];
+        attr.exclude_kernel = 1; // Allowed up to perf_event_paranoid 2.
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        long const fd = syscall(__NR_perf_event_open, &attr, 0, -1, _leader, 0);
+
+        if (fd < 0)
+        {
+            if (_error.empty())
+            {
+                _error = string(perf_event_name(static_cast<PerfEvent>(e))) + ": " + strerror(errno);
+            }
+
+            continue;
+        }
+
+        if (_leader < 0)
+        {
+            _leader = static_cast<int>(fd);
+        }
+
+        _fds[_opened] = static_cast<int>(fd);
+        _order[_opened] = static_cast<uint8_t>(e);
+        ++_opened;
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (size_t i = 0; i < _opened; ++i)
+    {
+        close(_fds[i]);
+    }
+}
+
+PerfSample PerfCounters::read() const
+{
+    PerfSample s;
+    s.wall_ns = now_ns();
+
+    if (_leader < 0)
+    {
+        return s;
+    }
+
+    // nr, time enabled, time running, then one value per member.
+    uint64_t buffer[3 + perf_event_count];
+
+    if (::read(_leader, buffer, sizeof(buffer)) < static_cast<ssize_t>(3 * sizeof(uint64_t)))
+    {
+        return s;
+    }
+
+    uint64_t const enabled = buffer[1];
+    uint64_t const running = buffer[2];
+
+    for (size_t i = 0; i < buffer[0] && i < _opened; ++i)
+    {
+        uint64_t v = buffer[3 + i];
+
+        if (running && running < enabled)
+        {
+            v = static_cast<uint64_t>(static_cast<double>(v) * static_cast<double>(enabled) / static_cast<double>(running));
+        }
+
+        s.values[_order[i]] = v;
+        s.available |= 1u << _order[i];
+    }
+
+    return s;
+}
+
+#else
+
+PerfCounters::PerfCounters()
+    : _error("perf_event_open is Linux only")
+{}
+
+PerfCounters::~PerfCounters() {}
+
+PerfSample PerfCounters::read() const
+{
+    PerfSample s;
+    s.wall_ns = now_ns();
+    return s;
+}
+
+#endif
+
+uint32_t PerfCounters::available() const
+{
+    uint32_t a = 0;
+
+    for (size_t i = 0; i < _opened; ++i)
+    {
+        a |= 1u << _order[i];
+    }
+
+    return a;
+}
+
+string const& PerfCounters::error() const
+{
+    return _error;
+}
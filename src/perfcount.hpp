@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Hardware performance counters of the calling thread, through
+// perf_event_open. Nothing is opened unless a PerfCounters is made. An event
+// the machine or the kernel does not offer (a VM without a PMU, a strict
+// perf_event_paranoid, not Linux) reads as unavailable and the others carry
+// on; task-clock is a software event and nearly always there.
+
+enum class PerfEvent { cycles, instructions, branch_misses, cache_misses, task_clock };
+
+size_t const perf_event_count = 5;
+
+// "cycles", "instructions", "branch-misses", "cache-misses", "task-clock".
+char const* perf_event_name(PerfEvent);
+
+struct PerfSample
+{
+    uint64_t values[perf_event_count] = {}; // Task-clock in ns.
+    uint32_t available = 0;                 // Bit per PerfEvent.
+    uint64_t wall_ns   = 0;
+
+    bool has(PerfEvent e) const
+    {
+        return (available >> static_cast<unsigned>(e)) & 1;
+    }
+
+    uint64_t operator[](PerfEvent e) const
+    {
+        return values[static_cast<size_t>(e)];
+    }
+
+    PerfSample& operator+=(PerfSample const&);
+};
+
+// The counts between two reads.
+PerfSample operator-(PerfSample const& end, PerfSample const& start);
+
+class PerfCounters
+{
+    public:
+        PerfCounters();
+        ~PerfCounters();
+
+        PerfCounters(PerfCounters const&) = delete;
+        PerfCounters& operator=(PerfCounters const&) = delete;
+
+        uint32_t available() const;
+
+        // Why the first missing event is missing, e.g. "cycles: No such file
+        // or directory"; empty if all opened.
+        string const& error() const;
+
+        // Totals since opening, read in one call so they cover the same
+        // interval, and scaled up if the kernel had to multiplex them.
+        PerfSample read() const;
+
+    private:
+        int      _leader = -1;
+        int      _fds[perf_event_count];
+        size_t   _opened = 0;
+        uint8_t  _order[perf_event_count]; // Event of each group member.
+        string   _error;
+};
+
+// Counts summed per phase, and per sampled call of chosen rules. parse()
+// records "prescan", "parse" and "trace" when given one in ParseOptions;
+// callers add phases of their own, such as lexing or printing the AST.
+struct PerfReport
+{
+    struct Entry
+    {
+        string     name;
+        uint64_t   calls   = 0; // Runs of a phase, or calls of a rule.
+        uint64_t   samples = 0; // Those measured.
+        PerfSample total;       // Over the samples.
+    };
+
+    PerfCounters* counters = nullptr; // Must be set.
+    vector<Entry> phases;
+
+    // Rules to sample by name, e.g. {"parse_func"}, reading the counters at
+    // both ends of one call in sample_every. A call made while the same
+    // rule is already being sampled is counted, not measured. Two reads
+    // cost a few microseconds, so this suits top-level rules best.
+    vector<Entry> rules;
+    unsigned      sample_every = 1;
+
+    void add(string const& phase, PerfSample const&);
+};
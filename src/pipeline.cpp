@@ -0,0 +1,781 @@
+#include "pipeline.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "queue.hpp"
+#include "source.hpp"
+#include "threadpool.hpp"
+#include "uring.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum class Outcome { ok, recovered, failed };
+
+// One input file on its way through the stages. The stage that is done with
+// a field clears it, so memory is held for files in flight only.
+struct IngestJob
+{
+    string           path;
+    size_t           input = 0; // Its index in PipelineOptions::inputs.
+    string           text;
+    vector<Tok>      tokens;
+    vector<uint32_t> offsets;
+    string           output;
+    Outcome          outcome = Outcome::ok;
+
+    // I/O in progress.
+    int    fd    = -1;
+    size_t done  = 0;
+    int    error = 0; // errno of a failed write.
+
+    void fail(string message)
+    {
+        outcome = Outcome::failed;
+        output = path + ": " + message + "\n";
+    }
+};
+
+using JobPtr = std::unique_ptr<IngestJob>;
+using JobQueue = BoundedQueue<JobPtr>;
+
+static uint64_t now_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Counts a stage's work, less any time spent waiting on a queue.
+struct StageCounter
+{
+    std::atomic<uint64_t> items{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> busy_ns{0};
+
+    StageStats stats(unsigned threads) const
+    {
+        return {items.load(), bytes.load(), busy_ns.load(), threads};
+    }
+};
+
+static QueueStats queue_stats(JobQueue const& q)
+{
+    JobQueue::Stats const s = q.stats();
+    QueueStats out;
+    out.pushes = s.pushes;
+    out.full_waits = s.full_waits;
+    out.mean_depth = s.pushes ? static_cast<double>(s.depth_sum) / static_cast<double>(s.pushes) : 0;
+    out.max_depth = s.max_depth;
+    out.capacity = q.capacity();
+    return out;
+}
+
+// Opens the file and sizes its buffer; a failed job or an empty file is
+// ready as it is.
+static JobPtr open_input(PipelineOptions const& opts, size_t input)
+{
+    JobPtr job = std::make_unique<IngestJob>();
+    job->path = opts.inputs[input];
+    job->input = input;
+    job->fd = ::open(job->path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (job->fd < 0 || fstat(job->fd, &st) != 0)
+    {
+        job->fail(strerror(errno));
+    }
+    else
+    {
+        job->text.resize(static_cast<size_t>(st.st_size));
+    }
+
+    return job;
+}
+
+static void close_fd(IngestJob& job)
+{
+    if (job.fd >= 0)
+    {
+        ::close(job.fd);
+        job.fd = -1;
+    }
+}
+
+static void read_blocking(IngestJob& job)
+{
+    while (job.fd >= 0 && job.done < job.text.size())
+    {
+        ssize_t const n = ::pread(job.fd, &job.text[job.done], job.text.size() - job.done, static_cast<off_t>(job.done));
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (n < 0)
+        {
+            job.fail(strerror(errno));
+            break;
+        }
+
+        if (n == 0)
+        {
+            job.text.resize(job.done); // Shrank since fstat().
+            break;
+        }
+
+        job.done += static_cast<size_t>(n);
+    }
+
+    close_fd(job);
+}
+
+// A failed submit leaves some operations with the kernel and the rest only
+// queued. Waits out the first kind, crediting what each transferred, so
+// that every job still in a slot can be finished with blocking calls. False
+// if even waiting fails: the kernel may then still write into those jobs.
+static bool drain(Uring& ring, vector<JobPtr>& slots)
+{
+    uint64_t user;
+    int32_t result;
+
+    while (ring.drain(&user, &result))
+    {
+        if (result > 0)
+        {
+            slots[user]->done += static_cast<size_t>(result);
+        }
+    }
+
+    return ring.in_flight() == 0;
+}
+
+// Leaks a job the kernel may still write into, and returns a failed one to
+// stand in for it.
+static JobPtr abandon(JobPtr job)
+{
+    JobPtr stand_in = std::make_unique<IngestJob>();
+    stand_in->path = job->path;
+    stand_in->input = job->input;
+    stand_in->fail("abandoned after an io_uring error");
+    job.release();
+    return stand_in;
+}
+
+static void read_stage_threads(PipelineOptions const& opts, JobQueue& out, StageCounter& counter)
+{
+    ThreadPool pool(std::max(1u, std::min(opts.io_depth, 16u)));
+
+    parallel_for(pool, opts.inputs.size(), [&](size_t i)
+    {
+        uint64_t const start = now_ns();
+        JobPtr job = open_input(opts, i);
+        read_blocking(*job);
+        counter.items += 1;
+        counter.bytes += job->text.size();
+        counter.busy_ns += now_ns() - start;
+        out.push(std::move(job));
+    });
+}
+
+// One thread keeps up to io_depth reads in flight. A slot's index is the
+// user value of its read.
+static void read_stage_uring(PipelineOptions const& opts, Uring& ring, JobQueue& out, StageCounter& counter)
+{
+    uint64_t const start = now_ns();
+    uint64_t waited = 0;
+    vector<JobPtr> slots(opts.io_depth);
+    vector<size_t> free_slots;
+    size_t next = 0;
+    bool broken = false; // The ring may still own abandoned jobs' buffers.
+
+    for (size_t s = slots.size(); s-- > 0; )
+    {
+        free_slots.push_back(s);
+    }
+
+    auto finish = [&](JobPtr job)
+    {
+        close_fd(*job);
+        counter.items += 1;
+        counter.bytes += job->text.size();
+        uint64_t const before = now_ns();
+        out.push(std::move(job));
+        waited += now_ns() - before;
+    };
+
+    while (next < opts.inputs.size() || free_slots.size() < slots.size())
+    {
+        while (!free_slots.empty() && next < opts.inputs.size())
+        {
+            JobPtr job = open_input(opts, next++);
+
+            if (job->outcome == Outcome::failed || job->text.empty())
+            {
+                finish(std::move(job));
+                continue;
+            }
+
+            size_t const slot = free_slots.back();
+
+            if (broken || !ring.read(job->fd, &job->text[0], job->text.size(), 0, slot))
+            {
+                read_blocking(*job); // Never expected: the ring holds io_depth.
+                finish(std::move(job));
+                continue;
+            }
+
+            free_slots.pop_back();
+            slots[slot] = std::move(job);
+        }
+
+        bool const in_flight = free_slots.size() < slots.size();
+
+        if (broken)
+        {
+            continue;
+        }
+
+        if (!ring.submit(in_flight ? 1 : 0))
+        {
+            // Finish what is outstanding the slow way, once the kernel has
+            // let go of it.
+            broken = !drain(ring, slots);
+
+            for (size_t s = 0; s < slots.size(); ++s)
+            {
+                if (slots[s])
+                {
+                    if (broken)
+                    {
+                        slots[s] = abandon(std::move(slots[s]));
+                    }
+
+                    read_blocking(*slots[s]);
+                    finish(std::move(slots[s]));
+                    free_slots.push_back(s);
+                }
+            }
+
+            continue;
+        }
+
+        uint64_t user;
+        int32_t result;
+
+        while (ring.complete(&user, &result))
+        {
+            JobPtr& job = slots[user];
+
+            if (result > 0)
+            {
+                job->done += static_cast<size_t>(result);
+
+                if (job->done < job->text.size()
+                    && ring.read(job->fd, &job->text[job->done], job->text.size() - job->done, job->done, user))
+                {
+                    continue;
+                }
+            }
+
+            if (result < 0)
+            {
+                job->fail(strerror(-result));
+            }
+            else
+            {
+                read_blocking(*job); // Shrank, or a short read that did not fit.
+            }
+
+            finish(std::move(job));
+            free_slots.push_back(user);
+        }
+    }
+
+    counter.busy_ns += now_ns() - start - waited;
+}
+
+// Runs f on each job popped from in, on `threads` threads, pushing the
+// results to out.
+template <typename F>
+static vector<std::thread> start_stage(unsigned threads, JobQueue& in, JobQueue& out, StageCounter& counter, F f)
+{
+    vector<std::thread> workers;
+
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&in, &out, &counter, f]()
+        {
+            JobPtr job;
+
+            while (in.pop(job))
+            {
+                uint64_t const start = now_ns();
+
+                if (job->outcome != Outcome::failed)
+                {
+                    f(*job);
+                }
+
+                counter.items += 1;
+                counter.busy_ns += now_ns() - start;
+                out.push(std::move(job));
+            }
+
+            out.producer_done();
+        });
+    }
+
+    return workers;
+}
+
+static void lex_job(IngestJob& job, StageCounter& counter)
+{
+    LexError error;
+    optional<vector<Tok>> tokens = lex(job.text, &job.offsets, &error);
+
+    if (!tokens)
+    {
+        SourceMap const source(job.text, {});
+        job.fail(to_string(source.at_offset(error.offset)) + ": " + error.message);
+        return;
+    }
+
+    job.tokens = std::move(*tokens);
+    counter.bytes += job.tokens.size();
+}
+
+static void parse_job(IngestJob& job, uint64_t steps_per_token)
+{
+    vector<ParseError> errors;
+    ParseOptions opts;
+    opts.errors = &errors;
+    opts.recover = true;
+    opts.max_steps = steps_per_token * (job.tokens.size() + 1);
+
+    Parsed<ASTPtr> const r = parse(job.tokens, opts);
+    SourceMap const source(std::move(job.text), std::move(job.offsets));
+
+    for (ParseError const& e : errors)
+    {
+        job.output += to_string(source.at_token(static_cast<uint32_t>(e.pos))) + ": " + e.message + "\n";
+    }
+
+    if (r)
+    {
+        job.output += std::get<0>(*r)->to_string();
+    }
+
+    job.outcome = !r ? Outcome::failed : errors.empty() ? Outcome::ok : Outcome::recovered;
+    vector<Tok>().swap(job.tokens);
+}
+
+// Keeps each input's path below the inputs' deepest common directory, so
+// that a/x.prs and b/x.prs do not write the same file; inputs that share a
+// directory go straight into output_dir. Creates the directories needed.
+static vector<string> output_paths(PipelineOptions const& opts)
+{
+    namespace fs = std::filesystem;
+    vector<fs::path> inputs;
+    std::error_code ec;
+
+    for (string const& input : opts.inputs)
+    {
+        inputs.push_back(fs::absolute(input, ec).lexically_normal());
+    }
+
+    fs::path common = inputs.empty() ? fs::path() : inputs[0].parent_path();
+
+    for (fs::path const& input : inputs)
+    {
+        fs::path const dir = input.parent_path();
+        fs::path prefix;
+
+        for (auto c = common.begin(), d = dir.begin(); c != common.end() && d != dir.end() && *c == *d; ++c, ++d)
+        {
+            prefix /= *c;
+        }
+
+        common = prefix;
+    }
+
+    vector<string> outputs;
+
+    for (fs::path const& input : inputs)
+    {
+        fs::path const output = fs::path(opts.output_dir) / input.lexically_relative(common);
+        fs::create_directories(output.parent_path(), ec);
+        outputs.push_back(output.string() + ".ast");
+    }
+
+    return outputs;
+}
+
+static void open_output(vector<string> const& outputs, IngestJob& job)
+{
+    job.done = 0;
+    job.fd = ::open(outputs[job.input].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    job.error = job.fd < 0 ? errno : 0;
+}
+
+static void write_blocking(IngestJob& job)
+{
+    while (job.fd >= 0 && job.done < job.output.size())
+    {
+        ssize_t const n = ::write(job.fd, job.output.data() + job.done, job.output.size() - job.done);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (n < 0)
+        {
+            job.error = errno;
+        }
+
+        if (n <= 0)
+        {
+            break;
+        }
+
+        job.done += static_cast<size_t>(n);
+    }
+
+    close_fd(job);
+}
+
+struct Tally
+{
+    uint64_t ok = 0, recovered = 0, failed = 0;
+    vector<string> unwritten;
+
+    // Once the job's output is written, or given up on.
+    void wrote(vector<string> const& outputs, IngestJob const& job)
+    {
+        if (job.error)
+        {
+            unwritten.push_back(outputs[job.input] + ": " + strerror(job.error));
+        }
+        else if (job.done < job.output.size())
+        {
+            unwritten.push_back(outputs[job.input] + ": short write");
+        }
+    }
+
+    void count(IngestJob const& job)
+    {
+        switch (job.outcome)
+        {
+            case Outcome::ok:        ++ok; break;
+            case Outcome::recovered: ++recovered; break;
+            case Outcome::failed:    ++failed; break;
+        }
+    }
+};
+
+static void emit_stage_blocking(vector<string> const& outputs, JobQueue& in, StageCounter& counter, Tally& tally)
+{
+    JobPtr job;
+
+    while (in.pop(job))
+    {
+        uint64_t const start = now_ns();
+        tally.count(*job);
+
+        if (!outputs.empty())
+        {
+            open_output(outputs, *job);
+            write_blocking(*job);
+            counter.bytes += job->done;
+            tally.wrote(outputs, *job);
+        }
+
+        counter.items += 1;
+        counter.busy_ns += now_ns() - start;
+    }
+}
+
+// Like the read stage: up to io_depth writes in flight from one thread,
+// which only blocks on the queue when nothing is being written.
+static void emit_stage_uring(PipelineOptions const& opts, vector<string> const& outputs, Uring& ring, JobQueue& in,
+    StageCounter& counter, Tally& tally)
+{
+    uint64_t const start = now_ns();
+    uint64_t waited = 0;
+    vector<JobPtr> slots(opts.io_depth);
+    vector<size_t> free_slots;
+    bool open = true;
+    bool broken = false; // As in the read stage.
+
+    for (size_t s = slots.size(); s-- > 0; )
+    {
+        free_slots.push_back(s);
+    }
+
+    auto begin_write = [&](JobPtr job)
+    {
+        tally.count(*job);
+        counter.items += 1;
+        open_output(outputs, *job);
+
+        if (job->fd < 0 || job->output.empty())
+        {
+            close_fd(*job);
+            tally.wrote(outputs, *job);
+            return;
+        }
+
+        size_t const slot = free_slots.back();
+
+        if (broken || !ring.write(job->fd, job->output.data(), job->output.size(), 0, slot))
+        {
+            write_blocking(*job);
+            counter.bytes += job->done;
+            tally.wrote(outputs, *job);
+            return;
+        }
+
+        free_slots.pop_back();
+        slots[slot] = std::move(job);
+    };
+
+    while (open || free_slots.size() < slots.size())
+    {
+        bool const in_flight = free_slots.size() < slots.size();
+
+        if (open && !free_slots.empty())
+        {
+            JobPtr job;
+
+            if (!in_flight)
+            {
+                uint64_t const before = now_ns();
+                open = in.pop(job);
+                waited += now_ns() - before;
+
+                if (open)
+                {
+                    begin_write(std::move(job));
+                }
+
+                continue;
+            }
+
+            if (in.try_pop(job))
+            {
+                begin_write(std::move(job));
+                continue;
+            }
+
+            if (in.closed())
+            {
+                if (in.try_pop(job))
+                {
+                    begin_write(std::move(job));
+                }
+                else
+                {
+                    open = false;
+                }
+
+                continue;
+            }
+        }
+
+        // Something is in flight: wait for it.
+        if (!ring.submit(1))
+        {
+            broken = !drain(ring, slots);
+
+            for (size_t s = 0; s < slots.size(); ++s)
+            {
+                if (slots[s])
+                {
+                    if (broken)
+                    {
+                        tally.unwritten.push_back(outputs[slots[s]->input] + ": abandoned after an io_uring error");
+                        slots[s].release(); // Already counted.
+                        free_slots.push_back(s);
+                        continue;
+                    }
+
+                    write_blocking(*slots[s]);
+                    counter.bytes += slots[s]->done;
+                    tally.wrote(outputs, *slots[s]);
+                    slots[s].reset();
+                    free_slots.push_back(s);
+                }
+            }
+
+            continue;
+        }
+
+        uint64_t user;
+        int32_t result;
+
+        while (ring.complete(&user, &result))
+        {
+            IngestJob& job = *slots[user];
+
+            if (result > 0)
+            {
+                job.done += static_cast<size_t>(result);
+
+                if (job.done < job.output.size()
+                    && ring.write(job.fd, job.output.data() + job.done, job.output.size() - job.done, job.done, user))
+                {
+                    continue;
+                }
+            }
+
+            if (result >= 0)
+            {
+                write_blocking(job);
+            }
+            else
+            {
+                job.error = -result;
+            }
+
+            close_fd(job);
+            counter.bytes += job.done;
+            tally.wrote(outputs, job);
+            slots[user].reset();
+            free_slots.push_back(user);
+        }
+    }
+
+    counter.busy_ns += now_ns() - start - waited;
+}
+
+PipelineStats run_pipeline(PipelineOptions const& opts)
+{
+    PipelineOptions o = opts;
+    unsigned const hardware = std::max(2u, std::thread::hardware_concurrency());
+    o.lex_threads = o.lex_threads ? o.lex_threads : hardware / 2;
+    o.parse_threads = o.parse_threads ? o.parse_threads : hardware / 2;
+    o.io_depth = std::max(1u, o.io_depth);
+
+    PipelineStats stats;
+    uint64_t const start = now_ns();
+
+    JobQueue read_lex(o.queue_size, 1);
+    JobQueue lex_parse(o.queue_size, o.lex_threads);
+    JobQueue parse_emit(o.queue_size, o.parse_threads);
+    StageCounter read, lexed, parsed, emitted;
+    Tally tally;
+
+    Uring read_ring, write_ring;
+    stats.io_uring = o.use_io_uring && read_ring.init(o.io_depth) && write_ring.init(o.io_depth);
+
+    vector<string> const outputs = o.output_dir.empty() ? vector<string>() : output_paths(o);
+
+    std::thread reader([&]()
+    {
+        if (stats.io_uring)
+        {
+            read_stage_uring(o, read_ring, read_lex, read);
+        }
+        else
+        {
+            read_stage_threads(o, read_lex, read);
+        }
+
+        read_lex.producer_done();
+    });
+
+    vector<std::thread> lexers = start_stage(o.lex_threads, read_lex, lex_parse, lexed,
+        [&lexed](IngestJob& job) { lex_job(job, lexed); });
+
+    vector<std::thread> parsers = start_stage(o.parse_threads, lex_parse, parse_emit, parsed,
+        [&o](IngestJob& job) { parse_job(job, o.steps_per_token); });
+
+    if (stats.io_uring && !o.output_dir.empty())
+    {
+        emit_stage_uring(o, outputs, write_ring, parse_emit, emitted, tally);
+    }
+    else
+    {
+        emit_stage_blocking(outputs, parse_emit, emitted, tally);
+    }
+
+    reader.join();
+
+    for (std::thread& t : lexers)
+    {
+        t.join();
+    }
+
+    for (std::thread& t : parsers)
+    {
+        t.join();
+    }
+
+    stats.wall_ns = now_ns() - start;
+    stats.ok = tally.ok;
+    stats.recovered = tally.recovered;
+    stats.failed = tally.failed;
+    stats.unwritten = std::move(tally.unwritten);
+    stats.read = read.stats(stats.io_uring ? 1 : std::max(1u, std::min(o.io_depth, 16u)));
+    stats.lex = lexed.stats(o.lex_threads);
+    stats.parse = parsed.stats(o.parse_threads);
+    stats.emit = emitted.stats(1);
+    stats.read_lex = queue_stats(read_lex);
+    stats.lex_parse = queue_stats(lex_parse);
+    stats.parse_emit = queue_stats(parse_emit);
+    return stats;
+}
+
+string to_string(PipelineStats const& s)
+{
+    double const wall = static_cast<double>(s.wall_ns) / 1e9;
+    char line[160];
+    string out;
+
+    snprintf(line, sizeof(line), "%s I/O, %.1f ms: %llu ok, %llu recovered, %llu failed, %zu unwritten\n",
+        s.io_uring ? "io_uring" : "threaded", wall * 1e3,
+        static_cast<unsigned long long>(s.ok), static_cast<unsigned long long>(s.recovered),
+        static_cast<unsigned long long>(s.failed), s.unwritten.size());
+    out += line;
+
+    for (string const& u : s.unwritten)
+    {
+        out += "unwritten: " + u + "\n";
+    }
+
+    out += "stage   threads    items     files/s      busy  bytes or tokens\n";
+
+    auto stage = [&](char const* name, StageStats const& st)
+    {
+        double const busy = static_cast<double>(st.busy_ns) / 1e9;
+        double const util = wall > 0 && st.threads ? busy / (wall * st.threads) : 0;
+        snprintf(line, sizeof(line), "%-7s %7u %8llu %11.0f %8.0f%% %16llu\n", name, st.threads,
+            static_cast<unsigned long long>(st.items), wall > 0 ? static_cast<double>(st.items) / wall : 0,
+            util * 100, static_cast<unsigned long long>(st.bytes));
+        out += line;
+    };
+
+    stage("read", s.read);
+    stage("lex", s.lex);
+    stage("parse", s.parse);
+    stage("emit", s.emit);
+    out += "queue       capacity   pushes  full waits  mean depth  max depth\n";
+
+    auto queue = [&](char const* name, QueueStats const& q)
+    {
+        snprintf(line, sizeof(line), "%-11s %8zu %8llu %11llu %11.1f %10llu\n", name, q.capacity,
+            static_cast<unsigned long long>(q.pushes), static_cast<unsigned long long>(q.full_waits),
+            q.mean_depth, static_cast<unsigned long long>(q.max_depth));
+        out += line;
+    };
+
+    queue("read>lex", s.read_lex);
+    queue("lex>parse", s.lex_parse);
+    queue("parse>emit", s.parse_emit);
+    return out;
+}
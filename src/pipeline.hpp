@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Batch ingestion: read -> lex -> parse -> emit, each stage on its own
+// threads and joined to the next by a BoundedQueue, so file I/O overlaps
+// with lexing and parsing instead of alternating with it.
+//
+// Reads and writes go through io_uring where the kernel allows it, keeping
+// several files in flight from one thread; otherwise files are read on a
+// ThreadPool and written with blocking calls from the emit thread. Either
+// way, the CPU stages never wait on the disk unless a queue runs dry.
+
+struct PipelineOptions
+{
+    vector<string> inputs;
+
+    // Each input's result goes to <output_dir>/<path>.ast, where path is the
+    // input's below the deepest directory common to all inputs: its syntax
+    // errors as line:col, then the AST. Nothing is written if empty.
+    string output_dir;
+
+    unsigned lex_threads   = 0; // 0 for half the hardware threads each.
+    unsigned parse_threads = 0;
+    unsigned io_depth      = 32; // Reads, or writes, in flight at once.
+
+    // Parses halt, failing the file, past this many steps per token; 0 for
+    // no limit.
+    uint64_t steps_per_token = 1000;
+
+    size_t   queue_size    = 64; // Files buffered between two stages.
+    bool     use_io_uring  = true;
+};
+
+struct StageStats
+{
+    uint64_t items   = 0;
+    uint64_t bytes   = 0; // In: file bytes; lex: tokens; emit: bytes written.
+    uint64_t busy_ns = 0; // Summed over the stage's threads.
+    unsigned threads = 0;
+};
+
+struct QueueStats
+{
+    uint64_t pushes     = 0;
+    uint64_t full_waits = 0; // Times a stage stalled on its consumer.
+    double   mean_depth = 0; // Seen by each push.
+    uint64_t max_depth  = 0;
+    size_t   capacity   = 0;
+};
+
+struct PipelineStats
+{
+    bool     io_uring = false;
+    uint64_t wall_ns  = 0;
+    uint64_t ok        = 0;
+    uint64_t recovered = 0; // Parsed, with syntax errors.
+    uint64_t failed    = 0; // Unreadable, or no AST.
+
+    // Outputs not written in full, whatever their outcome above; one
+    // "<output>: <reason>" line each.
+    vector<string> unwritten;
+
+    StageStats read, lex, parse, emit;
+    QueueStats read_lex, lex_parse, parse_emit;
+};
+
+// A table of the stages and queues, with throughput and utilization.
+string to_string(PipelineStats const&);
+
+PipelineStats run_pipeline(PipelineOptions const&);
@@ -0,0 +1,191 @@
+#include "prescan.hpp"
+#include "grammar.hpp"
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static_assert(tok_kind<RParTok> == tok_kind<LParTok> + 1 
+    && tok_kind<LBraceTok> == tok_kind<LParTok> + 2 
+    && tok_kind<RBraceTok> == tok_kind<LParTok> + 3, 
+    "brackets are found as one range of kinds, each closer after its opener");
+
+static string quoted(size_t kind)
+{
+    bool const word = kind == tok_kind<EndTok> || kind == tok_kind<NumTok> || kind == tok_kind<VarTok>;
+    return word ? kind_name(kind) : "'" + kind_name(kind) + "'";
+}
+
+static bool fail(ParseError* error, uint64_t pos, string message)
+{
+    if (error)
+    {
+        *error = ParseError{pos, std::move(message)};
+    }
+
+    return false;
+}
+
+//// BRACKETS ////
+
+// Bit i is set where kinds[i] is a bracket, for up to 16 kinds. As unsigned
+// bytes, kind - '(' is below 4 for the four brackets only.
+static unsigned bracket_mask(uint8_t const* kinds, size_t count)
+{
+#if defined(__SSE2__)
+    if (count >= 16)
+    {
+        __m128i const rel = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(kinds)), 
+            _mm_set1_epi8(static_cast<char>(tok_kind<LParTok>)));
+        __m128i const in = _mm_cmpeq_epi8(_mm_min_epu8(rel, _mm_set1_epi8(3)), rel);
+        return static_cast<unsigned>(_mm_movemask_epi8(in));
+    }
+#endif
+
+    unsigned mask = 0;
+
+    for (size_t i = 0; i < std::min<size_t>(count, 16); ++i)
+    {
+        mask |= static_cast<unsigned>(static_cast<uint8_t>(kinds[i] - tok_kind<LParTok>) < 4) << i;
+    }
+
+    return mask;
+}
+
+// Only the brackets are visited: most blocks of 16 tokens have none or one.
+bool match_brackets(uint8_t const* kinds, size_t count, vector<uint32_t>* matches, ParseError* error)
+{
+    if (matches)
+    {
+        matches->assign(count, no_bracket);
+    }
+
+    vector<uint32_t> open;
+
+    for (size_t block = 0; block < count; block += 16)
+    {
+        for (unsigned mask = bracket_mask(kinds + block, count - block); mask; mask &= mask - 1)
+        {
+            uint32_t const at = static_cast<uint32_t>(block + static_cast<size_t>(__builtin_ctz(mask)));
+            size_t const kind = kinds[at];
+
+            if (kind == tok_kind<LParTok> || kind == tok_kind<LBraceTok>)
+            {
+                open.push_back(at);
+                continue;
+            }
+
+            if (open.empty())
+            {
+                return fail(error, at, "unmatched " + quoted(kind));
+            }
+
+            if (kinds[open.back()] != kind - 1)
+            {
+                return fail(error, at, quoted(kind) + " closes " + quoted(kinds[open.back()]) 
+                    + " at token " + std::to_string(open.back()));
+            }
+
+            if (matches)
+            {
+                (*matches)[at] = open.back();
+                (*matches)[open.back()] = at;
+            }
+
+            open.pop_back();
+        }
+    }
+
+    if (!open.empty())
+    {
+        return fail(error, open.front(), "unclosed " + quoted(kinds[open.front()]));
+    }
+
+    return true;
+}
+
+//// ADJACENCY ////
+
+// Each block of 64 pairs is folded into one word without branching, and
+// only a block that fails is searched again for its first bad pair.
+bool check_adjacency(uint8_t const* kinds, size_t count, ParseError* error)
+{
+    static TokenAdjacency const adjacency = analyze_adjacency();
+    uint32_t const* follows = adjacency.follows;
+    size_t const end = tok_kind<EndTok>;
+
+    if (count == 0)
+    {
+        return adjacency.allows(end, end) || fail(error, 0, "empty input");
+    }
+
+    if (!adjacency.allows(end, kinds[0]))
+    {
+        return fail(error, 0, "unexpected " + quoted(kinds[0]) + " at start of input");
+    }
+
+    for (size_t block = 1; block < count; block += 64)
+    {
+        size_t const stop = std::min(count, block + 64);
+        uint32_t ok = 1;
+
+        for (size_t i = block; i < stop; ++i)
+        {
+            ok &= follows[kinds[i - 1]] >> kinds[i];
+        }
+
+        if (ok & 1)
+        {
+            continue;
+        }
+
+        for (size_t i = block; i < stop; ++i)
+        {
+            if (!adjacency.allows(kinds[i - 1], kinds[i]))
+            {
+                return fail(error, i, "unexpected " + quoted(kinds[i]) + " after " + quoted(kinds[i - 1]));
+            }
+        }
+    }
+
+    if (!adjacency.allows(kinds[count - 1], end))
+    {
+        return fail(error, count, "unexpected " + kind_name(end) + " after " + quoted(kinds[count - 1]));
+    }
+
+    return true;
+}
+
+bool prescan(uint8_t const* kinds, size_t count, vector<uint32_t>* matches, ParseError* error)
+{
+    ParseError bracket_error;
+    ParseError adjacency_error;
+    bool const balanced = match_brackets(kinds, count, matches, &bracket_error);
+    bool const adjacent = check_adjacency(kinds, count, &adjacency_error);
+
+    if (balanced && adjacent)
+    {
+        return true;
+    }
+
+    if (error)
+    {
+        bool const first = !adjacent && (balanced || adjacency_error.pos < bracket_error.pos);
+        *error = first ? adjacency_error : bracket_error;
+    }
+
+    return false;
+}
+
+vector<uint8_t> token_kinds(vector<Tok> const& tokens)
+{
+    vector<uint8_t> kinds(tokens.size());
+
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        kinds[i] = static_cast<uint8_t>(tokens[i].index());
+    }
+
+    return kinds;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "parsestate.hpp"
+#include <cstdint>
+
+// Linear checks over the token kinds alone, one byte per token as a
+// TokenView stores them, to turn away input the parser would only reject
+// after backtracking all the way through it. Neither rejects a program that
+// parses without recovery. Errors are at the earliest offending token.
+
+uint32_t const no_bracket = UINT32_MAX;
+
+// Pairs up ( ) and { }. matches, if given, is resized to count and receives
+// each bracket's partner position, and no_bracket for other tokens. False
+// if a bracket is unmatched or closes one of the other kind; the table then
+// stops at the error.
+bool match_brackets(uint8_t const* kinds, size_t count, vector<uint32_t>* matches = nullptr, 
+    ParseError* error = nullptr);
+
+// False if two adjacent tokens, or a token and an end of the input, never
+// stand together in the grammar; see analyze_adjacency().
+bool check_adjacency(uint8_t const* kinds, size_t count, ParseError* error = nullptr);
+
+// Both; the error is the earlier of the two.
+bool prescan(uint8_t const* kinds, size_t count, vector<uint32_t>* matches = nullptr, 
+    ParseError* error = nullptr);
+
+vector<uint8_t> token_kinds(vector<Tok> const&);
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+// Bounded multi-producer multi-consumer queue without locks, after Vyukov:
+// each cell carries a sequence number saying whether it is ready to be
+// written or read at the current lap, so producers and consumers only
+// contend on their own index. push() and pop() spin, then yield, then nap
+// while the queue is full or empty.
+//
+// Producers register up front and call producer_done() when finished; once
+// the last has and the queue has drained, pop() returns false.
+template <typename T>
+class BoundedQueue
+{
+    public:
+        struct Stats
+        {
+            uint64_t pushes     = 0;
+            uint64_t full_waits = 0; // Pushes that found the queue full.
+            uint64_t depth_sum  = 0; // Depth seen by each push, summed.
+            uint64_t max_depth  = 0;
+        };
+
+        // Capacity is rounded up to a power of two.
+        BoundedQueue(size_t capacity, unsigned producers)
+            : _producers(producers)
+        {
+            size_t size = 2;
+
+            while (size < capacity)
+            {
+                size *= 2;
+            }
+
+            _mask = size - 1;
+            _cells.reset(new Cell[size]);
+
+            for (size_t i = 0; i < size; ++i)
+            {
+                _cells[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        BoundedQueue(BoundedQueue const&) = delete;
+        BoundedQueue& operator=(BoundedQueue const&) = delete;
+
+        bool try_push(T& value)
+        {
+            size_t pos = _tail.load(std::memory_order_relaxed);
+
+            while (true)
+            {
+                Cell& cell = _cells[pos & _mask];
+                size_t const seq = cell.seq.load(std::memory_order_acquire);
+                intptr_t const diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+                if (diff == 0)
+                {
+                    if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        cell.value = std::move(value);
+                        cell.seq.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false; // Full.
+                }
+                else
+                {
+                    pos = _tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool try_pop(T& out)
+        {
+            size_t pos = _head.load(std::memory_order_relaxed);
+
+            while (true)
+            {
+                Cell& cell = _cells[pos & _mask];
+                size_t const seq = cell.seq.load(std::memory_order_acquire);
+                intptr_t const diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+                if (diff == 0)
+                {
+                    if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        out = std::move(cell.value);
+                        cell.seq.store(pos + _mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false; // Empty.
+                }
+                else
+                {
+                    pos = _head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        void push(T value)
+        {
+            uint64_t const depth = size();
+            _depth_sum.fetch_add(depth, std::memory_order_relaxed);
+            _pushes.fetch_add(1, std::memory_order_relaxed);
+
+            uint64_t max = _max_depth.load(std::memory_order_relaxed);
+
+            while (depth > max && !_max_depth.compare_exchange_weak(max, depth, std::memory_order_relaxed))
+            {
+            }
+
+            if (try_push(value))
+            {
+                return;
+            }
+
+            _full_waits.fetch_add(1, std::memory_order_relaxed);
+
+            for (unsigned spins = 0; !try_push(value); ++spins)
+            {
+                backoff(spins);
+            }
+        }
+
+        // False once every producer is done and nothing is left.
+        bool pop(T& out)
+        {
+            for (unsigned spins = 0; ; ++spins)
+            {
+                if (try_pop(out))
+                {
+                    return true;
+                }
+
+                if (_producers.load(std::memory_order_acquire) == 0)
+                {
+                    return try_pop(out); // Pushed just before the last finished.
+                }
+
+                backoff(spins);
+            }
+        }
+
+        void producer_done()
+        {
+            _producers.fetch_sub(1, std::memory_order_acq_rel);
+        }
+
+        bool closed() const
+        {
+            return _producers.load(std::memory_order_acquire) == 0;
+        }
+
+        // Approximate while others are pushing and popping.
+        size_t size() const
+        {
+            size_t const tail = _tail.load(std::memory_order_relaxed);
+            size_t const head = _head.load(std::memory_order_relaxed);
+            return tail > head ? tail - head : 0;
+        }
+
+        size_t capacity() const
+        {
+            return _mask + 1;
+        }
+
+        Stats stats() const
+        {
+            Stats s;
+            s.pushes = _pushes.load();
+            s.full_waits = _full_waits.load();
+            s.depth_sum = _depth_sum.load();
+            s.max_depth = _max_depth.load();
+            return s;
+        }
+
+    private:
+        struct Cell
+        {
+            std::atomic<size_t> seq;
+            T                   value;
+        };
+
+        std::unique_ptr<Cell[]> _cells;
+        size_t                  _mask;
+
+        // Apart, so producers and consumers do not share a cache line.
+        alignas(64) std::atomic<size_t> _tail{0};
+        alignas(64) std::atomic<size_t> _head{0};
+        alignas(64) std::atomic<unsigned> _producers;
+
+        std::atomic<uint64_t> _pushes{0};
+        std::atomic<uint64_t> _full_waits{0};
+        std::atomic<uint64_t> _depth_sum{0};
+        std::atomic<uint64_t> _max_depth{0};
+
+        static void backoff(unsigned spins)
+        {
+            if (spins < 64)
+            {
+                return;
+            }
+
+            if (spins < 128)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+};
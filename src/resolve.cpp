@@ -0,0 +1,197 @@
+#include "resolve.hpp"
+#include <unordered_map>
+
+using std::unordered_map;
+
+string to_string(ResolveError const& e)
+{
+    return e.func + ": " + e.message + " '" + e.name + "'";
+}
+
+class Resolver
+{
+    public:
+        Resolver(ASTFunc& func, vector<ResolveError>& errors)
+            : _func(func)
+            , _errors(errors)
+        {}
+
+        void run()
+        {
+            push_scope();
+
+            for (Arg const& arg : _func.args)
+            {
+                declare(arg.name, _func.span);
+            }
+
+            stmt(*_func.body);
+            pop_scope();
+            _func.num_slots = _next_slot;
+        }
+
+    private:
+        ASTFunc&              _func;
+        vector<ResolveError>& _errors;
+        unsigned              _next_slot = 0;
+
+        // Innermost binding last; popped when its scope closes.
+        unordered_map<string, vector<unsigned>> _bindings;
+        vector<vector<string const*>>           _scopes;
+
+        void error(string const& name, string const& message, Span at)
+        {
+            _errors.push_back(ResolveError{_func.name, name, message, at});
+        }
+
+        void push_scope()
+        {
+            _scopes.emplace_back();
+        }
+
+        void pop_scope()
+        {
+            for (string const* name : _scopes.back())
+            {
+                auto it = _bindings.find(*name);
+                it->second.pop_back();
+
+                if (it->second.empty())
+                {
+                    _bindings.erase(it);
+                }
+            }
+
+            _scopes.pop_back();
+        }
+
+        unsigned declare(string const& name, Span at)
+        {
+            for (string const* other : _scopes.back())
+            {
+                if (*other == name)
+                {
+                    error(name, "redeclared", at);
+                    break;
+                }
+            }
+
+            unsigned const slot = _next_slot++;
+            _bindings[name].push_back(slot);
+            _scopes.back().push_back(&name);
+            return slot;
+        }
+
+        unsigned lookup(string const& name, Span at)
+        {
+            auto const it = _bindings.find(name);
+
+            if (it == _bindings.end())
+            {
+                error(name, "unresolved", at);
+                return no_slot;
+            }
+
+            return it->second.back();
+        }
+
+        void stmt(AST& ast)
+        {
+            switch (ast.kind())
+            {
+                case ASTKind::block:
+                {
+                    push_scope();
+
+                    for (ASTPtr const& s : static_cast<ASTBlock&>(ast).stmts)
+                    {
+                        stmt(*s);
+                    }
+
+                    pop_scope();
+                    return;
+                }
+                case ASTKind::var_decl:
+                {
+                    auto& decl = static_cast<ASTVarDecl&>(ast);
+                    exp(*decl.value); // The initializer cannot see the new name.
+                    decl.slot = declare(decl.name, decl.span);
+                    return;
+                }
+                case ASTKind::assign:
+                {
+                    auto& assign = static_cast<ASTAssign&>(ast);
+                    exp(*assign.value);
+                    assign.slot = lookup(assign.name, assign.span);
+                    return;
+                }
+                default:
+                    exp(ast);
+                    return;
+            }
+        }
+
+        // Left to right, as written; chains can be deeper than the native
+        // stack, so this walks an explicit one.
+        void exp(AST& root)
+        {
+            vector<AST*> pending{&root};
+
+            while (!pending.empty())
+            {
+                AST& ast = *pending.back();
+                pending.pop_back();
+
+                switch (ast.kind())
+                {
+                    case ASTKind::var:
+                    {
+                        auto& var = static_cast<ASTVar&>(ast);
+                        var.slot = lookup(var.value, var.span);
+                        break;
+                    }
+                    case ASTKind::binop:
+                    {
+                        auto& binop = static_cast<ASTBinop&>(ast);
+                        pending.push_back(binop.right.get());
+                        pending.push_back(binop.left.get());
+                        break;
+                    }
+                    case ASTKind::unop:
+                        pending.push_back(static_cast<ASTUnop&>(ast).right.get());
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+};
+
+vector<ResolveError> resolve(ASTPtr const& ast)
+{
+    vector<ResolveError> errors;
+
+    if (ast->kind() == ASTKind::func)
+    {
+        Resolver(static_cast<ASTFunc&>(*ast), errors).run();
+    }
+    else if (ast->kind() == ASTKind::program)
+    {
+        for (ASTPtr const& decl : static_cast<ASTProgram&>(*ast).decls)
+        {
+            if (decl->kind() == ASTKind::func)
+            {
+                Resolver(static_cast<ASTFunc&>(*decl), errors).run();
+            }
+        }
+    }
+
+    return errors;
+}
+
+vector<ResolveError> resolve(ASTFunc& func)
+{
+    vector<ResolveError> errors;
+    Resolver(func, errors).run();
+    return errors;
+}
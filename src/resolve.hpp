@@ -0,0 +1,18 @@
+#pragma once
+
+#include "ast.hpp"
+
+struct ResolveError
+{
+    string func;
+    string name;
+    string message;
+    Span   span; // Of the node that raised it.
+};
+
+string to_string(ResolveError const&);
+
+// Binds every ASTVar, ASTAssign and ASTVarDecl to a dense per-function slot
+// and sets ASTFunc::num_slots. Accepts an ASTProgram or a single ASTFunc.
+vector<ResolveError> resolve(ASTPtr const&);
+vector<ResolveError> resolve(ASTFunc&);
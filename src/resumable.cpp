@@ -0,0 +1,116 @@
+#include "resumable.hpp"
+#include <algorithm>
+
+string to_string(ResumableParser::Status status)
+{
+    switch (status)
+    {
+        case ResumableParser::Status::need_more:   return "need_more";
+        case ResumableParser::Status::done:        return "done";
+        case ResumableParser::Status::failed:      return "failed";
+    }
+
+    std::abort();
+}
+
+ResumableParser::ResumableParser(FuncCallback on_func, ParseOptions const& opts)
+    : _source(*this)
+    , _on_func(std::move(on_func))
+    , _opts(opts)
+    , _thread([this]() { run(); })
+{}
+
+ResumableParser::~ResumableParser()
+{
+    finish();
+    _thread.join();
+}
+
+ResumableParser::Status ResumableParser::feed(vector<Tok> tokens)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_status != Status::need_more || _closed)
+        {
+            return _status;
+        }
+
+        _pending.insert(_pending.end(), 
+            std::make_move_iterator(tokens.begin()), 
+            std::make_move_iterator(tokens.end()));
+    }
+
+    return resume();
+}
+
+ResumableParser::Status ResumableParser::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_status != Status::need_more)
+        {
+            return _status;
+        }
+
+        _closed = true;
+    }
+
+    return resume();
+}
+
+ResumableParser::Status ResumableParser::status() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _status;
+}
+
+// Hands control to the parser thread until it suspends or finishes.
+ResumableParser::Status ResumableParser::resume()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _parser_turn = true;
+    _cv.notify_all();
+    _cv.wait(lock, [this]() { return !_parser_turn; });
+    return _status;
+}
+
+// Runs on the parser thread; suspends it whenever the input runs out.
+size_t ResumableParser::Source::read(vector<Tok>& out, size_t max)
+{
+    ResumableParser& p = _owner;
+    std::unique_lock<std::mutex> lock(p._mutex);
+
+    while (p._next == p._pending.size() && !p._closed)
+    {
+        p._pending.clear();
+        p._next = 0;
+        p._parser_turn = false;
+        p._cv.notify_all();
+        p._cv.wait(lock, [&p]() { return p._parser_turn; });
+    }
+
+    size_t const n = std::min(max, p._pending.size() - p._next);
+    auto const first = p._pending.begin() + static_cast<ptrdiff_t>(p._next);
+    out.insert(out.end(), 
+        std::make_move_iterator(first), 
+        std::make_move_iterator(first + static_cast<ptrdiff_t>(n)));
+    p._next += n;
+    return n;
+}
+
+void ResumableParser::run()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [this]() { return _parser_turn; });
+    }
+
+    bool const ok = parse_stream(_source, _on_func, _opts);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _status = ok ? Status::done : Status::failed;
+    _parser_turn = false;
+    _cv.notify_all();
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "parser.hpp"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// A parser that takes its input in chunks as it arrives. feed() runs the parse
+// until the tokens given so far are used up, then suspends it mid-rule; the
+// next feed() resumes exactly there, so nothing is parsed twice. Completed
+// functions are delivered through the callback as in parse_stream().
+//
+// The parse runs on its own thread, which serves as its continuation: control
+// passes back and forth with feed()/finish(), never both at once, so the
+// callback runs while the caller is blocked in feed() and needs no locking.
+class ResumableParser
+{
+    public:
+        enum class Status { need_more, done, failed };
+
+        ResumableParser(FuncCallback, ParseOptions const& = ParseOptions());
+        ~ResumableParser();
+
+        ResumableParser(ResumableParser const&) = delete;
+        ResumableParser& operator=(ResumableParser const&) = delete;
+
+        Status feed(vector<Tok> tokens);
+        Status finish(); // No more input is coming.
+        Status status() const;
+
+    private:
+        class Source : public TokenSource
+        {
+            public:
+                Source(ResumableParser& owner) : _owner(owner) {}
+                size_t read(vector<Tok>& out, size_t max);
+
+            private:
+                ResumableParser& _owner;
+        };
+
+        Source                  _source;
+        FuncCallback            _on_func;
+        ParseOptions            _opts;
+        vector<Tok>             _pending;
+        size_t                  _next = 0;
+        bool                    _closed = false;
+        bool                    _parser_turn = false;
+        Status                  _status = Status::need_more;
+        mutable std::mutex      _mutex;
+        std::condition_variable _cv;
+        std::thread             _thread;
+
+        Status resume();
+        void run();
+};
+
+string to_string(ResumableParser::Status);
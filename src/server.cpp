@@ -0,0 +1,724 @@
+#include "server.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "source.hpp"
+#include "tokfile.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+string to_string(ServerStats const& s)
+{
+    return std::to_string(s.connections) + " connections, "
+        + std::to_string(s.requests) + " requests, "
+        + std::to_string(s.cache_hits) + " cache hits, "
+        + std::to_string(s.failed) + " failed";
+}
+
+using Clock = std::chrono::steady_clock;
+using Deadline = optional<Clock::time_point>;
+
+// Waits for fd to be ready; false once the deadline has passed.
+static bool wait_until(int fd, short events, Clock::time_point deadline)
+{
+    while (true)
+    {
+        auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+
+        if (left <= 0)
+        {
+            return false;
+        }
+
+        pollfd p = {fd, events, 0};
+        int const r = ::poll(&p, 1, static_cast<int>(std::min<int64_t>(left, INT_MAX)));
+
+        if (r != 0 && !(r < 0 && errno == EINTR))
+        {
+            return r > 0;
+        }
+    }
+}
+
+// With a deadline the socket is never blocked on: a peer that stalls
+// mid-message only costs the time left.
+static bool read_full(int fd, void* data, size_t size, Deadline deadline = std::nullopt)
+{
+    char* p = static_cast<char*>(data);
+    int const flags = deadline ? MSG_DONTWAIT : 0;
+
+    while (size)
+    {
+        ssize_t const n = ::recv(fd, p, size, flags);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (n < 0 && deadline && errno == EAGAIN && wait_until(fd, POLLIN, *deadline))
+        {
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            return false;
+        }
+
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+static bool write_full(int fd, void const* data, size_t size, Deadline deadline = std::nullopt)
+{
+    char const* p = static_cast<char const*>(data);
+    int const flags = MSG_NOSIGNAL | (deadline ? MSG_DONTWAIT : 0);
+
+    while (size)
+    {
+        ssize_t const n = ::send(fd, p, size, flags);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (n < 0 && deadline && errno == EAGAIN && wait_until(fd, POLLOUT, *deadline))
+        {
+            continue;
+        }
+
+        if (n <= 0)
+        {
+            return false;
+        }
+
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+// One message: length, code, body.
+static bool send_message(int fd, uint8_t code, string const& body, Deadline deadline = std::nullopt)
+{
+    string frame(sizeof(uint32_t) + 1, '\0');
+    uint32_t const length = static_cast<uint32_t>(body.size() + 1);
+    memcpy(&frame[0], &length, sizeof(length));
+    frame[sizeof(length)] = static_cast<char>(code);
+    frame += body;
+    return write_full(fd, frame.data(), frame.size(), deadline);
+}
+
+// False at end of stream, on an error or past the deadline; an oversized
+// message leaves *too_big set and the stream unread.
+static bool receive_message(int fd, size_t max_size, uint8_t* code, string* body, bool* too_big = nullptr,
+    Deadline deadline = std::nullopt)
+{
+    uint32_t length;
+
+    if (!read_full(fd, &length, sizeof(length), deadline) || length == 0)
+    {
+        return false;
+    }
+
+    if (length - 1 > max_size)
+    {
+        if (too_big)
+        {
+            *too_big = true;
+        }
+
+        return false;
+    }
+
+    if (!read_full(fd, code, 1, deadline))
+    {
+        return false;
+    }
+
+    body->resize(length - 1);
+    return read_full(fd, &(*body)[0], body->size(), deadline);
+}
+
+static bool socket_address(string const& path, sockaddr_un* addr, string* error)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(addr->sun_path))
+    {
+        if (error)
+        {
+            *error = path + ": socket path too long";
+        }
+
+        return false;
+    }
+
+    memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+static string system_error(string const& what)
+{
+    return what + ": " + strerror(errno);
+}
+
+ParseServer::ParseServer(ServerOptions opts)
+    : _opts(std::move(opts))
+{}
+
+ParseServer::~ParseServer()
+{
+    if (_listen >= 0)
+    {
+        ::close(_listen);
+        ::unlink(_opts.socket_path.c_str());
+    }
+
+    for (int fd : _wake)
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+    }
+}
+
+bool ParseServer::start(string* error)
+{
+    sockaddr_un addr;
+
+    if (!socket_address(_opts.socket_path, &addr, error))
+    {
+        return false;
+    }
+
+    if (!_opts.root.empty())
+    {
+        char resolved[PATH_MAX];
+
+        if (!::realpath(_opts.root.c_str(), resolved))
+        {
+            if (error)
+            {
+                *error = system_error(_opts.root);
+            }
+
+            return false;
+        }
+
+        _root = string(resolved) + (resolved[1] ? "/" : "");
+    }
+
+    if (_wake[0] < 0 && ::pipe2(_wake, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        if (error)
+        {
+            *error = system_error("pipe");
+        }
+
+        return false;
+    }
+
+    // Non-blocking, so a client that gives up between poll() and accept()
+    // cannot stall the loop.
+    _listen = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    if (_listen < 0)
+    {
+        if (error)
+        {
+            *error = system_error("socket");
+        }
+
+        return false;
+    }
+
+    ::unlink(_opts.socket_path.c_str());
+
+    if (::bind(_listen, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) < 0
+        || ::listen(_listen, SOMAXCONN) < 0)
+    {
+        if (error)
+        {
+            *error = system_error(_opts.socket_path);
+        }
+
+        ::close(_listen);
+        _listen = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void ParseServer::run()
+{
+    {
+        // Its destructor waits for the requests in flight, which close
+        // their connections once _stopping is set.
+        ThreadPool pool(_opts.threads);
+        vector<pollfd> fds;
+
+        while (!_stopping)
+        {
+            fds.assign({{_listen, POLLIN, 0}, {_wake[0], POLLIN, 0}});
+
+            {
+                std::lock_guard<std::mutex> lock(_connection_mutex);
+
+                for (int connection : _idle)
+                {
+                    fds.push_back({connection, POLLIN, 0});
+                }
+
+                _idle.clear();
+            }
+
+            if (::poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+            {
+                break;
+            }
+
+            char drain[64];
+
+            while (::read(_wake[0], drain, sizeof(drain)) > 0)
+            {
+            }
+
+            // Readable, closed or failed: serve() reads the request or finds
+            // the end. The rest wait on.
+            for (size_t i = 2; i < fds.size(); ++i)
+            {
+                int const connection = fds[i].fd;
+
+                if (fds[i].revents && !_stopping)
+                {
+                    pool.submit([this, connection]() { serve(connection); });
+                }
+                else
+                {
+                    park(connection);
+                }
+            }
+
+            if (fds[0].revents & POLLIN)
+            {
+                int connection;
+
+                while ((connection = ::accept4(_listen, nullptr, nullptr, SOCK_CLOEXEC)) >= 0)
+                {
+                    ++_connections;
+                    std::lock_guard<std::mutex> lock(_connection_mutex);
+                    _live.insert(connection);
+                    _idle.push_back(connection);
+                }
+            }
+        }
+
+        // Shutting connections down ends any read or write a request is
+        // blocked in; the descriptors stay open until whoever holds them
+        // closes them.
+        std::lock_guard<std::mutex> lock(_connection_mutex);
+
+        for (int connection : _live)
+        {
+            ::shutdown(connection, SHUT_RDWR);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(_connection_mutex);
+
+    for (int connection : _idle)
+    {
+        _live.erase(connection);
+        ::close(connection);
+    }
+
+    _idle.clear();
+}
+
+void ParseServer::park(int connection)
+{
+    std::lock_guard<std::mutex> lock(_connection_mutex);
+    _idle.push_back(connection);
+}
+
+// Under the lock, so stop() never shuts down a descriptor number that has
+// been closed and reused.
+void ParseServer::close_connection(int connection)
+{
+    std::lock_guard<std::mutex> lock(_connection_mutex);
+    _live.erase(connection);
+    ::close(connection);
+}
+
+// Async-signal-safe, as stop() calls it: a write, and errno put back.
+void ParseServer::wake()
+{
+    int const saved = errno;
+    char const byte = 0;
+
+    while (::write(_wake[1], &byte, 1) < 0 && errno == EINTR)
+    {
+    }
+
+    errno = saved;
+}
+
+static_assert(std::atomic<bool>::is_always_lock_free, "stop() sets _stopping from signal handlers");
+
+// Takes no lock, so that a signal arriving while this thread holds one
+// cannot deadlock it; run() does the shutting down.
+void ParseServer::stop()
+{
+    _stopping = true;
+
+    if (_wake[1] >= 0)
+    {
+        wake();
+    }
+}
+
+ServerStats ParseServer::stats() const
+{
+    ServerStats s;
+    s.connections = _connections;
+    s.requests = _requests;
+    s.cache_hits = _cache_hits;
+    s.failed = _failed;
+    return s;
+}
+
+// One request, read in full once its first bytes have arrived. The
+// connection then goes back to run() to wait for the next, or is closed at
+// its end, on an error, or if the client stalls past the timeout.
+void ParseServer::serve(int connection)
+{
+    auto const deadline = [this]() -> Deadline
+    {
+        return _opts.timeout_ms ? Deadline(Clock::now() + std::chrono::milliseconds(_opts.timeout_ms)) : std::nullopt;
+    };
+
+    uint8_t code;
+    string body;
+    bool too_big = false;
+
+    if (receive_message(connection, _opts.max_request, &code, &body, &too_big, deadline()))
+    {
+        ServerReply const reply = handle(static_cast<ServerRequest>(code), body);
+
+        if (send_message(connection, static_cast<uint8_t>(reply.status), reply.body, deadline()) && !_stopping)
+        {
+            park(connection);
+            wake();
+            return;
+        }
+    }
+    else if (too_big)
+    {
+        ++_failed;
+        send_message(connection, static_cast<uint8_t>(ServerStatus::bad_request), "request too large\n", deadline());
+    }
+
+    close_connection(connection);
+}
+
+ServerReply ParseServer::handle(ServerRequest request, string const& body)
+{
+    ++_requests;
+    ServerReply reply;
+
+    switch (request)
+    {
+        case ServerRequest::text:
+        case ServerRequest::tokens:
+            reply = parse_cached(request, body);
+            break;
+
+        case ServerRequest::path:
+            reply = parse_path(body);
+            break;
+
+        case ServerRequest::stats:
+            return {ServerStatus::ok, to_string(stats()) + "\n"};
+
+        default:
+            reply = {ServerStatus::bad_request, "unknown request\n"};
+            break;
+    }
+
+    if (reply.status == ServerStatus::failed || reply.status == ServerStatus::bad_request)
+    {
+        ++_failed;
+    }
+
+    return reply;
+}
+
+ServerReply ParseServer::parse_cached(ServerRequest request, string const& body)
+{
+    string key = static_cast<char>(request) + body;
+
+    if (optional<ServerReply> hit = cached(key))
+    {
+        ++_cache_hits;
+        return *hit;
+    }
+
+    ServerReply reply;
+
+    if (request == ServerRequest::text)
+    {
+        reply = parse_text(body);
+    }
+    else
+    {
+        // decode_tokens needs 4-byte alignment, which a string's heap
+        // buffer has.
+        string error;
+        optional<TokenView> view = decode_tokens(body, &error);
+        reply = view ? parse_tokens(*view) : ServerReply{ServerStatus::bad_request, error + "\n"};
+    }
+
+    remember(std::move(key), reply);
+    return reply;
+}
+
+optional<ServerReply> ParseServer::cached(string const& key)
+{
+    std::lock_guard<std::mutex> lock(_cache_mutex);
+    auto it = _cache_index.find(key);
+
+    if (it == _cache_index.end())
+    {
+        return std::nullopt;
+    }
+
+    _cache.splice(_cache.begin(), _cache, it->second);
+    return it->second->second;
+}
+
+// The key is counted twice, as the index holds a copy. A pair larger than
+// the whole cache is not kept.
+static size_t cache_cost(string const& key, ServerReply const& reply)
+{
+    return 2 * key.size() + reply.body.size();
+}
+
+void ParseServer::remember(string key, ServerReply const& reply)
+{
+    size_t const cost = cache_cost(key, reply);
+
+    if (cost > _opts.cache_bytes)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_cache_mutex);
+
+    if (_cache_index.count(key))
+    {
+        return; // Another connection got there first.
+    }
+
+    _cache.emplace_front(std::move(key), reply);
+    _cache_index[_cache.front().first] = _cache.begin();
+    _cache_size += cost;
+
+    while (_cache_size > _opts.cache_bytes)
+    {
+        _cache_size -= cache_cost(_cache.back().first, _cache.back().second);
+        _cache_index.erase(_cache.back().first);
+        _cache.pop_back();
+    }
+}
+
+// The errors, one per line, then the AST if there is one.
+template <typename Where>
+static ServerReply reply_for(Parsed<ASTPtr> const& r, vector<ParseError> const& errors, Where const& where)
+{
+    ServerReply reply;
+    reply.status = !r ? ServerStatus::failed
+        : errors.empty() ? ServerStatus::ok : ServerStatus::recovered;
+
+    for (ParseError const& e : errors)
+    {
+        reply.body += where(e) + ": " + e.message + "\n";
+    }
+
+    if (r)
+    {
+        reply.body += std::get<0>(*r)->to_string() + "\n";
+    }
+
+    return reply;
+}
+
+// Recovering, so that every error is reported, within a step budget in
+// proportion to the input, so that no request holds a worker for long.
+ParseOptions ParseServer::parse_options(vector<ParseError>* errors, size_t tokens) const
+{
+    ParseOptions opts;
+    opts.errors = errors;
+    opts.recover = true;
+    opts.max_steps = _opts.steps_per_token * (tokens + 1);
+    return opts;
+}
+
+ServerReply ParseServer::parse_text(string const& text)
+{
+    vector<uint32_t> offsets;
+    LexError lex_error;
+    optional<vector<Tok>> tokens = lex(text, &offsets, &lex_error);
+
+    if (!tokens)
+    {
+        return {ServerStatus::failed, to_string(lex_error) + "\n"};
+    }
+
+    vector<ParseError> errors;
+    Parsed<ASTPtr> const r = parse(*tokens, parse_options(&errors, tokens->size()));
+    SourceMap const source(text, std::move(offsets));
+
+    return reply_for(r, errors, [&](ParseError const& e)
+    {
+        return to_string(source.at_token(static_cast<uint32_t>(e.pos)));
+    });
+}
+
+ServerReply ParseServer::parse_tokens(TokenView const& view)
+{
+    vector<ParseError> errors;
+    Parsed<ASTPtr> const r = parse(view, parse_options(&errors, view.size()));
+
+    return reply_for(r, errors, [&](ParseError const& e)
+    {
+        return view.offsets() && e.pos < view.size()
+            ? "byte " + std::to_string(view.offsets()[e.pos])
+            : "token " + std::to_string(e.pos);
+    });
+}
+
+// A path is read afresh each time, since the file may have changed. Source
+// text is then cached by content; a token file is mapped, not copied, so it
+// is parsed every time.
+ServerReply ParseServer::parse_path(string const& requested)
+{
+    if (_root.empty())
+    {
+        return {ServerStatus::bad_request, "path requests are disabled\n"};
+    }
+
+    // Resolved first, so neither ".." nor a link can lead outside the root.
+    // A missing file and one outside get the same answer, so that clients
+    // cannot probe what exists elsewhere.
+    char resolved[PATH_MAX];
+    string const full = !requested.empty() && requested[0] == '/' ? requested : _root + requested;
+    string const path = ::realpath(full.c_str(), resolved) ? resolved : "";
+
+    if (path.empty() || path.compare(0, _root.size(), _root) != 0)
+    {
+        return {ServerStatus::failed, requested + ": no such file under the server root\n"};
+    }
+
+    bool const is_tok = path.size() > 4 && path.compare(path.size() - 4, 4, ".tok") == 0;
+
+    if (is_tok)
+    {
+        string error;
+        unique_ptr<TokenFile> file = TokenFile::open(path, &error);
+
+        if (!file)
+        {
+            return {ServerStatus::failed, error + "\n"};
+        }
+
+        return parse_tokens(file->view());
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream text;
+    text << file.rdbuf();
+
+    if (!file)
+    {
+        return {ServerStatus::failed, requested + ": cannot read\n"};
+    }
+
+    return parse_cached(ServerRequest::text, text.str());
+}
+
+ParseClient::ParseClient(int fd)
+    : _fd(fd)
+{}
+
+ParseClient::~ParseClient()
+{
+    ::close(_fd);
+}
+
+unique_ptr<ParseClient> ParseClient::connect(string const& socket_path, string* error)
+{
+    sockaddr_un addr;
+
+    if (!socket_address(socket_path, &addr, error))
+    {
+        return nullptr;
+    }
+
+    int const fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) < 0)
+    {
+        if (error)
+        {
+            *error = system_error(socket_path);
+        }
+
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+
+        return nullptr;
+    }
+
+    return unique_ptr<ParseClient>(new ParseClient(fd));
+}
+
+optional<ServerReply> ParseClient::request(ServerRequest request, string const& body, string* error)
+{
+    uint8_t code;
+    string reply;
+
+    if (!send_message(_fd, static_cast<uint8_t>(request), body)
+        || !receive_message(_fd, UINT32_MAX, &code, &reply))
+    {
+        if (error)
+        {
+            *error = "connection lost";
+        }
+
+        return std::nullopt;
+    }
+
+    return ServerReply{static_cast<ServerStatus>(code), std::move(reply)};
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "parsestate.hpp"
+#include "threadpool.hpp"
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+using std::optional;
+using std::string;
+using std::unique_ptr;
+
+// A parse daemon on a Unix domain socket. The grammar is built once per
+// process, so a warm server answers a small request in microseconds where
+// spawning prs would pay startup and closure construction each time.
+//
+// Each message, either way, is a native-endian uint32_t length followed by
+// that many bytes: a one-byte code, then the body. Requests:
+//
+//   text    source text, lexed by the server
+//   tokens  an encoded token buffer (see tokfile.hpp), parsed in place
+//   path    a file beneath ServerOptions::root to read: a .tok file is
+//           mapped, anything else lexed
+//   stats   no body; the reply describes the server's counters
+//
+// A reply's code is a ServerStatus and its body is text: one line per syntax
+// error, "line:col: message" where the position is known, then the AST. A
+// connection may carry any number of requests; replies come back in order.
+
+enum class ServerRequest : uint8_t { text, tokens, path, stats };
+
+enum class ServerStatus : uint8_t
+{
+    ok,          // Parsed cleanly.
+    recovered,   // Parsed, with syntax errors listed before the AST.
+    failed,      // Nothing to show but the errors.
+    bad_request, // Unknown code, oversized or malformed message.
+};
+
+struct ServerReply
+{
+    ServerStatus status;
+    string       body;
+};
+
+struct ServerOptions
+{
+    string   socket_path;
+    unsigned threads       = 0;    // Requests served at once; 0 for one
+                                   // per hardware thread.
+    size_t   cache_bytes   = 64 << 20; // Keys and replies kept for repeated
+                                       // requests, at most; 0 for no cache.
+    size_t   max_request   = 64 << 20;
+
+    // A request must arrive in full, and its reply be taken, within this
+    // long of its first bytes, or the connection is closed; 0 for no limit.
+    unsigned timeout_ms      = 10000;
+
+    // Parses halt, failing the request, past this many steps per token;
+    // 0 for no limit.
+    uint64_t steps_per_token = 1000;
+
+    // Path requests may only read files under this directory, after
+    // symbolic links are resolved; relative paths are taken from it. Empty
+    // refuses every path request.
+    string   root;
+};
+
+struct ServerStats
+{
+    uint64_t connections = 0;
+    uint64_t requests    = 0;
+    uint64_t cache_hits  = 0;
+    uint64_t failed      = 0; // Failed or bad requests.
+};
+
+string to_string(ServerStats const&);
+
+class ParseServer
+{
+    public:
+        explicit ParseServer(ServerOptions);
+        ~ParseServer();
+
+        ParseServer(ParseServer const&) = delete;
+        ParseServer& operator=(ParseServer const&) = delete;
+
+        // Binds and listens, replacing a stale socket file.
+        bool start(string* error = nullptr);
+
+        // Accepts connections and waits for requests on them until stop().
+        // Idle connections hold no thread: each request is served on the
+        // pool as it arrives, and its connection then goes back to waiting.
+        void run();
+
+        // Safe from any thread, and from a signal handler: it only sets a
+        // flag and wakes run(), which then shuts open connections down, so
+        // requests in flight fail fast, and returns once they have.
+        void stop();
+
+        ServerStats stats() const;
+
+        // What a request gets back, without the socket.
+        ServerReply handle(ServerRequest, string const& body);
+
+    private:
+        ServerOptions     _opts;
+        int               _listen = -1;
+        string            _root; // Resolved, with a trailing '/'.
+        int               _wake[2] = {-1, -1}; // A pipe that interrupts poll().
+        std::atomic<bool> _stopping{false};
+
+        // Connections waiting for their next request, handed back by the
+        // pool for run() to poll, and every connection not yet closed.
+        std::mutex              _connection_mutex;
+        vector<int>             _idle;
+        std::unordered_set<int> _live;
+
+        std::atomic<uint64_t> _connections{0};
+        std::atomic<uint64_t> _requests{0};
+        std::atomic<uint64_t> _cache_hits{0};
+        std::atomic<uint64_t> _failed{0};
+
+        // Least recently used last; keyed by the request code and body, and
+        // evicted once keys and reply bodies pass cache_bytes together.
+        using CacheList = std::list<std::pair<string, ServerReply>>;
+        std::mutex _cache_mutex;
+        CacheList  _cache;
+        size_t     _cache_size = 0;
+        std::unordered_map<string, CacheList::iterator> _cache_index;
+
+        optional<ServerReply> cached(string const& key);
+        void remember(string key, ServerReply const&);
+        ServerReply parse_cached(ServerRequest, string const& body);
+        ServerReply parse_text(string const& text);
+        ServerReply parse_tokens(TokenView const&);
+        ServerReply parse_path(string const& path);
+        ParseOptions parse_options(vector<ParseError>* errors, size_t tokens) const;
+        void serve(int connection);
+        void park(int connection);
+        void close_connection(int connection);
+        void wake();
+};
+
+class ParseClient
+{
+    public:
+        static unique_ptr<ParseClient> connect(string const& socket_path, string* error = nullptr);
+        ~ParseClient();
+
+        ParseClient(ParseClient const&) = delete;
+        ParseClient& operator=(ParseClient const&) = delete;
+
+        // Sends one request and waits for its reply; nullopt if the
+        // connection failed.
+        optional<ServerReply> request(ServerRequest, string const& body, string* error = nullptr);
+
+    private:
+        int _fd;
+
+        explicit ParseClient(int fd);
+};
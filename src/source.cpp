@@ -0,0 +1,60 @@
+#include "source.hpp"
+#include <algorithm>
+
+string to_string(Location loc)
+{
+    return std::to_string(loc.line) + ":" + std::to_string(loc.column);
+}
+
+SourceMap::SourceMap(string text, vector<uint32_t> offsets)
+    : _text(std::move(text))
+    , _offsets(std::move(offsets))
+    , _lines{0}
+{
+    for (size_t i = 0; i < _text.size(); ++i)
+    {
+        if (_text[i] == '\n')
+        {
+            _lines.push_back(static_cast<uint32_t>(i + 1));
+        }
+    }
+}
+
+string const& SourceMap::text() const
+{
+    return _text;
+}
+
+size_t SourceMap::token_count() const
+{
+    return _offsets.size();
+}
+
+uint32_t SourceMap::offset(uint32_t token) const
+{
+    return token < _offsets.size() ? _offsets[token] : static_cast<uint32_t>(_text.size());
+}
+
+Location SourceMap::at_offset(uint32_t offset) const
+{
+    auto const it = std::upper_bound(_lines.begin(), _lines.end(), offset) - 1;
+    Location loc;
+    loc.line = static_cast<uint32_t>(it - _lines.begin() + 1);
+    loc.column = offset - *it + 1;
+    return loc;
+}
+
+Location SourceMap::at_token(uint32_t token) const
+{
+    return at_offset(offset(token));
+}
+
+Location SourceMap::begin(Span span) const
+{
+    return at_token(span.begin);
+}
+
+Location SourceMap::last(Span span) const
+{
+    return at_token(span.end > span.begin ? span.end - 1 : span.begin);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "ast.hpp"
+#include <cstdint>
+
+// 1-based; columns count bytes.
+struct Location
+{
+    uint32_t line   = 1;
+    uint32_t column = 1;
+};
+
+string to_string(Location);
+
+// Maps token indices back to the text they were lexed from. Tokens carry no
+// position; the map keeps one 32-bit byte offset per token beside them, and
+// an index of line starts in which binary search finds lines and columns.
+// The index is built up front, so lookups are read-only and thread-safe.
+class SourceMap
+{
+    public:
+        SourceMap(string text, vector<uint32_t> offsets);
+
+        string const& text() const;
+        size_t token_count() const;
+
+        // Byte offset of a token; the text size past the last one.
+        uint32_t offset(uint32_t token) const;
+
+        Location at_offset(uint32_t offset) const;
+        Location at_token(uint32_t token) const;
+
+        // Start of the first and of the last token of a node.
+        Location begin(Span) const;
+        Location last(Span) const;
+
+    private:
+        string                   _text;
+        vector<uint32_t>         _offsets;
+        vector<uint32_t>         _lines; // Byte offset of each line start.
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::function;
+using std::vector;
+
+class ThreadPool
+{
+    public:
+        // 0 threads means one per hardware thread.
+        explicit ThreadPool(unsigned threads = 0);
+        ~ThreadPool();
+
+        ThreadPool(ThreadPool const&) = delete;
+        ThreadPool& operator=(ThreadPool const&) = delete;
+
+        unsigned size() const;
+        void submit(function<void()>);
+
+    private:
+        vector<std::thread>           _threads;
+        std::deque<function<void()>>  _tasks;
+        std::mutex                    _mutex;
+        std::condition_variable       _ready;
+        bool                          _stopping = false;
+
+        void work();
+};
+
+// Runs f(0) .. f(n-1) on the pool and returns once all of them have finished.
+template <typename F>
+void parallel_for(ThreadPool& pool, size_t n, F const& f)
+{
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t remaining = n;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        pool.submit([&, i]()
+        {
+            f(i);
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (--remaining == 0)
+            {
+                done.notify_one();
+            }
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return remaining == 0; });
+}
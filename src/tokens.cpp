@@ -57,3 +57,17 @@ string to_string(vector<Tok> const& toks)
 
     return s;
 }
+
+static_assert(tok_kind<EndTok> == 0 && tok_kind<AssignTok> == tok_kind_count - 1);
+
+string kind_name(size_t kind)
+{
+    static char const* const names[tok_kind_count] = 
+    {
+        "end of input", "number", "name", 
+        "(", ")", "{", "}", ",", ";", 
+        "+", "-", "*", "/", "&&", "||", "-", "!", "=",
+    };
+
+    return kind < tok_kind_count ? names[kind] : "?";
+}
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <memory>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
@@ -51,5 +52,20 @@ using Tok = variant<
     AssignTok
     >;
 
+// Variant index of token type T, e.g. tok_kind<SemiTok>.
+template <typename T, typename... Ts>
+constexpr size_t tok_kind_in(variant<Ts...> const*)
+{
+    size_t i = 0;
+    ((std::is_same_v<T, Ts> ? true : (++i, false)) || ...);
+    return i;
+}
+
+template <typename T>
+constexpr size_t tok_kind = tok_kind_in<T>(static_cast<Tok const*>(nullptr));
+
+size_t const tok_kind_count = std::variant_size_v<Tok>;
+
 string to_string(Tok const&);
 string to_string(vector<Tok> const&);
+string kind_name(size_t kind);
@@ -0,0 +1,45 @@
+#include "tokensource.hpp"
+#include <algorithm>
+#include <iterator>
+
+VectorTokenSource::VectorTokenSource(vector<Tok> const& tokens)
+    : _tokens(tokens)
+{}
+
+size_t VectorTokenSource::read(vector<Tok>& out, size_t max)
+{
+    size_t const n = std::min(max, _tokens.size() - _next);
+    auto const first = _tokens.begin() + static_cast<ptrdiff_t>(_next);
+    out.insert(out.end(), first, first + static_cast<ptrdiff_t>(n));
+    _next += n;
+    return n;
+}
+
+ChunkedTokenSource::ChunkedTokenSource(vector<vector<Tok>> chunks)
+    : _chunks(std::move(chunks))
+{}
+
+size_t ChunkedTokenSource::read(vector<Tok>& out, size_t max)
+{
+    size_t total = 0;
+
+    while (total < max && _chunk < _chunks.size())
+    {
+        vector<Tok>& chunk = _chunks[_chunk];
+        size_t const n = std::min(max - total, chunk.size() - _next);
+        auto const first = chunk.begin() + static_cast<ptrdiff_t>(_next);
+        out.insert(out.end(), std::make_move_iterator(first), 
+            std::make_move_iterator(first + static_cast<ptrdiff_t>(n)));
+        _next += n;
+        total += n;
+
+        if (_next == chunk.size())
+        {
+            vector<Tok>().swap(chunk);
+            ++_chunk;
+            _next = 0;
+        }
+    }
+
+    return total;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "tokens.hpp"
+
+// Supplies tokens incrementally, for inputs too large to hold at once.
+class TokenSource
+{
+    public:
+        virtual ~TokenSource() {}
+
+        // Appends at most max tokens to out and returns how many were
+        // appended; 0 means the input is exhausted.
+        virtual size_t read(vector<Tok>& out, size_t max) = 0;
+};
+
+class VectorTokenSource : public TokenSource
+{
+    public:
+        VectorTokenSource(vector<Tok> const&);
+        size_t read(vector<Tok>& out, size_t max);
+
+    private:
+        vector<Tok> const& _tokens;
+        size_t             _next = 0;
+};
+
+// Hands out the tokens of several buffers in order, e.g. lex_parallel()'s
+// chunks, moving them out rather than copying, and frees each buffer once
+// it has been read.
+class ChunkedTokenSource : public TokenSource
+{
+    public:
+        explicit ChunkedTokenSource(vector<vector<Tok>> chunks);
+        size_t read(vector<Tok>& out, size_t max);
+
+    private:
+        vector<vector<Tok>> _chunks;
+        size_t              _chunk = 0;
+        size_t              _next  = 0;
+};
@@ -0,0 +1,366 @@
+#include "tokfile.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+static char const token_magic[8] = {'P', 'R', 'S', 'T', 'O', 'K', 'S', '\0'};
+
+static size_t align4(size_t n)
+{
+    return (n + 3) & ~static_cast<size_t>(3);
+}
+
+//// VIEW ////
+
+size_t TokenView::size() const
+{
+    return _size;
+}
+
+size_t TokenView::kind(size_t i) const
+{
+    return _kinds[i];
+}
+
+uint32_t TokenView::payload(size_t i) const
+{
+    return _payloads[i];
+}
+
+VarTok const& TokenView::name(uint32_t index) const
+{
+    return _names[index];
+}
+
+uint8_t const* TokenView::kinds() const
+{
+    return _kinds;
+}
+
+uint32_t const* TokenView::offsets() const
+{
+    return _offsets;
+}
+
+template <size_t... Is>
+static Tok make_tok(size_t kind, std::index_sequence<Is...>)
+{
+    static Tok const prototypes[] = { Tok(std::in_place_index<Is>)... };
+    return prototypes[kind];
+}
+
+Tok TokenView::tok(size_t i) const
+{
+    switch (kind(i))
+    {
+        case tok_kind<NumTok>: return NumTok{static_cast<int>(payload(i))};
+        case tok_kind<VarTok>: return name(payload(i));
+        default:               return make_tok(kind(i), std::make_index_sequence<tok_kind_count>());
+    }
+}
+
+vector<Tok> TokenView::to_tokens() const
+{
+    vector<Tok> tokens;
+    tokens.reserve(_size);
+
+    for (size_t i = 0; i < _size; ++i)
+    {
+        tokens.push_back(tok(i));
+    }
+
+    return tokens;
+}
+
+//// ENCODING ////
+
+template <typename T>
+static void append(string& out, T const* data, size_t n)
+{
+    out.append(reinterpret_cast<char const*>(data), n * sizeof(T));
+    out.resize(align4(out.size()));
+}
+
+optional<string> encode_tokens(vector<Tok> const& tokens, vector<uint32_t> const* offsets, 
+    string* error)
+{
+    auto const fail = [&](string message) -> optional<string>
+    {
+        if (error)
+        {
+            *error = std::move(message);
+        }
+
+        return std::nullopt;
+    };
+
+    // The header counts in 32 bits, and string indices fit in a payload.
+    if (tokens.size() > UINT32_MAX)
+    {
+        return fail("too many tokens for a token file");
+    }
+
+    if (offsets && offsets->size() != tokens.size())
+    {
+        offsets = nullptr;
+    }
+
+    vector<uint8_t> kinds;
+    vector<uint32_t> payloads;
+    vector<uint32_t> string_ends;
+    string string_bytes;
+    std::unordered_map<string, uint32_t> strings;
+
+    kinds.reserve(tokens.size());
+    payloads.reserve(tokens.size());
+
+    for (Tok const& tok : tokens)
+    {
+        kinds.push_back(static_cast<uint8_t>(tok.index()));
+
+        if (NumTok const* num = std::get_if<NumTok>(&tok))
+        {
+            payloads.push_back(static_cast<uint32_t>(num->value));
+        }
+        else if (VarTok const* var = std::get_if<VarTok>(&tok))
+        {
+            auto const [it, added] = strings.insert({var->value, static_cast<uint32_t>(strings.size())});
+
+            if (added)
+            {
+                if (var->value.size() > UINT32_MAX - string_bytes.size())
+                {
+                    return fail("too many string bytes for a token file");
+                }
+
+                string_bytes += var->value;
+                string_ends.push_back(static_cast<uint32_t>(string_bytes.size()));
+            }
+
+            payloads.push_back(it->second);
+        }
+        else
+        {
+            payloads.push_back(0);
+        }
+    }
+
+    TokenFileHeader header;
+    std::memcpy(header.magic, token_magic, sizeof header.magic);
+    header.version = token_file_version;
+    header.byte_order = token_byte_order;
+    header.tokens = static_cast<uint32_t>(tokens.size());
+    header.strings = static_cast<uint32_t>(string_ends.size());
+    header.string_bytes = static_cast<uint32_t>(string_bytes.size());
+    header.flags = offsets ? token_has_offsets : 0;
+
+    string out;
+    append(out, &header, 1);
+    append(out, kinds.data(), kinds.size());
+    append(out, payloads.data(), payloads.size());
+
+    if (offsets)
+    {
+        append(out, offsets->data(), offsets->size());
+    }
+
+    append(out, string_ends.data(), string_ends.size());
+    append(out, string_bytes.data(), string_bytes.size());
+    return out;
+}
+
+optional<TokenView> decode_tokens(string_view bytes, string* error)
+{
+    auto const fail = [&](string message) -> optional<TokenView>
+    {
+        if (error)
+        {
+            *error = std::move(message);
+        }
+
+        return std::nullopt;
+    };
+
+    if (bytes.size() < sizeof(TokenFileHeader))
+    {
+        return fail("too short for a token file");
+    }
+
+    // The view reads the uint32_t arrays in place.
+    if (reinterpret_cast<uintptr_t>(bytes.data()) % alignof(uint32_t) != 0)
+    {
+        return fail("token file buffer is not 4-byte aligned");
+    }
+
+    TokenFileHeader header;
+    std::memcpy(&header, bytes.data(), sizeof header);
+
+    if (std::memcmp(header.magic, token_magic, sizeof header.magic) != 0)
+    {
+        return fail("not a token file");
+    }
+
+    if (header.byte_order != token_byte_order)
+    {
+        return fail("token file has the wrong byte order");
+    }
+
+    if (header.version != token_file_version)
+    {
+        return fail("unsupported token file version " + std::to_string(header.version));
+    }
+
+    size_t const n = header.tokens;
+    bool const has_offsets = header.flags & token_has_offsets;
+    size_t const kinds_at = sizeof(TokenFileHeader);
+    size_t const payloads_at = align4(kinds_at + n);
+    size_t const offsets_at = payloads_at + 4 * n;
+    size_t const ends_at = offsets_at + (has_offsets ? 4 * n : 0);
+    size_t const strings_at = ends_at + 4 * static_cast<size_t>(header.strings);
+
+    if (strings_at + header.string_bytes > bytes.size())
+    {
+        return fail("token file is truncated");
+    }
+
+    TokenView view;
+    char const* const base = bytes.data();
+    view._size = n;
+    view._kinds = reinterpret_cast<uint8_t const*>(base + kinds_at);
+    view._payloads = reinterpret_cast<uint32_t const*>(base + payloads_at);
+    view._offsets = has_offsets ? reinterpret_cast<uint32_t const*>(base + offsets_at) : nullptr;
+
+    uint32_t const* const ends = reinterpret_cast<uint32_t const*>(base + ends_at);
+    view._names.reserve(header.strings);
+    uint32_t begin = 0;
+
+    for (uint32_t i = 0; i < header.strings; ++i)
+    {
+        if (ends[i] < begin || ends[i] > header.string_bytes)
+        {
+            return fail("token file string table is corrupt");
+        }
+
+        view._names.push_back(VarTok{string(base + strings_at + begin, ends[i] - begin)});
+        begin = ends[i];
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (view._kinds[i] >= tok_kind_count)
+        {
+            return fail("bad token kind at token " + std::to_string(i));
+        }
+
+        if (view._kinds[i] == tok_kind<VarTok> && view._payloads[i] >= header.strings)
+        {
+            return fail("bad string index at token " + std::to_string(i));
+        }
+    }
+
+    return view;
+}
+
+//// FILES ////
+
+bool write_token_file(string const& path, vector<Tok> const& tokens, 
+    vector<uint32_t> const* offsets, string* error)
+{
+    optional<string> const bytes = encode_tokens(tokens, offsets, error);
+
+    if (!bytes)
+    {
+        return false;
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes->data(), static_cast<std::streamsize>(bytes->size()));
+
+    if (!out)
+    {
+        if (error)
+        {
+            *error = "cannot write " + path;
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+TokenFile::TokenFile(void* data, size_t size, TokenView view)
+    : _data(data)
+    , _size(size)
+    , _view(std::move(view))
+{}
+
+TokenFile::~TokenFile()
+{
+    munmap(_data, _size);
+}
+
+TokenView const& TokenFile::view() const
+{
+    return _view;
+}
+
+unique_ptr<TokenFile> TokenFile::open(string const& path, string* error)
+{
+    auto const fail = [&](string message) -> unique_ptr<TokenFile>
+    {
+        if (error)
+        {
+            *error = path + ": " + message;
+        }
+
+        return nullptr;
+    };
+
+    int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return fail(std::strerror(errno));
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+    {
+        int const e = errno;
+        ::close(fd);
+        return fail(std::strerror(e));
+    }
+
+    if (st.st_size == 0)
+    {
+        ::close(fd);
+        return fail("empty file");
+    }
+
+    size_t const size = static_cast<size_t>(st.st_size);
+    void* const data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return fail(std::strerror(errno));
+    }
+
+    string message;
+    optional<TokenView> view = decode_tokens(string_view(static_cast<char const*>(data), size), &message);
+
+    if (!view)
+    {
+        munmap(data, size);
+        return fail(message);
+    }
+
+    return unique_ptr<TokenFile>(new TokenFile(data, size, std::move(*view)));
+}
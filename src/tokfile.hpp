@@ -0,0 +1,101 @@
+#pragma once
+
+#include "tokens.hpp"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+using std::optional;
+using std::string_view;
+using std::unique_ptr;
+
+// Binary token format, read in place (e.g. from an mmap) without building a
+// vector<Tok>. All fields are native-endian; byte_order tells a reader
+// whether it can use the file. Sections follow the header, each starting on
+// a 4-byte boundary:
+//
+//   uint8_t  kinds[tokens]         tok_kind of each token
+//   uint32_t payloads[tokens]      NumTok value, VarTok string index, else 0
+//   uint32_t offsets[tokens]       byte offsets in the source (if flagged)
+//   uint32_t string_ends[strings]  end of each string in the bytes below
+//   char     string_bytes[string_bytes]
+//
+// Identifiers are deduplicated: each distinct name is stored once.
+struct TokenFileHeader
+{
+    char     magic[8];     // "PRSTOKS\0"
+    uint32_t version;
+    uint32_t byte_order;   // token_byte_order as written.
+    uint32_t tokens;
+    uint32_t strings;
+    uint32_t string_bytes;
+    uint32_t flags;
+};
+
+uint32_t const token_file_version = 1;
+uint32_t const token_byte_order   = 0x01020304;
+uint32_t const token_has_offsets  = 1;
+
+// Tokens of an encoded buffer, read in place: the buffer must outlive the
+// view. Only the distinct identifiers are materialized, once each, so that
+// ParseState can hand out VarTok pointers.
+class TokenView
+{
+    public:
+        size_t size() const;
+        size_t kind(size_t i) const;
+        uint32_t payload(size_t i) const;
+        VarTok const& name(uint32_t index) const;
+
+        // One tok_kind per token, as stored.
+        uint8_t const* kinds() const;
+
+        // Byte offsets in the source, or nullptr if none were stored.
+        uint32_t const* offsets() const;
+
+        // Builds the token; allocates for a VarTok.
+        Tok tok(size_t i) const;
+        vector<Tok> to_tokens() const;
+
+    private:
+        friend optional<TokenView> decode_tokens(string_view, string*);
+
+        uint8_t const*  _kinds    = nullptr;
+        uint32_t const* _payloads = nullptr;
+        uint32_t const* _offsets  = nullptr;
+        size_t          _size     = 0;
+        vector<VarTok>  _names;
+};
+
+// Encodes tokens, with their source byte offsets if given one per token.
+// Fails past UINT32_MAX tokens or string bytes, which the header cannot count.
+optional<string> encode_tokens(vector<Tok> const&, vector<uint32_t> const* offsets = nullptr,
+    string* error = nullptr);
+
+// Validates the buffer and views it. The buffer must be 4-byte aligned, or
+// decoding fails.
+optional<TokenView> decode_tokens(string_view bytes, string* error = nullptr);
+
+bool write_token_file(string const& path, vector<Tok> const&, 
+    vector<uint32_t> const* offsets = nullptr, string* error = nullptr);
+
+// A token file mapped read-only.
+class TokenFile
+{
+    public:
+        static unique_ptr<TokenFile> open(string const& path, string* error = nullptr);
+        ~TokenFile();
+
+        TokenFile(TokenFile const&) = delete;
+        TokenFile& operator=(TokenFile const&) = delete;
+
+        TokenView const& view() const;
+
+    private:
+        void*     _data;
+        size_t    _size;
+        TokenView _view;
+
+        TokenFile(void* data, size_t size, TokenView view);
+};
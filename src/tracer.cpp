@@ -1,5 +1,5 @@
 #include "tracer.hpp"
-#include <iostream>
+#include <ostream>
 
 string to_string(TraceResult t)
 {
@@ -14,10 +14,12 @@ string to_string(TraceResult t)
     std::abort();
 }
 
-Tracer::Trace::Trace(string const& _name, Trace* _parent, unsigned _depth)
-    : name(_name)
+Tracer::Trace::Trace(string const& _name, Trace* _parent, unsigned _depth, 
+    std::pmr::memory_resource* memory)
+    : name(_name, memory)
     , depth(_depth)
     , parent(_parent)
+    , children(memory)
 {}
         
 string Tracer::indent(unsigned depth) const
@@ -48,7 +50,7 @@ void Tracer::finalize(Trace& t, bool flag)
     }
 }
 
-int Tracer::print(Trace const& t) const
+int Tracer::print(std::ostream& out, Trace const& t) const
 {
     int color = [&]()
     {
@@ -63,27 +65,27 @@ int Tracer::print(Trace const& t) const
         std::abort();
     }();
 
-    auto printColor = [](int c)
+    auto printColor = [&](int c)
     {
-        std::cout << "\033[" << c << "m";
+        out << "\033[" << c << "m";
     };
     
     printColor(color);
-    std::cout << indent(t.depth) << t.name << "\n";
+    out << indent(t.depth) << t.name << "\n";
     printColor(0);
 
     int count = 1;
 
     for (Trace const& c : t.children)
     {
-        count += print(c);
+        count += print(out, c);
     }
 
     return count;
 }
 
-Tracer::Tracer(string const& root_name, unsigned indent)
-    : _root(root_name, nullptr, 0)
+Tracer::Tracer(string const& root_name, unsigned indent, std::pmr::memory_resource* memory)
+    : _root(root_name, nullptr, 0, memory)
     , _cur(&_root)
     , _indent(indent)
 {}
@@ -91,7 +93,7 @@ Tracer::Tracer(string const& root_name, unsigned indent)
 void Tracer::push(string const& name)
 {
     _cur->children.push_back(
-        Trace(name, _cur, _cur->depth + 1)
+        Trace(name, _cur, _cur->depth + 1, _cur->children.get_allocator().resource())
         );
     _cur = &_cur->children.back();
 }
@@ -110,8 +112,8 @@ void Tracer::finalize()
     return finalize(_root, false);
 }
 
-void Tracer::print() const
+void Tracer::print(std::ostream& out) const
 {
-    int count = print(_root);
-    std::cout << indent(1) << count << " steps\n";
+    int count = print(out, _root);
+    out << indent(1) << count << " steps\n";
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <iosfwd>
+#include <memory_resource>
 #include <string>
 #include <vector>
 
@@ -17,22 +19,25 @@ enum class TraceResult
 class Tracer
 {
     public:
-        Tracer(string const& root_name, unsigned indent);
+        // Trace nodes and their labels are allocated from memory.
+        Tracer(string const& root_name, unsigned indent, 
+            std::pmr::memory_resource* memory = std::pmr::get_default_resource());
         void push(string const& label);
         void pop(TraceResult);
         void finalize();
-        void print() const;
+        void print(std::ostream&) const;
     
     private:
         struct Trace
         {
-            string        name;
-            unsigned      depth;
-            Trace*        parent;
-            vector<Trace> children;
-            TraceResult   result = TraceResult::undefined;
-
-            Trace(string const& name, Trace* parent, unsigned depth);
+            std::pmr::string        name;
+            unsigned                depth;
+            Trace*                  parent;
+            std::pmr::vector<Trace> children;
+            TraceResult             result = TraceResult::undefined;
+
+            Trace(string const& name, Trace* parent, unsigned depth, 
+                std::pmr::memory_resource*);
         };
 
     private:
@@ -42,7 +47,7 @@ class Tracer
 
         string indent(unsigned) const;
         void finalize(Trace&, bool);
-        int print(Trace const&) const;
+        int print(std::ostream&, Trace const&) const;
 };
 
 string to_string(TraceResult);
@@ -0,0 +1,285 @@
+#include "typecheck.hpp"
+#include "resolve.hpp"
+
+string to_string(TypeError const& e)
+{
+    return e.func + ": " + e.message;
+}
+
+class TypeChecker
+{
+    public:
+        TypeChecker(ASTFunc& func, TypeTable& types, vector<TypeError>& errors)
+            : _func(func)
+            , _types(types)
+            , _errors(errors)
+        {}
+
+        void run()
+        {
+            for (ResolveError const& e : resolve(_func))
+            {
+                error(e.message + " '" + e.name + "'", e.span);
+            }
+
+            _slots.assign(_func.num_slots, type_error);
+            declared(_func.ret_type, "return type", _func.span);
+
+            for (unsigned i = 0; i < _func.args.size(); ++i)
+            {
+                _slots[i] = declared(_func.args[i].type, "argument " + _func.args[i].name, _func.span);
+            }
+
+            stmt(*_func.body);
+        }
+
+    private:
+        ASTFunc&           _func;
+        TypeTable&         _types;
+        vector<TypeError>& _errors;
+        vector<TypeId>     _slots;
+
+        void error(string const& message, Span at)
+        {
+            _errors.push_back(TypeError{_func.name, message, at});
+        }
+
+        TypeId declared(string const& name, string const& what, Span at)
+        {
+            TypeId const t = _types.intern(name);
+
+            if (!_types.is_known(t))
+            {
+                error("unknown type '" + name + "' for " + what, at);
+                return type_error;
+            }
+
+            return t;
+        }
+
+        // Reports a mismatch unless either side is already an error. There are
+        // no float literals, so int widens to flt on initialization/assignment.
+        void expect(TypeId want, TypeId got, string const& what, Span at)
+        {
+            if (want == got || want == type_error || got == type_error)
+            {
+                return;
+            }
+
+            if (!(want == type_flt && got == type_int))
+            {
+                error(what + " expects " + _types.name(want) 
+                    + " but got " + _types.name(got), at);
+            }
+        }
+
+        TypeId slot_type(unsigned slot) const
+        {
+            return slot == no_slot ? type_error : _slots[slot];
+        }
+
+        void stmt(AST& ast)
+        {
+            switch (ast.kind())
+            {
+                case ASTKind::block:
+                    for (ASTPtr const& s : static_cast<ASTBlock&>(ast).stmts)
+                    {
+                        stmt(*s);
+                    }
+                    return;
+                case ASTKind::var_decl:
+                {
+                    auto& decl = static_cast<ASTVarDecl&>(ast);
+                    TypeId const t = declared(decl.type, "variable " + decl.name, decl.span);
+                    expect(t, exp(*decl.value), "declaration of " + decl.name, decl.span);
+
+                    if (decl.slot != no_slot)
+                    {
+                        _slots[decl.slot] = t;
+                    }
+                    return;
+                }
+                case ASTKind::assign:
+                {
+                    auto& assign = static_cast<ASTAssign&>(ast);
+                    expect(slot_type(assign.slot), exp(*assign.value), 
+                        "assignment to " + assign.name, assign.span);
+                    return;
+                }
+                case ASTKind::error:
+                    return; // Reported by the parser.
+                default:
+                    exp(ast);
+                    return;
+            }
+        }
+
+        // Post-order over an explicit stack, since operator chains can be
+        // deeper than the native one. An operator is pushed again, marked as
+        // expanded, beneath its operands and combines their types when it
+        // comes back up.
+        TypeId exp(AST& root)
+        {
+            vector<std::pair<AST*, bool>> pending{{&root, false}};
+            vector<TypeId> types;
+
+            while (!pending.empty())
+            {
+                auto const [ast, expanded] = pending.back();
+                pending.pop_back();
+
+                switch (ast->kind())
+                {
+                    case ASTKind::unop:
+                    {
+                        auto& unop = static_cast<ASTUnop&>(*ast);
+
+                        if (!expanded)
+                        {
+                            pending.push_back({ast, true});
+                            pending.push_back({unop.right.get(), false});
+                            break;
+                        }
+
+                        types.back() = unary(unop.op, types.back(), unop.span);
+                        break;
+                    }
+                    case ASTKind::binop:
+                    {
+                        auto& binop = static_cast<ASTBinop&>(*ast);
+
+                        if (!expanded)
+                        {
+                            pending.push_back({ast, true});
+                            pending.push_back({binop.right.get(), false});
+                            pending.push_back({binop.left.get(), false});
+                            break;
+                        }
+
+                        TypeId const r = types.back();
+                        types.pop_back();
+                        types.back() = binary(binop.op, types.back(), r, binop.span);
+                        break;
+                    }
+                    default:
+                        types.push_back(leaf(*ast));
+                        break;
+                }
+            }
+
+            return types.back();
+        }
+
+        TypeId leaf(AST& ast)
+        {
+            switch (ast.kind())
+            {
+                case ASTKind::num:
+                    return type_int;
+                case ASTKind::var:
+                    return slot_type(static_cast<ASTVar&>(ast).slot);
+                case ASTKind::error:
+                    return type_error;
+                default:
+                    error("statement used as an expression", ast.span);
+                    return type_error;
+            }
+        }
+
+        TypeId unary(Op op, TypeId t, Span at)
+        {
+            if (t == type_error)
+            {
+                return type_error;
+            }
+
+            bool const ok = op == Op::opNot ? t == type_bool : _types.is_numeric(t);
+
+            if (!ok)
+            {
+                error("operator '" + ::to_string(op) + "' cannot take " + _types.name(t), at);
+                return type_error;
+            }
+
+            return t;
+        }
+
+        TypeId binary(Op op, TypeId l, TypeId r, Span at)
+        {
+            if (l == type_error || r == type_error)
+            {
+                return type_error;
+            }
+
+            bool const logical = op == Op::opAnd || op == Op::opOr;
+            bool const ok = l == r 
+                && (logical ? l == type_bool : _types.is_numeric(l));
+
+            if (!ok)
+            {
+                error("operator '" + ::to_string(op) + "' cannot take " 
+                    + _types.name(l) + " and " + _types.name(r), at);
+                return type_error;
+            }
+
+            return l;
+        }
+};
+
+static vector<ASTFunc*> funcs_of(ASTPtr const& ast)
+{
+    vector<ASTFunc*> funcs;
+
+    if (ast->kind() == ASTKind::func)
+    {
+        funcs.push_back(static_cast<ASTFunc*>(ast.get()));
+    }
+    else if (ast->kind() == ASTKind::program)
+    {
+        for (ASTPtr const& decl : static_cast<ASTProgram&>(*ast).decls)
+        {
+            if (decl->kind() == ASTKind::func)
+            {
+                funcs.push_back(static_cast<ASTFunc*>(decl.get()));
+            }
+        }
+    }
+
+    return funcs;
+}
+
+vector<TypeError> typecheck(ASTPtr const& ast, TypeTable& types, ThreadPool& pool)
+{
+    vector<ASTFunc*> const funcs = funcs_of(ast);
+    vector<vector<TypeError>> per_func(funcs.size());
+
+    parallel_for(pool, funcs.size(), [&](size_t i)
+    {
+        TypeChecker(*funcs[i], types, per_func[i]).run();
+    });
+
+    vector<TypeError> errors;
+
+    for (vector<TypeError>& es : per_func)
+    {
+        errors.insert(errors.end(), 
+            std::make_move_iterator(es.begin()), 
+            std::make_move_iterator(es.end()));
+    }
+
+    return errors;
+}
+
+vector<TypeError> typecheck(ASTPtr const& ast)
+{
+    TypeTable types;
+    vector<TypeError> errors;
+
+    for (ASTFunc* func : funcs_of(ast))
+    {
+        TypeChecker(*func, types, errors).run();
+    }
+
+    return errors;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "ast.hpp"
+#include "threadpool.hpp"
+#include "types.hpp"
+
+struct TypeError
+{
+    string func;
+    string message;
+    Span   span; // Of the node that raised it.
+};
+
+string to_string(TypeError const&);
+
+// Resolves and type checks every ASTFunc of an ASTProgram (or a single
+// ASTFunc). Functions are checked concurrently on the caller's pool, or one
+// after another on the calling thread without one; diagnostics come back
+// grouped by function in declaration order.
+vector<TypeError> typecheck(ASTPtr const&, TypeTable&, ThreadPool&);
+vector<TypeError> typecheck(ASTPtr const&);
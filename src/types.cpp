@@ -0,0 +1,53 @@
+#include "types.hpp"
+#include <iterator>
+
+static char const* const builtin_names[] = {"<error>", "int", "flt", "bool"};
+
+TypeTable::TypeTable()
+    : _names(std::begin(builtin_names), std::end(builtin_names))
+{
+    for (TypeId id = 0; id < _names.size(); ++id)
+    {
+        _ids.insert({_names[id], id});
+    }
+}
+
+TypeId TypeTable::intern(string const& name)
+{
+    for (TypeId id = type_int; id <= type_bool; ++id)
+    {
+        if (name == builtin_names[id])
+        {
+            return id;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto const it = _ids.find(name);
+
+    if (it != _ids.end())
+    {
+        return it->second;
+    }
+
+    TypeId const id = static_cast<TypeId>(_names.size());
+    _names.push_back(name);
+    _ids.insert({name, id});
+    return id;
+}
+
+string TypeTable::name(TypeId id) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _names.at(id);
+}
+
+bool TypeTable::is_known(TypeId id) const
+{
+    return id == type_int || id == type_flt || id == type_bool;
+}
+
+bool TypeTable::is_numeric(TypeId id) const
+{
+    return id == type_int || id == type_flt;
+}
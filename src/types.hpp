@@ -1 +1,36 @@
 #pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+// Interned type name; two types are the same iff their ids are equal.
+using TypeId = unsigned;
+
+TypeId const type_error = 0; // Result of an ill-typed expression.
+TypeId const type_int   = 1;
+TypeId const type_flt   = 2;
+TypeId const type_bool  = 3;
+
+class TypeTable
+{
+    public:
+        TypeTable();
+
+        // Thread-safe. The built-in types are found without taking the
+        // lock; only other names, which are errors, are added under it.
+        TypeId intern(string const&);
+        string name(TypeId) const;
+        bool is_known(TypeId) const;
+        bool is_numeric(TypeId) const;
+
+    private:
+        mutable std::mutex             _mutex;
+        unordered_map<string, TypeId>  _ids;
+        vector<string>                 _names;
+};
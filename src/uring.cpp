@@ -0,0 +1,242 @@
+#include "uring.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <linux/io_uring.h>
+
+static unsigned* field(void* map, uint32_t offset)
+{
+    return reinterpret_cast<unsigned*>(static_cast<char*>(map) + offset);
+}
+
+// READ and WRITE came with the probe, in 5.6. Older kernels set a ring up
+// but fail every one of those operations with -EINVAL.
+static bool can_read_write(int fd)
+{
+    size_t const ops = 256;
+    alignas(io_uring_probe) unsigned char buffer[sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op)] = {};
+    auto* const probe = reinterpret_cast<io_uring_probe*>(buffer);
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, ops) < 0)
+    {
+        return false;
+    }
+
+    auto supported = [probe](uint8_t op)
+    {
+        return op < probe->ops_len && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    };
+
+    return supported(IORING_OP_READ) && supported(IORING_OP_WRITE);
+}
+
+Uring::~Uring()
+{
+    if (_sqes)
+    {
+        munmap(_sqes, _sqes_size);
+    }
+
+    if (_cq_map && _cq_map != _sq_map)
+    {
+        munmap(_cq_map, _cq_map_size);
+    }
+
+    if (_sq_map)
+    {
+        munmap(_sq_map, _sq_map_size);
+    }
+
+    if (_fd >= 0)
+    {
+        close(_fd);
+    }
+}
+
+bool Uring::init(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    long const fd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    _fd = static_cast<int>(fd);
+
+    if (!can_read_write(_fd))
+    {
+        return false;
+    }
+
+    _sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    // Newer kernels map both rings at once.
+    bool const single = params.features & IORING_FEAT_SINGLE_MMAP;
+
+    if (single)
+    {
+        _sq_map_size = _cq_map_size = std::max(_sq_map_size, _cq_map_size);
+    }
+
+    _sq_map = mmap(nullptr, _sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+
+    if (_sq_map == MAP_FAILED)
+    {
+        _sq_map = nullptr;
+        return false;
+    }
+
+    _cq_map = single ? _sq_map
+        : mmap(nullptr, _cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+
+    if (_cq_map == MAP_FAILED)
+    {
+        _cq_map = nullptr;
+        return false;
+    }
+
+    _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+
+    if (_sqes == MAP_FAILED)
+    {
+        _sqes = nullptr;
+        return false;
+    }
+
+    _sq_head = field(_sq_map, params.sq_off.head);
+    _sq_tail = field(_sq_map, params.sq_off.tail);
+    _sq_mask = field(_sq_map, params.sq_off.ring_mask);
+    _sq_entries = field(_sq_map, params.sq_off.ring_entries);
+    _sq_array = field(_sq_map, params.sq_off.array);
+    _cq_head = field(_cq_map, params.cq_off.head);
+    _cq_tail = field(_cq_map, params.cq_off.tail);
+    _cq_mask = field(_cq_map, params.cq_off.ring_mask);
+    _cqes = static_cast<char*>(_cq_map) + params.cq_off.cqes;
+    return true;
+}
+
+bool Uring::queue(uint8_t opcode, int fd, uint64_t address, size_t size, uint64_t offset, uint64_t user)
+{
+    // The kernel moves the head; only this thread moves the tail.
+    unsigned const tail = *_sq_tail;
+    unsigned const head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head == *_sq_entries)
+    {
+        return false;
+    }
+
+    unsigned const index = tail & *_sq_mask;
+    io_uring_sqe& sqe = static_cast<io_uring_sqe*>(_sqes)[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = address;
+    sqe.len = static_cast<uint32_t>(std::min<size_t>(size, INT_MAX)); // Short transfers are resubmitted.
+    sqe.off = offset;
+    sqe.user_data = user;
+
+    _sq_array[index] = index;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++_to_submit;
+    return true;
+}
+
+bool Uring::read(int fd, void* buffer, size_t size, uint64_t offset, uint64_t user)
+{
+    return queue(IORING_OP_READ, fd, reinterpret_cast<uintptr_t>(buffer), size, offset, user);
+}
+
+bool Uring::write(int fd, void const* buffer, size_t size, uint64_t offset, uint64_t user)
+{
+    return queue(IORING_OP_WRITE, fd, reinterpret_cast<uintptr_t>(buffer), size, offset, user);
+}
+
+bool Uring::submit(unsigned wait)
+{
+    while (true)
+    {
+        long const r = syscall(__NR_io_uring_enter, _fd, _to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+        if (r >= 0)
+        {
+            _to_submit -= static_cast<unsigned>(r);
+            _in_flight += static_cast<unsigned>(r);
+            return true;
+        }
+
+        if (errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+bool Uring::complete(uint64_t* user, int32_t* result)
+{
+    unsigned const head = *_cq_head;
+
+    if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    io_uring_cqe const& cqe = static_cast<io_uring_cqe const*>(_cqes)[head & *_cq_mask];
+    *user = cqe.user_data;
+    *result = cqe.res;
+    __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+    --_in_flight;
+    return true;
+}
+
+bool Uring::drain(uint64_t* user, int32_t* result)
+{
+    // Without SQPOLL the kernel only reads entries inside io_uring_enter(),
+    // so those not yet submitted can be taken back.
+    if (_to_submit)
+    {
+        __atomic_store_n(_sq_tail, *_sq_tail - _to_submit, __ATOMIC_RELEASE);
+        _to_submit = 0;
+    }
+
+    while (_in_flight)
+    {
+        if (complete(user, result))
+        {
+            return true;
+        }
+
+        long const r = syscall(__NR_io_uring_enter, _fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+        if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+#else
+
+Uring::~Uring() {}
+bool Uring::init(unsigned) { return false; }
+bool Uring::read(int, void*, size_t, uint64_t, uint64_t) { return false; }
+bool Uring::write(int, void const*, size_t, uint64_t, uint64_t) { return false; }
+bool Uring::submit(unsigned) { return false; }
+bool Uring::complete(uint64_t*, int32_t*) { return false; }
+bool Uring::drain(uint64_t*, int32_t*) { return false; }
+
+#endif
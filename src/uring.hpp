@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Just enough io_uring for whole-file reads and writes, through the raw
+// system calls, so there is nothing to link. One thread owns a ring.
+class Uring
+{
+    public:
+        Uring() = default;
+        ~Uring();
+
+        Uring(Uring const&) = delete;
+        Uring& operator=(Uring const&) = delete;
+
+        // False where io_uring is missing or forbidden, or cannot read and
+        // write; callers fall back to blocking I/O on threads.
+        bool init(unsigned entries);
+
+        // Queue an operation; false if the submission ring is full.
+        bool read(int fd, void* buffer, size_t size, uint64_t offset, uint64_t user);
+        bool write(int fd, void const* buffer, size_t size, uint64_t offset, uint64_t user);
+
+        // Submits what is queued and waits until at least wait completions
+        // are ready; false on an error.
+        bool submit(unsigned wait = 0);
+
+        // Takes one completion: the user value given when queueing and the
+        // result, a byte count or -errno.
+        bool complete(uint64_t* user, int32_t* result);
+
+        // After a failed submit: drops what is queued but not yet submitted,
+        // then waits for and takes the completions of what was, one at a
+        // time. False once nothing is in flight, or if waiting fails; then
+        // in_flight() stays nonzero and the buffers of those operations may
+        // still be written to.
+        bool drain(uint64_t* user, int32_t* result);
+
+        // Submitted, and not yet taken by complete() or drain().
+        unsigned in_flight() const { return _in_flight; }
+
+    private:
+        int       _fd = -1;
+        void*     _sq_map = nullptr;
+        size_t    _sq_map_size = 0;
+        void*     _cq_map = nullptr;
+        size_t    _cq_map_size = 0;
+        void*     _sqes = nullptr;
+        size_t    _sqes_size = 0;
+
+        unsigned* _sq_head;
+        unsigned* _sq_tail;
+        unsigned* _sq_mask;
+        unsigned* _sq_entries;
+        unsigned* _sq_array;
+        unsigned* _cq_head;
+        unsigned* _cq_tail;
+        unsigned* _cq_mask;
+        void*     _cqes;
+        unsigned  _to_submit = 0;
+        unsigned  _in_flight = 0;
+
+        bool queue(uint8_t opcode, int fd, uint64_t address, size_t size, uint64_t offset, uint64_t user);
+};
@@ -0,0 +1,560 @@
+#include "gen.hpp"
+#include "grammar.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "prescan.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <sstream>
+
+using namespace std;
+
+// Searches for inputs that make the parser do the most work per token and
+// keeps the worst as a regression corpus. Each corpus file is source text
+// headed by the step budget it must parse within:
+//
+//     // prs_fuzz: 40 tokens, 812 steps, 95 rewinds
+//     // budget: 1031
+//     int f ( ( ( a ...
+//
+// Inputs are parsed with recovery on, so malformed ones still run to the end
+// and the recovery rules are searched too.
+//
+// check first compares the rules grammar() describes with those the parser
+// TRACEs. Both modes also hold the prescan to its promise: its tables are read off
+// grammar(), a hand copy of parser.cpp, so where the two drift apart it turns
+// away programs the parser accepts. check replays generated programs as well,
+// since few corpus inputs parse without recovery.
+
+static int usage()
+{
+    cerr << "usage: prs_fuzz search <corpus-dir> [iterations] [seed] [max-tokens]\n"
+            "       prs_fuzz check <file>...\n";
+    return 2;
+}
+
+struct Cost
+{
+    uint64_t steps   = 0;
+    uint64_t rewinds = 0;
+    size_t   tokens  = 0;
+    bool     halted  = false; // Hit the search cap.
+
+    // Steps and rewinds per token; what the search maximizes.
+    double score() const
+    {
+        return static_cast<double>(steps + rewinds) / static_cast<double>(max<size_t>(tokens, 1));
+    }
+};
+
+static Cost measure(vector<Tok> const& tokens, uint64_t max_steps, RuleProfile* profile = nullptr)
+{
+    ParseStats stats;
+    ParseOptions opts;
+    opts.recover = true;
+    opts.stats = &stats;
+    opts.max_steps = max_steps;
+    opts.profile = profile;
+
+    parse(tokens, opts);
+
+    Cost cost;
+    cost.steps = stats.steps;
+    cost.rewinds = stats.rewinds;
+    cost.tokens = tokens.size();
+    cost.halted = max_steps && stats.steps > max_steps;
+    return cost;
+}
+
+// True unless the parser accepts the tokens without recovery and the
+// prescan rejects them.
+static bool prescan_agrees(vector<Tok> const& tokens, uint64_t max_steps, ParseError* error)
+{
+    ParseOptions opts;
+    opts.max_steps = max_steps;
+
+    if (!parse(tokens, opts))
+    {
+        return true;
+    }
+
+    vector<uint8_t> const kinds = token_kinds(tokens);
+    return prescan(kinds.data(), kinds.size(), nullptr, error);
+}
+
+// Room for harmless grammar changes; a blowup still goes well past it.
+static uint64_t budget_for(Cost const& cost)
+{
+    return cost.steps + cost.steps / 4 + 16;
+}
+
+static unsigned log2_bucket(uint64_t n)
+{
+    unsigned b = 0;
+
+    while (n)
+    {
+        n >>= 1;
+        ++b;
+    }
+
+    return b;
+}
+
+// Coverage features, AFL style: each rule with its call and repeat counts
+// bucketed by powers of two.
+static vector<uint64_t> features(RuleProfile const& profile)
+{
+    vector<uint64_t> out;
+
+    for (size_t rule = 0; rule < profile.rules.size(); ++rule)
+    {
+        RuleProfile::Counts const& c = profile.rules[rule];
+
+        if (c.calls)
+        {
+            out.push_back(rule << 16 | log2_bucket(c.calls));
+            out.push_back(rule << 16 | 0x100 | log2_bucket(c.repeats));
+        }
+    }
+
+    return out;
+}
+
+class Fuzzer
+{
+    public:
+        Fuzzer(unsigned seed, size_t max_tokens)
+            : _rng(seed)
+            , _max_tokens(max_tokens)
+        {}
+
+        struct Input
+        {
+            vector<Tok> tokens;
+            Cost        cost;
+        };
+
+        void seed(vector<Tok> tokens)
+        {
+            if (tokens.size() > _max_tokens)
+            {
+                tokens.resize(_max_tokens);
+            }
+
+            consider(std::move(tokens));
+        }
+
+        void run(unsigned iterations)
+        {
+            for (unsigned i = 0; i < iterations; ++i)
+            {
+                vector<Tok> tokens = _pool[below(_pool.size())].tokens;
+                size_t const rounds = 1 + below(4);
+
+                for (size_t r = 0; r < rounds; ++r)
+                {
+                    mutate(tokens);
+                }
+
+                if (tokens.size() > _max_tokens)
+                {
+                    tokens.resize(_max_tokens);
+                }
+
+                consider(std::move(tokens));
+            }
+        }
+
+        // Worst first; at most one input per token count, so a single shape
+        // at growing lengths does not crowd out the rest.
+        vector<Input> worst(size_t count, size_t min_tokens) const
+        {
+            vector<Input> sorted;
+
+            for (Input const& in : _pool)
+            {
+                if (in.tokens.size() >= min_tokens)
+                {
+                    sorted.push_back(in);
+                }
+            }
+
+            sort(sorted.begin(), sorted.end(), [](Input const& a, Input const& b)
+            {
+                return a.cost.score() > b.cost.score();
+            });
+
+            vector<Input> out;
+            set<size_t> lengths;
+
+            for (Input& in : sorted)
+            {
+                if (out.size() < count && lengths.insert(in.tokens.size()).second)
+                {
+                    out.push_back(std::move(in));
+                }
+            }
+
+            return out;
+        }
+
+        // Inputs the parser accepted and the prescan rejected.
+        vector<vector<Tok>> const& disagreements() const { return _disagreements; }
+
+        size_t pool_size() const { return _pool.size(); }
+        size_t feature_count() const { return _features.size(); }
+
+    private:
+        std::mt19937     _rng;
+        size_t           _max_tokens;
+        vector<Input>    _pool;
+        set<uint64_t>    _features;
+        set<string>      _seen;
+        double           _best = 0;
+        vector<vector<Tok>> _disagreements;
+
+        static constexpr uint64_t steps_per_token_cap = 4096;
+
+        size_t below(size_t n)
+        {
+            return n ? uniform_int_distribution<size_t>(0, n - 1)(_rng) : 0;
+        }
+
+        // Kept if it reaches new coverage or is the costliest yet.
+        void consider(vector<Tok> tokens)
+        {
+            if (!_seen.insert(to_string(tokens)).second)
+            {
+                return;
+            }
+
+            RuleProfile profile;
+            uint64_t const cap = steps_per_token_cap * (tokens.size() + 1);
+            Cost const cost = measure(tokens, cap, &profile);
+            bool interesting = cost.score() > _best;
+
+            if (!prescan_agrees(tokens, cap, nullptr))
+            {
+                _disagreements.push_back(tokens);
+            }
+
+            for (uint64_t f : features(profile))
+            {
+                interesting |= _features.insert(f).second;
+            }
+
+            if (interesting)
+            {
+                _best = max(_best, cost.score());
+                _pool.push_back({std::move(tokens), cost});
+            }
+        }
+
+        Tok random_token()
+        {
+            static Tok const alphabet[] =
+            {
+                NumTok{0}, NumTok{1}, NumTok{7},
+                VarTok{"int"}, VarTok{"a"}, VarTok{"b"},
+                LParTok{}, RParTok{}, LBraceTok{}, RBraceTok{},
+                CommaTok{}, SemiTok{}, AssignTok{},
+                AddTok{}, SubTok{}, MulTok{}, DivTok{},
+                AndTok{}, OrTok{}, NotTok{},
+            };
+
+            return alphabet[below(size(alphabet))];
+        }
+
+        void mutate(vector<Tok>& t)
+        {
+            size_t const n = t.size();
+
+            switch (below(n ? 7 : 1))
+            {
+                case 0: // Insert.
+                    t.insert(t.begin() + static_cast<ptrdiff_t>(below(n + 1)), random_token());
+                    break;
+
+                case 1: // Replace.
+                    t[below(n)] = random_token();
+                    break;
+
+                case 2: // Erase.
+                    t.erase(t.begin() + static_cast<ptrdiff_t>(below(n)));
+                    break;
+
+                case 3: // Repeat a span in place.
+                {
+                    size_t const at = below(n);
+                    size_t const len = 1 + below(min<size_t>(8, n - at));
+                    vector<Tok> const span(t.begin() + static_cast<ptrdiff_t>(at),
+                                           t.begin() + static_cast<ptrdiff_t>(at + len));
+                    t.insert(t.begin() + static_cast<ptrdiff_t>(at), span.begin(), span.end());
+                    break;
+                }
+
+                case 4: // Wrap a span in parens.
+                {
+                    size_t const at = below(n);
+                    size_t const end = at + 1 + below(n - at);
+                    t.insert(t.begin() + static_cast<ptrdiff_t>(end), RParTok{});
+                    t.insert(t.begin() + static_cast<ptrdiff_t>(at), LParTok{});
+                    break;
+                }
+
+                case 5: // Open a run of parens, unbalanced.
+                {
+                    size_t const at = below(n + 1);
+                    t.insert(t.begin() + static_cast<ptrdiff_t>(at), 1 + below(8), LParTok{});
+                    break;
+                }
+
+                case 6: // Splice in a span of another input.
+                {
+                    vector<Tok> const& other = _pool[below(_pool.size())].tokens;
+
+                    if (!other.empty())
+                    {
+                        size_t const from = below(other.size());
+                        size_t const len = 1 + below(min<size_t>(16, other.size() - from));
+                        t.insert(t.begin() + static_cast<ptrdiff_t>(below(n + 1)),
+                                 other.begin() + static_cast<ptrdiff_t>(from),
+                                 other.begin() + static_cast<ptrdiff_t>(from + len));
+                    }
+
+                    break;
+                }
+            }
+        }
+};
+
+static string wrap(vector<Tok> const& tokens)
+{
+    string text;
+    size_t line = 0;
+
+    for (Tok const& tok : tokens)
+    {
+        string const s = to_string(tok);
+
+        if (line && line + 1 + s.size() > 78)
+        {
+            text += "\n";
+            line = 0;
+        }
+        else if (line)
+        {
+            text += " ";
+            ++line;
+        }
+
+        text += s;
+        line += s.size();
+    }
+
+    return text + "\n";
+}
+
+static int search(string const& dir, unsigned iterations, unsigned seed, size_t max_tokens)
+{
+    Fuzzer fuzzer(seed, max_tokens);
+    GenOptions gen;
+    gen.seed = seed;
+    gen.functions = 1;
+    gen.max_stmts = 3;
+
+    fuzzer.seed({});
+    fuzzer.seed(generate_program(gen));
+    fuzzer.seed(generate_deep_parens(4));
+    fuzzer.seed(generate_operator_chain(8));
+    fuzzer.run(iterations);
+
+    cerr << fuzzer.pool_size() << " inputs kept, " << fuzzer.feature_count() << " features\n";
+
+    for (vector<Tok> const& tokens : fuzzer.disagreements())
+    {
+        cerr << "prescan rejects a program the parser accepts:\n" << wrap(tokens);
+    }
+
+    std::error_code ec;
+    filesystem::create_directories(dir, ec);
+
+    if (ec)
+    {
+        cerr << dir << ": " << ec.message() << "\n";
+        return 1;
+    }
+
+    unsigned n = 0;
+
+    for (Fuzzer::Input const& in : fuzzer.worst(8, 8))
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "seed%u-%02u.prs", seed, n++);
+        string const path = (filesystem::path(dir) / name).string();
+        ofstream out(path);
+
+        out << "// prs_fuzz: " << in.cost.tokens << " tokens, " << in.cost.steps << " steps, "
+            << in.cost.rewinds << " rewinds\n"
+            << "// budget: " << budget_for(in.cost) << "\n"
+            << wrap(in.tokens);
+
+        if (!out)
+        {
+            cerr << path << ": cannot write\n";
+            return 1;
+        }
+
+        cout << path << ": " << in.cost.score() << " steps+rewinds/token"
+             << (in.cost.halted ? ", hit the search cap" : "") << "\n";
+    }
+
+    return fuzzer.disagreements().empty() ? 0 : 1;
+}
+
+static bool check(string const& path)
+{
+    ifstream file(path);
+    stringstream text;
+    text << file.rdbuf();
+
+    if (!file)
+    {
+        cerr << path << ": cannot read\n";
+        return false;
+    }
+
+    string const source = text.str();
+    size_t const at = source.find("// budget: ");
+    uint64_t const budget = at == string::npos ? 0 : strtoull(source.c_str() + at + 11, nullptr, 10);
+
+    if (!budget)
+    {
+        cerr << path << ": no budget line\n";
+        return false;
+    }
+
+    LexError lex_error;
+    optional<vector<Tok>> tokens = lex(source, nullptr, &lex_error);
+
+    if (!tokens)
+    {
+        cerr << path << ": " << to_string(lex_error) << "\n";
+        return false;
+    }
+
+    Cost const cost = measure(*tokens, budget);
+    bool const ok = !cost.halted;
+
+    cout << path << ": " << cost.steps << (ok ? "" : "+") << " of " << budget << " steps"
+         << (ok ? "" : ", over budget") << "\n";
+
+    ParseError error;
+
+    if (!prescan_agrees(*tokens, budget, &error))
+    {
+        cerr << path << ": parses, but the prescan rejects it at " << to_string(error) << "\n";
+        return false;
+    }
+
+    return ok;
+}
+
+// grammar() feeds the memo plan and the prescan, so it must name the same
+// rules as the parser.
+static bool check_rules()
+{
+    vector<string> const problems = check_grammar();
+
+    for (string const& p : problems)
+    {
+        cerr << "grammar drift: " << p << "\n";
+    }
+
+    cout << "grammar(): " << (problems.empty() ? "matches" : "differs from") << " the parser's rules\n";
+    return problems.empty();
+}
+
+// Well-formed programs of every shape gen.hpp makes, which the prescan must
+// all let through.
+static bool check_generated()
+{
+    vector<vector<Tok>> programs;
+
+    for (unsigned seed = 1; seed <= 256; ++seed)
+    {
+        GenOptions gen;
+        gen.seed = seed;
+        gen.functions = 1 + seed % 3;
+        gen.max_stmts = 1 + seed % 6;
+        gen.max_args = seed % 4;
+        programs.push_back(generate_program(gen));
+    }
+
+    for (unsigned n = 1; n <= 32; ++n)
+    {
+        programs.push_back(generate_deep_parens(n));
+        programs.push_back(generate_operator_chain(n));
+    }
+
+    bool ok = true;
+
+    for (vector<Tok> const& tokens : programs)
+    {
+        ParseError error;
+
+        if (!parse(tokens))
+        {
+            cerr << "parser rejects a generated program:\n" << wrap(tokens);
+            ok = false;
+        }
+        else if (!prescan_agrees(tokens, 0, &error))
+        {
+            cerr << "prescan rejects a generated program at " << to_string(error) << ":\n" 
+                 << wrap(tokens);
+            ok = false;
+        }
+    }
+
+    cout << programs.size() << " generated programs: prescan " 
+         << (ok ? "agrees" : "disagrees") << " with the parser\n";
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    vector<string> const args(argv + 1, argv + argc);
+
+    if (args.size() >= 2 && args.size() <= 5 && args[0] == "search")
+    {
+        unsigned const iterations = args.size() > 2 ? static_cast<unsigned>(stoul(args[2])) : 20000;
+        unsigned const seed = args.size() > 3 ? static_cast<unsigned>(stoul(args[3])) : 1;
+        size_t const max_tokens = args.size() > 4 ? stoul(args[4]) : 64;
+        return search(args[1], iterations, seed, max_tokens);
+    }
+
+    if (args.size() >= 2 && args[0] == "check")
+    {
+        // The prescan reads grammar(), which may not even be analyzable.
+        if (!check_rules())
+        {
+            return 1;
+        }
+
+        bool ok = check_generated();
+
+        for (size_t i = 1; i < args.size(); ++i)
+        {
+            ok &= check(args[i]);
+        }
+
+        return ok ? 0 : 1;
+    }
+
+    return usage();
+}
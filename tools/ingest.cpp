@@ -0,0 +1,55 @@
+#include "pipeline.hpp"
+#include <iostream>
+
+using namespace std;
+
+static int usage()
+{
+    cerr << "usage: prs_ingest [-o <dir>] [-l <lex threads>] [-p <parse threads>] [--no-uring] <file>...\n";
+    return 2;
+}
+
+int main(int argc, char** argv)
+{
+    vector<string> const args(argv + 1, argv + argc);
+    PipelineOptions opts;
+
+    for (size_t i = 0; i < args.size(); ++i)
+    {
+        bool const has_value = i + 1 < args.size();
+
+        if (args[i] == "-o" && has_value)
+        {
+            opts.output_dir = args[++i];
+        }
+        else if (args[i] == "-l" && has_value)
+        {
+            opts.lex_threads = static_cast<unsigned>(stoul(args[++i]));
+        }
+        else if (args[i] == "-p" && has_value)
+        {
+            opts.parse_threads = static_cast<unsigned>(stoul(args[++i]));
+        }
+        else if (args[i] == "--no-uring")
+        {
+            opts.use_io_uring = false;
+        }
+        else if (!args[i].empty() && args[i][0] == '-')
+        {
+            return usage();
+        }
+        else
+        {
+            opts.inputs.push_back(args[i]);
+        }
+    }
+
+    if (opts.inputs.empty())
+    {
+        return usage();
+    }
+
+    PipelineStats const stats = run_pipeline(opts);
+    cerr << to_string(stats);
+    return stats.failed || !stats.unwritten.empty() ? 1 : 0;
+}
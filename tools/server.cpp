@@ -0,0 +1,142 @@
+#include "server.hpp"
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+static int usage()
+{
+    cerr << "usage: prs_server serve [--root <dir>] <socket> [threads]\n"
+            "       prs_server send <socket> <file>...\n"
+            "       prs_server stats <socket>\n";
+    return 2;
+}
+
+static ParseServer* g_server = nullptr;
+
+static void on_signal(int)
+{
+    g_server->stop();
+}
+
+// Path requests are refused unless a root is given.
+static int serve(string const& socket, unsigned threads, string const& root)
+{
+    ServerOptions opts;
+    opts.socket_path = socket;
+    opts.threads = threads;
+    opts.root = root;
+
+    ParseServer server(opts);
+    string error;
+
+    if (!server.start(&error))
+    {
+        cerr << error << "\n";
+        return 1;
+    }
+
+    g_server = &server;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    server.run();
+    cerr << to_string(server.stats()) << "\n";
+    return 0;
+}
+
+// Sends each file's contents over one connection: a .tok file as tokens,
+// anything else as text.
+static int send(string const& socket, vector<string> const& files)
+{
+    string error;
+    unique_ptr<ParseClient> client = ParseClient::connect(socket, &error);
+
+    if (!client)
+    {
+        cerr << error << "\n";
+        return 1;
+    }
+
+    int status = 0;
+
+    for (string const& path : files)
+    {
+        ifstream file(path, ios::binary);
+        stringstream text;
+        text << file.rdbuf();
+
+        if (!file)
+        {
+            cerr << path << ": cannot read\n";
+            status = 1;
+            continue;
+        }
+
+        bool const is_tok = path.size() > 4 && path.compare(path.size() - 4, 4, ".tok") == 0;
+        optional<ServerReply> reply = client->request(
+            is_tok ? ServerRequest::tokens : ServerRequest::text, text.str(), &error);
+
+        if (!reply)
+        {
+            cerr << error << "\n";
+            return 1;
+        }
+
+        cout << path << ":\n" << reply->body;
+
+        if (reply->status != ServerStatus::ok)
+        {
+            status = 1;
+        }
+    }
+
+    return status;
+}
+
+static int stats(string const& socket)
+{
+    string error;
+    unique_ptr<ParseClient> client = ParseClient::connect(socket, &error);
+    optional<ServerReply> reply;
+
+    if (!client || !(reply = client->request(ServerRequest::stats, "", &error)))
+    {
+        cerr << error << "\n";
+        return 1;
+    }
+
+    cout << reply->body;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    vector<string> args(argv + 1, argv + argc);
+    string root;
+
+    if (args.size() >= 3 && args[0] == "serve" && args[1] == "--root")
+    {
+        root = args[2];
+        args.erase(args.begin() + 1, args.begin() + 3);
+    }
+
+    if ((args.size() == 2 || args.size() == 3) && args[0] == "serve")
+    {
+        return serve(args[1], args.size() == 3 ? static_cast<unsigned>(stoul(args[2])) : 0, root);
+    }
+
+    if (args.size() >= 3 && args[0] == "send")
+    {
+        return send(args[1], vector<string>(args.begin() + 2, args.end()));
+    }
+
+    if (args.size() == 2 && args[0] == "stats")
+    {
+        return stats(args[1]);
+    }
+
+    return usage();
+}
@@ -0,0 +1,137 @@
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "tokfile.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+static int usage()
+{
+    cerr << "usage: prs_tokconv encode <source> <out.tok>\n"
+            "       prs_tokconv dump <in.tok>\n"
+            "       prs_tokconv parse <in.tok>\n";
+    return 2;
+}
+
+static int encode(string const& in, string const& out)
+{
+    ifstream file(in, ios::binary);
+
+    if (!file)
+    {
+        cerr << in << ": cannot read\n";
+        return 1;
+    }
+
+    stringstream text;
+    text << file.rdbuf();
+
+    vector<uint32_t> offsets;
+    LexError lex_error;
+    optional<vector<Tok>> tokens = lex(text.str(), &offsets, &lex_error);
+
+    if (!tokens)
+    {
+        cerr << in << ": " << to_string(lex_error) << "\n";
+        return 1;
+    }
+
+    string error;
+
+    if (!write_token_file(out, *tokens, &offsets, &error))
+    {
+        cerr << error << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+static int dump(string const& in)
+{
+    string error;
+    unique_ptr<TokenFile> file = TokenFile::open(in, &error);
+
+    if (!file)
+    {
+        cerr << error << "\n";
+        return 1;
+    }
+
+    TokenView const& view = file->view();
+
+    for (size_t i = 0; i < view.size(); ++i)
+    {
+        cout << (i ? " " : "") << to_string(view.tok(i));
+    }
+
+    cout << "\n";
+    return 0;
+}
+
+static int parse(string const& in)
+{
+    string error;
+    unique_ptr<TokenFile> file = TokenFile::open(in, &error);
+
+    if (!file)
+    {
+        cerr << error << "\n";
+        return 1;
+    }
+
+    TokenView const& view = file->view();
+    vector<ParseError> errors;
+    ParseOptions opts;
+    opts.errors = &errors;
+    opts.recover = true;
+
+    Parsed<ASTPtr> r = parse(view, opts);
+
+    for (ParseError const& e : errors)
+    {
+        cout << in << ": ";
+
+        if (view.offsets() && e.pos < view.size())
+        {
+            cout << "byte " << view.offsets()[e.pos] << ": " << e.message << "\n";
+        }
+        else
+        {
+            cout << to_string(e) << "\n";
+        }
+    }
+
+    if (!r)
+    {
+        return 1;
+    }
+
+    auto const& program = static_cast<ASTProgram const&>(*get<0>(*r));
+    cout << program.decls.size() << " declarations\n";
+    return errors.empty() ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    vector<string> const args(argv + 1, argv + argc);
+
+    if (args.size() == 3 && args[0] == "encode")
+    {
+        return encode(args[1], args[2]);
+    }
+
+    if (args.size() == 2 && args[0] == "dump")
+    {
+        return dump(args[1]);
+    }
+
+    if (args.size() == 2 && args[0] == "parse")
+    {
+        return parse(args[1]);
+    }
+
+    return usage();
+}